@@ -501,6 +501,7 @@ void App::constructTracer()
 	// fetch vertex and triangle data ----->
 	m_rtVertices.clear();
 	m_rtVertices.reserve( m_mesh->numVertices() );
+	m_rtNormals.clear();
 	m_rtTriangles.clear();
 	m_rtTriangles.reserve( m_mesh->numTriangles() );
 	m_rtMap.clear();
@@ -510,6 +511,13 @@ void App::constructTracer()
 		Vec3f p = m_mesh->getVertexAttrib( i, FW::MeshBase::AttribType_Position ).getXYZ();
 		m_rtVertices.push_back( p );
 	}
+	int normalAttrib = m_mesh->findAttrib( FW::MeshBase::AttribType_Normal );
+	if ( normalAttrib != -1 )
+	{
+		m_rtNormals.reserve( m_mesh->numVertices() );
+		for ( int i = 0; i < m_mesh->numVertices(); ++i )
+			m_rtNormals.push_back( m_mesh->getVertexAttrib( i, normalAttrib ).getXYZ() );
+	}
 	for ( int i = 0; i < m_mesh->numSubmeshes(); ++i )
 	{
 		const Array<Vec3i>& idx = m_mesh->indices( i );
@@ -525,6 +533,9 @@ void App::constructTracer()
 			t.m_vertices[0] = &m_rtVertices[0] + idx[j][0];
 			t.m_vertices[1] = &m_rtVertices[0] + idx[j][1];
 			t.m_vertices[2] = &m_rtVertices[0] + idx[j][2];
+			for ( int k = 0; k < 3; ++k )
+				t.m_vertexNormals[k] = m_rtNormals.empty() ? NULL : &m_rtNormals[0] + idx[j][k];
+			t.m_normal = cross( *t.m_vertices[1] - *t.m_vertices[0], *t.m_vertices[2] - *t.m_vertices[0] ).normalized();
 			m_rtTriangles.push_back( t );
 		}
 	}
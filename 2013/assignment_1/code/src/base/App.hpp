@@ -107,6 +107,7 @@ private:
 	RayTracer*							m_rt;
 	Renderer*							m_renderer;
 	std::vector<Vec3f>					m_rtVertices;
+	std::vector<Vec3f>					m_rtNormals;
 	std::vector<RTTriangle>				m_rtTriangles;
 	std::vector<Renderer::RTToMesh>		m_rtMap;
 	Image*								m_rtImage;
@@ -2,6 +2,7 @@
 
 #include "Hit.hpp"
 #include "RTTriangle.hpp"
+#include "Renderer.hpp"
 
 namespace FW {
 
@@ -15,5 +16,48 @@ Hit::~Hit (void)
 {
 }
 
+// Interpolates a vertex attribute of the triangle with the barycentrics
+static Vec4f interpolate (const MeshBase* mesh, const Vec3i& indices, const Vec3f& barycentrics, int attrib)
+{
+	return barycentrics[0] * mesh->getVertexAttrib(indices[0], attrib) +
+		   barycentrics[1] * mesh->getVertexAttrib(indices[1], attrib) +
+		   barycentrics[2] * mesh->getVertexAttrib(indices[2], attrib);
+}
+
+SurfaceInteraction::SurfaceInteraction (const Hit& hit, const MeshBase* mesh)
+{
+	const RTTriangle* tri = hit.triangle;
+	const Renderer::RTToMesh* map = (const Renderer::RTToMesh*)tri->m_userPointer;
+
+	barycentrics = Vec3f(1.0f - hit.umin - hit.vmin, hit.umin, hit.vmin);
+	indices = mesh->indices(map->submesh)[map->tri_idx];
+	geometricNormal = tri->m_normal;
+	material = map->submesh;
+
+	// Interpolate the vertex normals the triangle points to and normalize once
+	normal = geometricNormal;
+	if (tri->m_vertexNormals[0])
+		normal = (barycentrics[0] * *tri->m_vertexNormals[0] +
+				  barycentrics[1] * *tri->m_vertexNormals[1] +
+				  barycentrics[2] * *tri->m_vertexNormals[2]).normalized();
+	int attrib = mesh->findAttrib(MeshBase::AttribType_TexCoord);
+	uv = attrib != -1 ? interpolate(mesh, indices, barycentrics, attrib).getXY() : Vec2f(0.0f);
+
+	// Point sample the diffuse texture, repeating it outside [0, 1]
+	const MeshBase::Material& mat = mesh->material(material);
+	const Texture& tex = mat.textures[MeshBase::TextureType_Diffuse];
+	if (tex.exists())
+	{
+		const Image& teximg = *tex.getImage();
+		Vec2i texCoordi = Vec2i( (int)((uv.x - floor(uv.x))*teximg.getSize().x),
+								 (int)((uv.y - floor(uv.y))*teximg.getSize().y) );
+		albedo = teximg.getVec4f(texCoordi).getXYZ();
+	}
+	else
+	{
+		albedo = mat.diffuse.getXYZ();
+	}
+}
+
 
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "base/Math.hpp"
+#include "3d/Mesh.hpp"
 #include <limits>
 
 namespace FW {
@@ -22,5 +23,23 @@ public:
 	float					vmin;
 };
 
+// What shading needs of a hit, computed once from the barycentrics the
+// traversal found along with the hit. The triangle's m_userPointer must point
+// to its Renderer::RTToMesh in mesh. Neither normal is flipped towards the ray.
+class SurfaceInteraction
+{
+public:
+
+	SurfaceInteraction		(const Hit& hit, const MeshBase* mesh);
+
+	Vec3f					barycentrics;		// Weights of the three vertices, (1-umin-vmin, umin, vmin)
+	Vec3i					indices;			// Of the three vertices in mesh
+	Vec3f					geometricNormal;	// Of the triangle plane
+	Vec3f					normal;				// Interpolated vertex normal, the geometric one if the mesh has none
+	Vec2f					uv;					// Interpolated texture coordinates, 0 if the mesh has none
+	int						material;			// Submesh of the triangle, mesh->material(material) is its material
+	Vec3f					albedo;				// Diffuse texture at uv if there is one, otherwise the diffuse color
+};
+
 
 }
\ No newline at end of file
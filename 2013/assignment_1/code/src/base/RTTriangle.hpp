@@ -21,6 +21,8 @@ public:
 	Vec3f		calculateCentroid	(void) const;
 
 	Vec3f*		m_vertices[3];
+	Vec3f const*	m_vertexNormals[3];	// NULL if the mesh has no normals
+	Vec3f		m_normal;			// Normalized, of the triangle plane
 	void*	    m_userPointer;
 };
 
@@ -10,6 +10,7 @@ class RTTriangle;
 class Bvh;
 class Node;
 class Hit;
+class MulticoreLauncher;
 
 // Main class for tracing rays using BVHs
 class RayTracer
@@ -33,6 +34,19 @@ public:
 	Hit						rayCast					(const Vec3f& orig, const Vec3f& dir) const;
 	bool					rayCastAny				(const Vec3f& orig, const Vec3f& dir) const;
 
+	// Occlusion query for AO rays: true if anything is hit at orig + t*dir
+	// with t in (tmin, tmax). Stops at the first hit found.
+	bool					occluded					(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax) const;
+	bool					rayIntersectNodeOccluded	(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax, const Node* node) const;
+
+	// Batch queries, hits[i] and occluded[i] are the results of ray i, cast
+	// like rayCast and occluded. Large batches are traced sorted by direction
+	// octant and then along a Morton curve over their origins, so the rays
+	// traced one after another visit the same nodes. Given a launcher the
+	// chunks of the batch run on its threads, otherwise on the calling thread.
+	void					rayCastBatch				(const Vec3f* origs, const Vec3f* dirs, int numRays, Hit* hits, MulticoreLauncher* launcher = NULL) const;
+	void					occludedBatch				(const Vec3f* origs, const Vec3f* dirs, int numRays, U8* occluded, float tmin = 0.0f, float tmax = 1.0f, MulticoreLauncher* launcher = NULL) const;
+
 
 	// This function computes an MD5 checksum of the input scene data,
 	// WITH the assumption all vertices are allocated in one big chunk.
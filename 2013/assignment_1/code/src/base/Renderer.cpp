@@ -8,9 +8,52 @@
 
 #define HALTON_MAX_IDX 100000
 
+#define TILE_SIZE_DEFAULT 16
+
 namespace FW
 {
 
+int Renderer::tileSize = TILE_SIZE_DEFAULT;
+
+// rayTracePicture hands its tasks tiles of tileSize pixels in Hilbert order,
+// clipped to the image. hilbertCell is cell d of the curve over an n x n grid.
+static Vec2i hilbertCell( int n, int d )
+{
+	Vec2i c( 0, 0 );
+	for ( int s = 1; s < n; s *= 2 )
+	{
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if ( ry == 0 )
+		{
+			// Rotate the quadrant
+			if ( rx == 1 )
+				c = Vec2i( s - 1 - c.x, s - 1 - c.y );
+			std::swap( c.x, c.y );
+		}
+		c += Vec2i( s * rx, s * ry );
+		d /= 4;
+	}
+	return c;
+}
+
+static void hilbertTiles( const Vec2i& size, int tile, std::vector<Vec2i>& tiles )
+{
+	int numX = (size.x + tile - 1) / tile;
+	int numY = (size.y + tile - 1) / tile;
+	int n = 1;
+	while ( n < numX || n < numY )
+		n *= 2;
+
+	tiles.clear();
+	for ( int d = 0; d < n * n; ++d )
+	{
+		Vec2i c = hilbertCell( n, d );
+		if ( c.x < numX && c.y < numY )
+			tiles.push_back( c * tile );
+	}
+}
+
 Renderer::Renderer()
 {
 	m_aoRayLength = 0.5f;
@@ -30,10 +73,16 @@ void tracePictureThread(MulticoreLauncher::Task& task) {
 	int width = d->image->getSize().x;
 	int height = d->image->getSize().y;
 
-	//#pragma omp parallel for
-	for (int j = task.idx; j < task.idx+1; ++j)
+	// The tile of this task, clipped to the image
+	const Vec2i& tile = d->tiles[task.idx];
+	int tileRight = FW::min(tile.x + d->tileSize, width);
+	int tileBottom = FW::min(tile.y + d->tileSize, height);
+
+	// The camera rays of the tile are traced as one batch
+	std::vector<Vec3f> origs, dirs;
+	for (int j = tile.y; j < tileBottom; ++j)
 	{
-		for ( int i = 0; i < width; ++i )
+		for ( int i = tile.x; i < tileRight; ++i )
 		{
 			// generate ray through pixel
 			float x = (i + 0.5f) / width *  2.0f - 1.0f;
@@ -54,12 +103,25 @@ void tracePictureThread(MulticoreLauncher::Task& task) {
 			// NOTE that it's not normalized; the direction Rd is defined
 			// so that the segment to be traced is [Ro, Ro+Rd], i.e.,
 			// intersections that come _after_ the point Ro+Rd are to be discarded.
-			Rd = Rd - Ro;
+			origs.push_back( Ro );
+			dirs.push_back( Rd - Ro );
+		}
+	}
 
-			// trace!
-			Hit pHit = d->rt->rayCast( Ro, Rd );
-			// bookkeeping for perf measurement
-			(*((int*)task.result))++;
+	// trace!
+	int numRays = (int)origs.size();
+	std::vector<Hit> hits( numRays );
+	if ( numRays > 0 )
+		d->rt->rayCastBatch( &origs[0], &dirs[0], numRays, &hits[0] );
+	// bookkeeping for perf measurement
+	(*((int*)task.result)) += numRays;
+
+	int k = 0;
+	for (int j = tile.y; j < tileBottom; ++j)
+	{
+		for ( int i = tile.x; i < tileRight; ++i, ++k )
+		{
+			const Hit& pHit = hits[k];
 
 			// if we hit something, fetch a color and insert into image
 			Vec4f color(0,0,0,1);
@@ -112,7 +174,9 @@ void Renderer::rayTracePicture( const MeshBase* mesh, RayTracer* rt, Image* imag
 	// Create dynamically allocated data for the threads and
 	// launch the threads
 	ThreadData* data = new ThreadData(mesh, rt, image, cameraCtrl, *this);
-	launcher.push(tracePictureThread, data, 0, height);
+	data->tileSize = tileSize;
+	hilbertTiles(image->getSize(), data->tileSize, data->tiles);
+	launcher.push(tracePictureThread, data, 0, (int)data->tiles.size());
 
 	// Wait until all the threads are done, accumulate the total rays the threads have traced
 	while (launcher.getNumTasks())
@@ -144,8 +208,11 @@ Vec4f Renderer::interpolateAttribute( const RTTriangle* tri, float a, float b, c
 
 Vec4f Renderer::computeShadingHeadlight( const RayTracer* rt, const MeshBase* mesh, const Hit& pHit, const CameraControls& cameraCtrl ) const
 {
-	// compute normal for intersected triangle instead (faceted shading)
-	Vec3f n = cross(*pHit.triangle->m_vertices[1] - *pHit.triangle->m_vertices[0], *pHit.triangle->m_vertices[2] - *pHit.triangle->m_vertices[0]).normalized();
+	// normal and diffuse color of the hit
+	const SurfaceInteraction si( pHit, mesh );
+
+	// use the normal of the intersected triangle (faceted shading)
+	const Vec3f& n = si.geometricNormal;
 
 	// dot with view ray direction <=> "headlight shading"
 	float d = fabs( dot( n, (pHit.intersection-cameraCtrl.getPosition()).normalized() ) );
@@ -153,9 +220,8 @@ Vec4f Renderer::computeShadingHeadlight( const RayTracer* rt, const MeshBase* me
 	// assign gray value (d,d,d)
 	Vec3f shade = d;
 	
-	// get diffuse color
-	const RTToMesh* map = (const RTToMesh*)pHit.triangle->m_userPointer;
-	Vec3f diffuse = mesh->material( map->submesh ).diffuse.getXYZ();
+	// get diffuse color, from the texture if there is one
+	Vec3f diffuse = si.albedo;
 	// uncomment this to shade in diffuse white
 	//Vec3f diffuse = 1;
 
@@ -169,9 +235,10 @@ Vec4f Renderer::computeShadingAmbientOcclusion( const RayTracer* rt, const MeshB
 	// Calculate a vector from the surface point to the camera
 	Vec3f surfaceToCam = (cameraCtrl.getPosition()-pHit.intersection).normalized();
 
-	// Compute intersection normal
+	// Intersection normal, of the triangle plane, and diffuse color
 	// Flip the normal if the camera is on the backside
-	Vec3f n = cross(*pHit.triangle->m_vertices[1] - *pHit.triangle->m_vertices[0], *pHit.triangle->m_vertices[2] - *pHit.triangle->m_vertices[0]).normalized();
+	const SurfaceInteraction si( pHit, mesh );
+	Vec3f n = si.geometricNormal;
 		
 	if ( dot(n, surfaceToCam) < 0.0f ) {
 		n *= -1.0f;
@@ -220,7 +287,7 @@ Vec4f Renderer::computeShadingAmbientOcclusion( const RayTracer* rt, const MeshB
 
 		// Trace a ray from the surface point to the random direction
 		// The rays are not normalized, the length of the ray describes the maximum distance to trace
-		if ( !rt->rayCastAny(origin, this->m_aoRayLength * u) ) {
+		if ( !rt->occluded(origin, this->m_aoRayLength * u, 0.0f, 1.0f) ) {
 			noHits++;
 		}
 	}
@@ -231,9 +298,7 @@ Vec4f Renderer::computeShadingAmbientOcclusion( const RayTracer* rt, const MeshB
 	switch (colorMode) {
 		case ColorMode::ColorMode_On:
 		{
-			const RTToMesh* map = (const RTToMesh*)pHit.triangle->m_userPointer;
-			Vec3f diffuse = mesh->material( map->submesh ).diffuse.getXYZ();
-			return Vec4f(color*diffuse, 1.0f);
+			return Vec4f(color*si.albedo, 1.0f);
 		}
 		case ColorMode::ColorMode_Off:
 		{
@@ -110,7 +110,7 @@ public:
 
 			struct ThreadData {
 				ThreadData (const MeshBase* mesh, const RayTracer* rt, Image* image, const CameraControls& cameraCtrl, const Renderer& renderer) :
-					mesh(mesh), rt(rt), image(image), cameraCtrl(cameraCtrl), renderer(renderer)
+					mesh(mesh), rt(rt), image(image), cameraCtrl(cameraCtrl), renderer(renderer), tileSize(0)
 				{
 				}
 
@@ -119,6 +119,8 @@ public:
 				Image* image;
 				const CameraControls& cameraCtrl;
 				const Renderer& renderer;
+				std::vector<Vec2i> tiles;	// Upper left corners in Hilbert order, a task per tile
+				int tileSize;
 			};
 
 			// draw a picture of the mesh from the viewpoint specified by the matrix.
@@ -137,6 +139,10 @@ public:
 
 			float				getRaysPerSecond					( void )			{ return m_raysPerSecond; }
 
+			// Edge of the square tiles rayTracePicture splits the image into
+			static	void		setTileSize							( int size )		{ Renderer::tileSize = FW::max(size, 1); }
+			static	int			getTileSize							( void )			{ return Renderer::tileSize; }
+
 
 protected:
 			// this function fetches a given attribute from the vertices that correspond
@@ -171,6 +177,8 @@ protected:
 			__int64						m_s64TotalRays;
 			float						m_raysPerSecond;
 
+			static	int					tileSize;
+
 };
 
 };	// namespace FW
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include "Hit.hpp"
 #include "RTTriangle.hpp"
+#include "RayTracer.hpp"
 
 namespace FW {
 
@@ -15,5 +16,60 @@ Hit::~Hit (void)
 {
 }
 
+SurfaceInteraction::SurfaceInteraction (const Hit& hit, const Mesh<VertexPNTC>* mesh)
+{
+	setGeometry(hit, mesh);
+	uv = barycentrics[0] * mesh->vertex(indices[0]).t +
+		 barycentrics[1] * mesh->vertex(indices[1]).t +
+		 barycentrics[2] * mesh->vertex(indices[2]).t;
+	setAlbedo(mesh);
+}
+
+SurfaceInteraction::SurfaceInteraction (const Hit& hit, const MeshBase* mesh)
+{
+	setGeometry(hit, mesh);
+	int attrib = mesh->findAttrib(MeshBase::AttribType_TexCoord);
+	if (attrib != -1)
+		uv = (barycentrics[0] * mesh->getVertexAttrib(indices[0], attrib) +
+			  barycentrics[1] * mesh->getVertexAttrib(indices[1], attrib) +
+			  barycentrics[2] * mesh->getVertexAttrib(indices[2], attrib)).getXY();
+	else
+		uv = Vec2f(0.0f);
+	setAlbedo(mesh);
+}
+
+void SurfaceInteraction::setGeometry (const Hit& hit, const MeshBase* mesh)
+{
+	const RTTriangle* tri = hit.triangle;
+	const RTToMesh* map = (const RTToMesh*)tri->m_userPointer;
+
+	barycentrics = Vec3f(1.0f - hit.umin - hit.vmin, hit.umin, hit.vmin);
+	indices = mesh->indices(map->submesh)[map->tri_idx];
+	geometricNormal = tri->getNormal();
+	// Interpolate the vertex normals the triangle points to and normalize once
+	normal = (barycentrics[0] * *tri->m_vertexNormals[0] +
+			  barycentrics[1] * *tri->m_vertexNormals[1] +
+			  barycentrics[2] * *tri->m_vertexNormals[2]).normalized();
+	material = map->submesh;
+}
+
+void SurfaceInteraction::setAlbedo (const MeshBase* mesh)
+{
+	// Point sample the diffuse texture, repeating it outside [0, 1]
+	const MeshBase::Material& mat = mesh->material(material);
+	const Texture& tex = mat.textures[MeshBase::TextureType_Diffuse];
+	if (tex.exists())
+	{
+		const Image& teximg = *tex.getImage();
+		Vec2i texCoordi = Vec2i( (int)((uv.x - floor(uv.x))*teximg.getSize().x),
+								 (int)((uv.y - floor(uv.y))*teximg.getSize().y) );
+		albedo = teximg.getVec4f(texCoordi).getXYZ();
+	}
+	else
+	{
+		albedo = mat.diffuse.getXYZ();
+	}
+}
+
 
 }
\ No newline at end of file
@@ -55,6 +55,8 @@ void Radiosity::vertexTaskFunc( MulticoreLauncher::Task& task )
 		Vec3f E(0);
 		int randomIdx = ctx.m_rand.getU32(0, 100000 - ctx.m_numDirectRays);
 
+		// The shadow rays are traced as one batch, each adds its contribution if it gets through
+		std::vector<Vec3f> origs, dirs, contributions;
 		for ( int r = 0; r < ctx.m_numDirectRays; ++r )
 		{
 			// Draw a sample on light source
@@ -70,16 +72,21 @@ void Radiosity::vertexTaskFunc( MulticoreLauncher::Task& task )
 			float cosl = FW::clamp(FW::dot(ctx.m_light->getNormal(), -vl_normalized), 0.0f, 1.0f);
 			if (cosl == 0.0f) break;
 
-			// Trace shadow ray to see if it's blocked
-			if (!ctx.m_rt->rayCastShadow(o, vl))
-			{
-				// if not, add the appropriate emission, 1/r^2 and clamped cosine terms, accounting for the PDF as well.
-				// accumulate into E
-				float cosv = FW::clamp(FW::dot(vl_normalized, n), 0.0f, 1.0f);
-				float vl_length = vl.length();
-				E += (ctx.m_light->getEmission() * (1.0f / (vl_length * vl_length)) * cosl * cosv) / pdf;
-			}
+			// The appropriate emission, 1/r^2 and clamped cosine terms, accounting for the PDF as well.
+			float cosv = FW::clamp(FW::dot(vl_normalized, n), 0.0f, 1.0f);
+			float vl_length = vl.length();
+			origs.push_back( o );
+			dirs.push_back( vl );
+			contributions.push_back( (ctx.m_light->getEmission() * (1.0f / (vl_length * vl_length)) * cosl * cosv) / pdf );
 		}
+
+		// Trace the shadow rays to see which are blocked, accumulate the others into E
+		std::vector<U8> occluded( origs.size() );
+		if ( !origs.empty() )
+			ctx.m_rt->occludedBatch( &origs[0], &dirs[0], (int)origs.size(), &occluded[0], 0.0f, 1.0f );
+		for ( int r = 0; r < (int)origs.size(); ++r )
+			if ( !occluded[r] )
+				E += contributions[r];
 		// Note we are NOT multiplying by PI here;
 		// it's implicit in the hemisphere-to-light source area change of variables.
 		// The result we are computing is _irradiance_, not radiosity.
@@ -96,71 +103,45 @@ void Radiosity::vertexTaskFunc( MulticoreLauncher::Task& task )
 		Vec3f E(0.0f);
 		int randomIdx = ctx.m_rand.getU32(0, 100000-ctx.m_numHemisphereRays);
 
+		// Draw cosine weighted directions
+		// You need to transform them from the local frame to the vertex' hemisphere using B.
+		std::vector<Vec3f> origs( ctx.m_numHemisphereRays, o );
+		std::vector<Vec3f> dirs( ctx.m_numHemisphereRays );
 		for ( int r = 0; r < ctx.m_numHemisphereRays; ++r )
-		{
-			// Draw a cosine weighted direction and find out where it hits (if anywhere)
-			// You need to transform it from the local frame to the vertex' hemisphere using B.
+			dirs[r] = B * Sampler::CosineSampleHemisphere(randgen, randomIdx+r, (int)FW::sqrt((float)ctx.m_numHemisphereRays));
 
-			// Make the direction long but not too long to avoid numerical instability in the ray tracer.
-			// For our scenes, 100 is a good length. I (know, this special casing sucks.)
+		// Shoot them as unbounded rays in one batch, see where they hit
+		std::vector<Hit> hits( ctx.m_numHemisphereRays );
+		if ( ctx.m_numHemisphereRays > 0 )
+			ctx.m_rt->rayCastBatch( &origs[0], &dirs[0], ctx.m_numHemisphereRays, &hits[0], 0.0f, FLT_MAX );
 
-			// Shoot ray, see where we hit
-			const float scale = 100.0f;
-			Vec3f d = scale * B * Sampler::CosineSampleHemisphere(randgen, randomIdx+r, (int)FW::sqrt((float)ctx.m_numHemisphereRays));
-			Vec3f d_normalized = d.normalized();
-			const Hit hit = ctx.m_rt->rayCast( o, d );
+		for ( int r = 0; r < ctx.m_numHemisphereRays; ++r )
+		{
+			Vec3f d_normalized = dirs[r].normalized();
+			const Hit& hit = hits[r];
 			const RTTriangle* tri = hit.triangle;
 
 			if ( tri != 0 )
 			{
-				// Interpolate lighting from previous pass
-				const RTToMesh* map = (const RTToMesh*)tri->m_userPointer;
-				const Vec3i& indices = ctx.m_scene->indices( map->submesh )[ map->tri_idx ];
-
-				// Fetch barycentrics
-				Vec3f barycentrics = tri->getBarycentrics(hit.intersection);
-
 				// Check for backfaces => don't accumulate if we hit a surface from below!
 				// TODO: create switch for smooth vs. flat shading
 				float cosl = FW::dot(tri->getNormal(), -d_normalized);
 				if (cosl < 0.0f) continue;
 
+				// Barycentrics, vertices and albedo of the hit
+				const SurfaceInteraction si( hit, ctx.m_scene );
+
 				// Ei = interpolated irradiance determined by ctx.m_vecPrevBounce from vertices using the barycentrics
-				Vec3f Ei = barycentrics[0]*ctx.m_vecPrevBounce[indices[0]] + 
-						   barycentrics[1]*ctx.m_vecPrevBounce[indices[1]] + 
-						   barycentrics[2]*ctx.m_vecPrevBounce[indices[2]];
+				Vec3f Ei = si.barycentrics[0]*ctx.m_vecPrevBounce[si.indices[0]] + 
+						   si.barycentrics[1]*ctx.m_vecPrevBounce[si.indices[1]] + 
+						   si.barycentrics[2]*ctx.m_vecPrevBounce[si.indices[2]];
 
 				// Divide incident irradiance by PI so that we can turn it into outgoing
 				// radiosity by multiplying by the reflectance factor below.
 				Ei *= (1.0f / FW_PI);
 
-				// check for texture
-				const MeshBase::Material& mat = ctx.m_scene->material(map->submesh);
-				if ( mat.textures[MeshBase::TextureType_Diffuse].exists() )
-				{
-					// Yes, texture; fetch diffuse albedo from there.
-					// First interpolate UV coordinates from the vertices using barycentrics
-					// Then turn those into pixel coordinates within the texture
-					// Finally fetch the color using Image::getVec4f() (point sampling is fine).
-					// Use the result as the diffuse reflectance instead of mat.diffuse.
-
-					const MeshWithColors& mesh = *ctx.m_scene;
-					const Texture& tex = mat.textures[MeshBase::TextureType_Diffuse];
-					const Image& teximg = *tex.getImage();
-
-					Vec2f texCoord = barycentrics[0]*ctx.m_scene->vertex(indices[0]).t + 
-						             barycentrics[1]*ctx.m_scene->vertex(indices[1]).t + 
-									 barycentrics[2]*ctx.m_scene->vertex(indices[2]).t;
-
-					Vec2i texCoordi = Vec2i( (texCoord.x - floor(texCoord.x))*teximg.getSize().x, 
-											 (texCoord.y - floor(texCoord.y))*teximg.getSize().y );
-
-					Ei *= teximg.getVec4f(texCoordi).getXYZ();
-				}
-				else
-				{
-					Ei *= mat.diffuse.getXYZ();
-				}
+				// Diffuse reflectance, from the texture if there is one
+				Ei *= si.albedo;
 
 				E += Ei;	// accumulate
 			}
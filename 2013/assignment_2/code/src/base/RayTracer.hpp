@@ -10,6 +10,7 @@ class RTTriangle;
 class Bvh;
 class Node;
 class Hit;
+class MulticoreLauncher;
 
 // this struct helps to map the linear indices of the ray tracer triangles
 // back to the (submesh, tri) indexing of BaseMesh. Helps when getting colors,
@@ -34,16 +35,33 @@ public:
 	void					saveHierarchy			(const char* filename, const std::vector<RTTriangle>& triangles);
 	void					loadHierarchy			(const char* filename, std::vector<RTTriangle>& triangles);
 
+	// Occlusion query for shadow and AO rays: true if anything is hit at
+	// orig + t*dir with t in (tmin, tmax). Stops at the first hit found.
+	bool					occluded				(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax) const;
+	bool					rayIntersectNodeOccluded(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax, const Node* node) const;
+
+	// Segment [orig, orig+dir], same as occluded(orig, dir, 0, 1)
 	bool					rayCastShadow			( const Vec3f& orig, const Vec3f& dir ) const;
-	bool					rayIntersectNodeShadow	(const Vec3f& orig, const Vec3f& dir, const float maxval, const Node* node) const;
 
 	// intersection functions
-	Hit						rayIntersectNode		(const Vec3f& orig, const Vec3f& dir, const float maxval, const Node* node) const;
-	Hit						rayIntersectTriangles	(const Vec3f& orig, const Vec3f& dir, int startPrim, int endPrim) const;
+	Hit						rayIntersectNode		(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax, const Node* node) const;
+	Hit						rayIntersectTriangles	(const Vec3f& orig, const Vec3f& dir, int startPrim, int endPrim, float tmin = 0.0f, float tmax = 1.0f) const;
 
+	// Closest hit on the segment [orig, orig+dir]
 	Hit						rayCast					(const Vec3f& orig, const Vec3f& dir) const;
+	// Closest hit at orig + t*dir with t in (tmin, tmax), tmax = FLT_MAX for
+	// an unbounded ray
+	Hit						rayCast					(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax) const;
 	bool					rayCastAny				(const Vec3f& orig, const Vec3f& dir) const;
 
+	// Batch queries, hits[i] and occluded[i] are the results of ray i with t
+	// in (tmin, tmax). Large batches are traced sorted by direction octant and
+	// then along a Morton curve over their origins, so the rays traced one
+	// after another visit the same nodes. Given a launcher the chunks of the
+	// batch run on its threads, otherwise on the calling thread.
+	void					rayCastBatch			(const Vec3f* origs, const Vec3f* dirs, int numRays, Hit* hits, float tmin = 0.0f, float tmax = 1.0f, MulticoreLauncher* launcher = NULL) const;
+	void					occludedBatch			(const Vec3f* origs, const Vec3f* dirs, int numRays, U8* occluded, float tmin = 0.0f, float tmax = 1.0f, MulticoreLauncher* launcher = NULL) const;
+
 
 	// This function computes an MD5 checksum of the input scene data,
 	// WITH the assumption all vertices are allocated in one big chunk.
@@ -2,6 +2,7 @@
 #include "ShadowMap.hpp"
 #include "Hit.hpp"
 #include "RTTriangle.hpp"
+#include "base/MulticoreLauncher.hpp"
 
 namespace FW 
 {
@@ -24,13 +25,20 @@ void InstantRadiosity::castIndirect(RayTracer *rt, MeshWithColors *scene, const
 	std::vector<Vec3f> origs, dirs, E_times_pdf;
 	ls.sampleEmittedRays(num, origs, dirs, E_times_pdf);
 
+	// Intersect all the rays against the scene as one batch, on all the cores
+	std::vector<Hit> hits(num);
+	if (num > 0)
+	{
+		MulticoreLauncher launcher;
+		rt->rayCastBatch(&origs[0], &dirs[0], num, &hits[0], &launcher);
+	}
+
 	// At this point m_indirectLights holds #num lights that are off.
 	// Loop through the rays and fill in the corresponding lights in m_indirectLights
 	// based on what happens to the ray.
 	for (int i = 0; i < num; i++)
 	{
-		// Intersect against the scene
-		Hit h = rt->rayCast(origs[i], dirs[i]);
+		const Hit& h = hits[i];
 		const RTTriangle* tri = h.triangle;
 
 		if ( tri != 0 )
@@ -41,46 +49,18 @@ void InstantRadiosity::castIndirect(RayTracer *rt, MeshWithColors *scene, const
 			// of things that a light source needs to have)
 			// A lot of this code is like in the Assignment 2's corresponding routine.
 
-			const RTToMesh* map = (const RTToMesh*)tri->m_userPointer;
-			const Vec3i& indices = scene->indices( map->submesh )[ map->tri_idx ];
-
-			// Fetch the barycentrics
-			Vec3f barycentrics = tri->getBarycentrics(h.intersection);
+			// Normal and albedo from the barycentrics of the hit
+			const SurfaceInteraction si( h, scene );
 			
 			// Check for backfaces => don't accumulate if we hit a surface from below!
-			const Vec3f tnormal = tri->getNormal(h.intersection, barycentrics);
+			const Vec3f tnormal = si.normal;
 
 			// Divide incident irradiance by PI so that we can turn it into outgoing
 			// radiosity by multiplying by the reflectance factor below.
 			//Ei *= (1.0f / FW_PI);
 		
-			Vec3f Ei;
-			// check for texture
-			const MeshBase::Material& mat = scene->material(map->submesh);
-			if ( mat.textures[MeshBase::TextureType_Diffuse].exists() )
-			{
-				// Yes, texture; fetch diffuse albedo from there.
-				// First interpolate UV coordinates from the vertices using barycentrics
-				// Then turn those into pixel coordinates within the texture
-				// Finally fetch the color using Image::getVec4f() (point sampling is fine).
-				// Use the result as the diffuse reflectance instead of mat.diffuse.
-
-				const Texture& tex = mat.textures[MeshBase::TextureType_Diffuse];
-				const Image& teximg = *tex.getImage();
-
-				Vec2f texCoord = barycentrics[0] * scene->vertex(indices[0]).t + 
-								 barycentrics[1] * scene->vertex(indices[1]).t + 
-								 barycentrics[2] * scene->vertex(indices[2]).t;
-
-				Vec2i texCoordi = Vec2i( (texCoord.x - floor(texCoord.x))*teximg.getSize().x, 
-										 (texCoord.y - floor(texCoord.y))*teximg.getSize().y );
-
-				Ei = teximg.getVec4f(texCoordi).getXYZ();
-			}
-			else
-			{
-				Ei = mat.diffuse.getXYZ();
-			}
+			// Diffuse reflectance, from the texture if there is one
+			Vec3f Ei = si.albedo;
 
 			Vec3f emission = E_times_pdf[i] * Ei;
 
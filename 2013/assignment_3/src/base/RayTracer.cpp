@@ -6,11 +6,13 @@
 #include "base/Math.hpp"
 #include "RayTracer.hpp"
 #include <stdio.h>
+#include <algorithm>
 #include "rtIntersect.inl"
 
 #include "Bvh.hpp"
 #include "Hit.hpp"
 #include "RTTriangle.hpp"
+#include "base/MulticoreLauncher.hpp"
 
 // Helper function for hashing scene data for caching BVHs
 extern "C" void MD5Buffer( void* buffer, size_t bufLen, unsigned int* pDigest );
@@ -68,67 +70,93 @@ void RayTracer::constructHierarchy( std::vector<RTTriangle>& triangles )
 	m_bvh = new Bvh(triangles);	// Construct a new BVH
 }
 
-bool RayTracer::rayCastShadow( const Vec3f& orig, const Vec3f& dir ) const
+// Slab test of the segment orig + t*dir, t in (tmin, tmax), against a node box
+static inline bool intersectSegmentBox(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax, const Node* node)
+{
+	for (int i = 0; i < 3; ++i) {
+		float inv = 1.0f / dir[i];
+		float t0 = (node->bbMin[i] - orig[i]) * inv;
+		float t1 = (node->bbMax[i] - orig[i]) * inv;
+		if (inv < 0.0f)
+			std::swap(t0, t1);
+		tmin = FW::max(tmin, t0);
+		tmax = FW::min(tmax, t1);
+		if (tmin > tmax)
+			return false;
+	}
+	return true;
+}
+
+bool RayTracer::occluded( const Vec3f& orig, const Vec3f& dir, float tmin, float tmax ) const
 {
-	return rayIntersectNodeShadow(orig, dir, (dir-orig).length(), m_bvh->getRoot());
+	return rayIntersectNodeOccluded(orig, dir, tmin, tmax, m_bvh->getRoot());
 }
 
-bool RayTracer::rayIntersectNodeShadow(const Vec3f& orig, const Vec3f& dir, const float maxval, const Node* node) const
+bool RayTracer::rayIntersectNodeOccluded(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax, const Node* node) const
 {
-	// Test whether the ray intersects the node's bounding box at all
-	if (!intersect_bbox(&orig.x, &dir.x, &(node->bbMin).x, &(node->bbMax).x, maxval)) {
+	if (!intersectSegmentBox(orig, dir, tmin, tmax, node)) {
 		return false;
 	}
 
-	// If the node is a leaf node
+	// If the node is a leaf node, stop at the first blocker instead of looking for the closest one
 	if (!node->leftChild && !node->rightChild) {
-		return rayIntersectTriangles(orig, dir, node->startPrim, node->endPrim).triangle ? true : false;
+		for ( int i = node->startPrim; i <= node->endPrim; ++i )
+		{
+			float t, u, v;
+			if ( intersect_triangle1( &orig.x,
+									  &dir.x,
+									  &(*m_triangles)[i].m_vertices[0]->x,
+									  &(*m_triangles)[i].m_vertices[1]->x,
+									  &(*m_triangles)[i].m_vertices[2]->x,
+									  t, u, v ) && t > tmin && t < tmax )
+				return true;
+		}
+		return false;
 	}
 
-	if (rayIntersectNodeShadow(orig, dir, maxval, node->leftChild))
+	if (rayIntersectNodeOccluded(orig, dir, tmin, tmax, node->leftChild))
 		return true;
-	if (rayIntersectNodeShadow(orig, dir, maxval, node->rightChild))
+	if (rayIntersectNodeOccluded(orig, dir, tmin, tmax, node->rightChild))
 		return true;
 
 	return false;
 }
 
-bool RayTracer::rayCastAny( const Vec3f& orig, const Vec3f& dir )
+bool RayTracer::rayCastShadow( const Vec3f& orig, const Vec3f& dir ) const
+{
+	return occluded( orig, dir, 0.0f, 1.0f );
+}
+
+bool RayTracer::rayCastAny( const Vec3f& orig, const Vec3f& dir ) const
 {
-	return rayCast( orig, dir ).triangle != 0;
+	return occluded( orig, dir, 0.0f, 1.0f );
 }
 
 /** YOUR CODE HERE
 	This is where you hierarchically traverse the tree you built!
 	You can use the existing code for the leaf nodes.
 **/
-Hit RayTracer::rayIntersectNode(const Vec3f& orig, const Vec3f& dir, const float maxval, const Node* node) const
+// Closest hit with t in (tmin, tmax). The right child is only searched up to
+// the hit found in the left one.
+Hit RayTracer::rayIntersectNode(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax, const Node* node) const
 {
-	// Test whether the ray intersects the node's bounding box at all
-	if (!intersect_bbox(&orig.x, &dir.x, &(node->bbMin).x, &(node->bbMax).x, maxval)) {
+	if (!intersectSegmentBox(orig, dir, tmin, tmax, node)) {
 		return Hit(NULL);
 	}
 
-	// If the node is a leaf node
 	if (!node->leftChild && !node->rightChild) {
-		return rayIntersectTriangles(orig, dir, node->startPrim, node->endPrim);
+		return rayIntersectTriangles(orig, dir, node->startPrim, node->endPrim, tmin, tmax);
 	}
 
-	Hit left = rayIntersectNode(orig, dir, maxval, node->leftChild);
-	Hit right = rayIntersectNode(orig, dir, maxval, node->rightChild);
-
-	if (!left.triangle && !right.triangle)
-		return Hit(NULL);
-	else if (left.tmin < right.tmin)
-		return left;
-	else
-		return right;
+	Hit left = rayIntersectNode(orig, dir, tmin, tmax, node->leftChild);
+	Hit right = rayIntersectNode(orig, dir, tmin, left.triangle ? left.tmin : tmax, node->rightChild);
+	return right.triangle ? right : left;
 }
 
 
-Hit RayTracer::rayIntersectTriangles(const Vec3f& orig, const Vec3f& dir, int startPrim, int endPrim) const
+Hit RayTracer::rayIntersectTriangles(const Vec3f& orig, const Vec3f& dir, int startPrim, int endPrim, float tmin, float tmax) const
 {
-	float umin = 0.0f, vmin = 0.0f, tmin = 1.0f;
+	float umin = 0.0f, vmin = 0.0f, tbest = tmax;
 	int imin = -1;
 
 	// naive loop over all triangles
@@ -142,10 +170,10 @@ Hit RayTracer::rayIntersectTriangles(const Vec3f& orig, const Vec3f& dir, int st
 			&(*m_triangles)[i].m_vertices[2]->x,
 			t, u, v ) )
 		{
-			if ( t > 0.0f && t < tmin )
+			if ( t > tmin && t < tbest )
 			{
 				imin = i;
-				tmin = t;
+				tbest = t;
 				umin = u;
 				vmin = v;
 			}
@@ -153,14 +181,145 @@ Hit RayTracer::rayIntersectTriangles(const Vec3f& orig, const Vec3f& dir, int st
 	}
 
 	if ( imin != -1 )
-		return Hit(&(*m_triangles)[imin], orig + tmin*dir, tmin, umin, vmin);
+		return Hit(&(*m_triangles)[imin], orig + tbest*dir, tbest, umin, vmin);
 	else
 		return Hit(NULL);
 }
 
 Hit RayTracer::rayCast( const Vec3f& orig, const Vec3f& dir ) const
 {
-	return rayIntersectNode(orig, dir, (dir-orig).length(), m_bvh->getRoot());
+	return rayIntersectNode(orig, dir, 0.0f, 1.0f, m_bvh->getRoot());
+}
+
+
+//------------------------------------------------------------------------
+// Batch queries. The rays are sorted by the octant of their direction and then
+// by the Morton code of the origin within the bounds of all the origins, and
+// each task traces a chunk of BATCH_CHUNK rays of that order. Batches under
+// BATCH_SORT_MIN rays and batches from a single origin are traced in the given
+// order, the sort would cost more than it saves.
+
+#define BATCH_CHUNK 1024
+#define BATCH_SORT_MIN 1024
+#define BATCH_MORTON_BITS 10
+
+struct BatchJob
+{
+	const RayTracer*	rt;
+	const Vec3f*		origs;
+	const Vec3f*		dirs;
+	const S32*			order;		// Ray indices in tracing order, NULL for the given order
+	int					numRays;
+	Hit*				hits;		// rayCastBatch
+	U8*					occluded;	// occludedBatch
+};
+
+// Spreads the low 10 bits of v out so that there are two zero bits between each
+static inline U32 expandBits( U32 v )
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x30000ff;
+	v = (v | (v << 8)) & 0x300f00f;
+	v = (v | (v << 4)) & 0x30c30c3;
+	v = (v | (v << 2)) & 0x9249249;
+	return v;
+}
+
+static void sortBatch( const Vec3f* origs, const Vec3f* dirs, int numRays, std::vector<S32>& order )
+{
+	Vec3f lo( FLT_MAX ), hi( -FLT_MAX );
+	for ( int i = 0; i < numRays; ++i )
+	{
+		lo = FW::min( lo, origs[i] );
+		hi = FW::max( hi, origs[i] );
+	}
+
+	// Rays from a single point, such as those gathered at a vertex, all
+	// have the same Morton code
+	if ( lo == hi )
+		return;
+
+	float maxCell = (float)((1 << BATCH_MORTON_BITS) - 1);
+	Vec3f extent = hi - lo;
+	Vec3f scale( extent.x > 0.0f ? maxCell / extent.x : 0.0f,
+				 extent.y > 0.0f ? maxCell / extent.y : 0.0f,
+				 extent.z > 0.0f ? maxCell / extent.z : 0.0f );
+
+	// The index breaks the ties, so rays with the same key keep their order
+	std::vector<std::pair<U64, S32> > keys( numRays );
+	for ( int i = 0; i < numRays; ++i )
+	{
+		Vec3f c = (origs[i] - lo) * scale;
+		U32 octant = (dirs[i].x < 0.0f ? 4 : 0) | (dirs[i].y < 0.0f ? 2 : 0) | (dirs[i].z < 0.0f ? 1 : 0);
+		U32 morton = (expandBits( (U32)c.x ) << 2) | (expandBits( (U32)c.y ) << 1) | expandBits( (U32)c.z );
+		keys[i] = std::make_pair( ((U64)octant << (3 * BATCH_MORTON_BITS)) | morton, i );
+	}
+	std::sort( keys.begin(), keys.end() );
+
+	order.resize( numRays );
+	for ( int k = 0; k < numRays; ++k )
+		order[k] = keys[k].second;
+}
+
+static void rayCastBatchTask( MulticoreLauncher::Task& task )
+{
+	const BatchJob& job = *(const BatchJob*)task.data;
+	int end = FW::min( (task.idx + 1) * BATCH_CHUNK, job.numRays );
+	for ( int k = task.idx * BATCH_CHUNK; k < end; ++k )
+	{
+		int i = job.order ? job.order[k] : k;
+		job.hits[i] = job.rt->rayCast( job.origs[i], job.dirs[i] );
+	}
+}
+
+static void occludedBatchTask( MulticoreLauncher::Task& task )
+{
+	const BatchJob& job = *(const BatchJob*)task.data;
+	int end = FW::min( (task.idx + 1) * BATCH_CHUNK, job.numRays );
+	for ( int k = task.idx * BATCH_CHUNK; k < end; ++k )
+	{
+		int i = job.order ? job.order[k] : k;
+		job.occluded[i] = job.rt->occluded( job.origs[i], job.dirs[i], 0.0f, 1.0f ) ? 1 : 0;
+	}
+}
+
+static void runBatch( MulticoreLauncher::TaskFunc func, BatchJob& job, MulticoreLauncher* launcher )
+{
+	std::vector<S32> order;
+	if ( job.numRays >= BATCH_SORT_MIN )
+	{
+		sortBatch( job.origs, job.dirs, job.numRays, order );
+		if ( !order.empty() )
+			job.order = &order[0];
+	}
+
+	int numChunks = (job.numRays + BATCH_CHUNK - 1) / BATCH_CHUNK;
+	if ( launcher && numChunks > 1 )
+	{
+		launcher->push( func, &job, 0, numChunks );
+		launcher->popAll();
+		return;
+	}
+
+	MulticoreLauncher::Task task;
+	task.launcher = NULL;
+	task.func = func;
+	task.data = &job;
+	task.result = NULL;
+	for ( task.idx = 0; task.idx < numChunks; ++task.idx )
+		func( task );
+}
+
+void RayTracer::rayCastBatch( const Vec3f* origs, const Vec3f* dirs, int numRays, Hit* hits, MulticoreLauncher* launcher ) const
+{
+	BatchJob job = { this, origs, dirs, NULL, numRays, hits, NULL };
+	runBatch( rayCastBatchTask, job, launcher );
+}
+
+void RayTracer::occludedBatch( const Vec3f* origs, const Vec3f* dirs, int numRays, U8* results, MulticoreLauncher* launcher ) const
+{
+	BatchJob job = { this, origs, dirs, NULL, numRays, NULL, results };
+	runBatch( occludedBatchTask, job, launcher );
 }
 
 
@@ -19,6 +19,7 @@ class RTTriangle;
 class Bvh;
 class Node;
 class Hit;
+class MulticoreLauncher;
 
 //
 // The ray tracer uses its own, extremely simple interface for vertices and triangles.
@@ -51,15 +52,28 @@ public:
 	void				saveHierarchy			(const char* filename, const std::vector<RTTriangle>& triangles);
 	void				loadHierarchy			(const char* filename, const std::vector<RTTriangle>& triangles);
 
+	// Occlusion query for shadow and AO rays: true if anything is hit at
+	// orig + t*dir with t in (tmin, tmax). Stops at the first hit found.
+	bool				occluded				(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax) const;
+	bool				rayIntersectNodeOccluded(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax, const Node* node) const;
+
+	// Segment [orig, orig+dir], same as occluded(orig, dir, 0, 1)
 	bool				rayCastShadow			( const Vec3f& orig, const Vec3f& dir ) const;
-	bool				rayIntersectNodeShadow	(const Vec3f& orig, const Vec3f& dir, const float maxval, const Node* node) const;
 
 	// intersection functions
-	Hit					rayIntersectNode		(const Vec3f& orig, const Vec3f& dir, const float maxval, const Node* node) const;
-	Hit					rayIntersectTriangles	(const Vec3f& orig, const Vec3f& dir, int startPrim, int endPrim) const;
+	Hit					rayIntersectNode		(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax, const Node* node) const;
+	Hit					rayIntersectTriangles	(const Vec3f& orig, const Vec3f& dir, int startPrim, int endPrim, float tmin = 0.0f, float tmax = 1.0f) const;
 
+	// Closest hit on the segment [orig, orig+dir]
 	Hit					rayCast					(const Vec3f& orig, const Vec3f& dir) const;
-	bool			    rayCastAny				(const Vec3f& orig, const Vec3f& dir);
+	bool			    rayCastAny				(const Vec3f& orig, const Vec3f& dir) const;
+
+	// rayCast and occluded of numRays segments, the results of ray i go
+	// to hits[i] and occluded[i]. Large batches are traced sorted by direction
+	// octant and then along a Morton curve over their origins. Given a
+	// launcher the chunks of the batch run on its threads.
+	void				rayCastBatch			(const Vec3f* origs, const Vec3f* dirs, int numRays, Hit* hits, MulticoreLauncher* launcher = NULL) const;
+	void				occludedBatch			(const Vec3f* origs, const Vec3f* dirs, int numRays, U8* occluded, MulticoreLauncher* launcher = NULL) const;
 
 
 	// This function computes an MD5 checksum of the input scene data,
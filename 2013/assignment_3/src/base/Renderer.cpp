@@ -150,8 +150,11 @@ Vec4f Renderer::interpolateAttribute( const RTTriangle* tri, float a, float b, c
 
 Vec4f Renderer::computeShadingHeadlight( const RayTracer* rt, const MeshBase* mesh, const Hit& pHit, const CameraControls& cameraCtrl ) const
 {
-	// compute normal for intersected triangle instead (faceted shading)
-	Vec3f n = cross(*pHit.triangle->m_vertices[1] - *pHit.triangle->m_vertices[0], *pHit.triangle->m_vertices[2] - *pHit.triangle->m_vertices[0]).normalized();
+	// normal and diffuse color of the hit
+	const SurfaceInteraction si( pHit, mesh );
+
+	// use the normal of the intersected triangle (faceted shading)
+	const Vec3f& n = si.geometricNormal;
 
 	// dot with view ray direction <=> "headlight shading"
 	float d = fabs( dot( n, (pHit.intersection-cameraCtrl.getPosition()).normalized() ) );
@@ -159,9 +162,8 @@ Vec4f Renderer::computeShadingHeadlight( const RayTracer* rt, const MeshBase* me
 	// assign gray value (d,d,d)
 	Vec3f shade = d;
 	
-	// get diffuse color
-	const RTToMesh* map = (const RTToMesh*)pHit.triangle->m_userPointer;
-	Vec3f diffuse = mesh->material( map->submesh ).diffuse.getXYZ();
+	// get diffuse color, from the texture if there is one
+	Vec3f diffuse = si.albedo;
 	// uncomment this to shade in diffuse white
 	//Vec3f diffuse = 1;
 
@@ -175,9 +177,10 @@ Vec4f Renderer::computeShadingAmbientOcclusion( const RayTracer* rt, const MeshB
 	// Calculate a vector from the surface point to the camera
 	Vec3f surfaceToCam = (cameraCtrl.getPosition()-pHit.intersection).normalized();
 
-	// Compute intersection normal
+	// Intersection normal, of the triangle plane, and diffuse color
 	// Flip the normal if the camera is on the backside
-	Vec3f n = cross(*pHit.triangle->m_vertices[1] - *pHit.triangle->m_vertices[0], *pHit.triangle->m_vertices[2] - *pHit.triangle->m_vertices[0]).normalized();
+	const SurfaceInteraction si( pHit, mesh );
+	Vec3f n = si.geometricNormal;
 		
 	if ( dot(n, surfaceToCam) < 0.0f ) {
 		n *= -1.0f;
@@ -236,9 +239,7 @@ Vec4f Renderer::computeShadingAmbientOcclusion( const RayTracer* rt, const MeshB
 	switch (colorMode) {
 		case ColorMode::ColorMode_On:
 		{
-			const RTToMesh* map = (const RTToMesh*)pHit.triangle->m_userPointer;
-			Vec3f diffuse = mesh->material( map->submesh ).diffuse.getXYZ();
-			return Vec4f(color*diffuse, 1.0f);
+			return Vec4f(color*si.albedo, 1.0f);
 		}
 		case ColorMode::ColorMode_Off:
 		{
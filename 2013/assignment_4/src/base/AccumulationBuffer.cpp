@@ -0,0 +1,134 @@
+#include "AccumulationBuffer.hpp"
+
+#include <cfloat>
+#include <cstring>
+#include <malloc.h>
+#include <xmmintrin.h>
+
+// Alignment of the planes, every row starts on a 4 pixel boundary
+#define ACCUMULATION_ALIGNMENT 64
+
+// Smallest mean luminance relativeError divides by
+#define ACCUMULATION_ERROR_FLOOR 0.01f
+
+namespace FW
+{
+
+AccumulationBuffer::AccumulationBuffer(void) : m_data(NULL), m_r(NULL), m_g(NULL), m_b(NULL), m_w(NULL), m_l2(NULL), m_size(0), m_stride(0)
+{
+}
+
+AccumulationBuffer::~AccumulationBuffer(void)
+{
+	_aligned_free(m_data);
+}
+
+void AccumulationBuffer::reset(const Vec2i& size)
+{
+	if (m_data && size == m_size) {
+		clear();
+		return;
+	}
+	_aligned_free(m_data);
+
+	// Planes of whole cache lines keep the rows of all of them aligned
+	m_size = size;
+	m_stride = (size.x + 3) & ~3;
+	size_t plane = ((size_t)m_stride * size.y + 15) & ~(size_t)15;
+	m_data = (F32*)_aligned_malloc(FW::max(plane * 5, (size_t)16) * sizeof(F32), ACCUMULATION_ALIGNMENT);
+	m_r = m_data;
+	m_g = m_r + plane;
+	m_b = m_g + plane;
+	m_w = m_b + plane;
+	m_l2 = m_w + plane;
+	clear();
+}
+
+void AccumulationBuffer::clear(void)
+{
+	if (m_data)
+		memset(m_data, 0, (size_t)(m_g - m_r) * 5 * sizeof(F32));
+}
+
+float AccumulationBuffer::relativeError(int x, int y) const
+{
+	int ofs = y * m_stride + x;
+	float n = m_w[ofs];
+	if (n < 2.0f)
+		return FLT_MAX;
+
+	float mean = luminance(Vec3f(m_r[ofs], m_g[ofs], m_b[ofs])) / n;
+	float variance = FW::max((m_l2[ofs] - n * mean * mean) / (n - 1.0f), 0.0f);
+	return sqrt(variance / n) / FW::max(mean, ACCUMULATION_ERROR_FLOOR);
+}
+
+float AccumulationBuffer::maxRelativeError(const Vec2i& lo, const Vec2i& hi) const
+{
+	float e = 0.0f;
+	for (int y = lo.y; y < hi.y; ++y)
+		for (int x = lo.x; x < hi.x; ++x)
+			e = FW::max(e, relativeError(x, y));
+	return e;
+}
+
+void AccumulationBuffer::resolve(const Vec2i& lo, const Vec2i& hi, Vec4f* dest, int destStride) const
+{
+	for (int y = lo.y; y < hi.y; ++y)
+		resolveRow(y, lo.x, hi.x, dest + y * destStride);
+}
+
+void AccumulationBuffer::resolveSpan(int first, int end, Vec4f* dest, int destStride) const
+{
+	while (first < end) {
+		int y = first / m_size.x;
+		int x0 = first - y * m_size.x;
+		int x1 = FW::min(x0 + end - first, m_size.x);
+		resolveRow(y, x0, x1, dest + y * destStride);
+		first += x1 - x0;
+	}
+}
+
+void AccumulationBuffer::resolveRow(int y, int x0, int x1, Vec4f* dest) const
+{
+	const F32* r = m_r + y * m_stride;
+	const F32* g = m_g + y * m_stride;
+	const F32* b = m_b + y * m_stride;
+	const F32* w = m_w + y * m_stride;
+
+	// Up to the first aligned group of 4, then whole groups, then the rest
+	int x = x0;
+	for (; x < x1 && (x & 3) != 0; ++x) {
+		float s = (w[x] != 0.0f) ? 1.0f / w[x] : 0.0f;
+		dest[x] = Vec4f(r[x], g[x], b[x], w[x]) * s;
+	}
+
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	for (; x + 4 <= x1; x += 4) {
+		__m128 vr = _mm_load_ps(r + x);
+		__m128 vg = _mm_load_ps(g + x);
+		__m128 vb = _mm_load_ps(b + x);
+		__m128 vw = _mm_load_ps(w + x);
+
+		// 1/w where there are samples, 0 (not inf) where there are none
+		__m128 s = _mm_and_ps(_mm_div_ps(one, vw), _mm_cmpneq_ps(vw, zero));
+		vr = _mm_mul_ps(vr, s);
+		vg = _mm_mul_ps(vg, s);
+		vb = _mm_mul_ps(vb, s);
+		vw = _mm_mul_ps(vw, s);
+
+		// Planes to RGBA pixels
+		_MM_TRANSPOSE4_PS(vr, vg, vb, vw);
+		_mm_storeu_ps(&dest[x + 0].x, vr);
+		_mm_storeu_ps(&dest[x + 1].x, vg);
+		_mm_storeu_ps(&dest[x + 2].x, vb);
+		_mm_storeu_ps(&dest[x + 3].x, vw);
+	}
+
+	for (; x < x1; ++x) {
+		float s = (w[x] != 0.0f) ? 1.0f / w[x] : 0.0f;
+		dest[x] = Vec4f(r[x], g[x], b[x], w[x]) * s;
+	}
+}
+
+}
\ No newline at end of file
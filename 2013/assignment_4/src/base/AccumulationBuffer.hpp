@@ -0,0 +1,71 @@
+#pragma once
+
+#include "base/Math.hpp"
+
+namespace FW
+{
+
+// Running sums of the path tracer, one aligned float plane per channel (red,
+// green, blue, the number of samples and the sum of the squared luminances
+// for the variance) with rows padded to a multiple of 4 pixels. A pass gives
+// every pixel to exactly one task, so the tasks add to their pixels without
+// locks, and each resolves its own pixels into the display image when it is
+// done with them.
+class AccumulationBuffer
+{
+public:
+	AccumulationBuffer			(void);
+	~AccumulationBuffer			(void);
+
+	// Reallocates for an image of the given size if it differs, and clears
+	void			reset					(const Vec2i& size);
+	void			clear					(void);
+
+	const Vec2i&	getSize					(void) const	{ return m_size; }
+
+	void			add						(int x, int y, const Vec3f& c)
+	{
+		int ofs = y * m_stride + x;
+		m_r[ofs] += c.x;
+		m_g[ofs] += c.y;
+		m_b[ofs] += c.z;
+		m_w[ofs] += 1.0f;
+
+		float l = luminance(c);
+		m_l2[ofs] += l * l;
+	}
+
+	// Standard error of the mean luminance of a pixel relative to the mean,
+	// FLT_MAX with less than two samples. Dark pixels are measured against
+	// ACCUMULATION_ERROR_FLOOR instead of a mean close to zero.
+	float			relativeError			(int x, int y) const;
+	float			maxRelativeError		(const Vec2i& lo, const Vec2i& hi) const;
+
+	// Writes the mean of the samples of pixels [lo, hi) to an RGBA_Vec4f image
+	// with the given stride in pixels, four pixels at a time with SSE. Pixels
+	// without samples are written as zero.
+	void			resolve					(const Vec2i& lo, const Vec2i& hi, Vec4f* dest, int destStride) const;
+
+	// The same for a run of pixels in scanline order, which may span rows
+	void			resolveSpan				(int first, int end, Vec4f* dest, int destStride) const;
+
+private:
+	static float	luminance				(const Vec3f& c)	{ return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+	void			resolveRow				(int y, int x0, int x1, Vec4f* dest) const;
+
+private:
+	AccumulationBuffer			(const AccumulationBuffer&);	// forbidden
+	AccumulationBuffer&	operator=	(const AccumulationBuffer&);	// forbidden
+
+	F32*			m_data;
+	F32*			m_r;
+	F32*			m_g;
+	F32*			m_b;
+	F32*			m_w;
+	F32*			m_l2;
+	Vec2i			m_size;
+	int				m_stride;		// Floats per row of a plane
+};
+
+}
\ No newline at end of file
@@ -36,9 +36,23 @@ App::App(void)
 	m_renderer			(0),
 	m_RTMode			(false),
 	m_useRussianRoulette(false),
+	m_wavefront			(false),
+	m_tileSize			(Renderer::getTileSize()),
+	m_adaptive			(Renderer::getAdaptive()),
+	m_adaptiveWarmup	(Renderer::getAdaptiveWarmup()),
+	m_adaptiveTarget	(Renderer::getAdaptiveTarget()),
+	m_targetBatchTime	(Renderer::getTargetBatchTime()),
+	m_preview			(Renderer::getPreview()),
 	m_img				(Vec2i(10,10),ImageFormat::RGBA_Vec4f), // will get resized immediately
 	m_sequenceType		(Sequence::SequenceType_Random),
-	m_bvhMode			(Bvh::BvhMode_Spatial)
+	m_bvhMode			(Bvh::BvhMode_Spatial),
+	m_sahBins			(Bvh::getBinCount()),
+	m_splitBudget		(Bvh::getSplitBudget()),
+	m_rebuildThreshold	(RayTracer::getRebuildThreshold()),
+	m_bvhThreads		(MulticoreLauncher::getNumCores()),
+	m_reportBvhScaling	(false),
+	m_traversalMode		(RayTracer::TraversalMode_Wide8),
+	m_leafKernel		(LeafTriangles::Kernel_AVX)
 {
 	//
     m_commonCtrl.showFPS(true);
@@ -91,16 +105,46 @@ App::App(void)
 	// BVH modes
 	m_commonCtrl.addToggle((S32*)&m_bvhMode, Bvh::BvhMode_Spatial, FW_KEY_NONE, "BVH: Spatial split (reload scene)" );
 	m_commonCtrl.addToggle((S32*)&m_bvhMode, Bvh::BvhMode_SAH, FW_KEY_NONE, "BVH: SAH (reload scene)" );
+	m_commonCtrl.addToggle((S32*)&m_bvhMode, Bvh::BvhMode_BinnedSAH, FW_KEY_NONE, "BVH: Binned SAH (reload scene)" );
+	m_commonCtrl.addToggle((S32*)&m_bvhMode, Bvh::BvhMode_LBVH, FW_KEY_NONE, "BVH: LBVH (reload scene)" );
+	m_commonCtrl.addToggle((S32*)&m_bvhMode, Bvh::BvhMode_HLBVH, FW_KEY_NONE, "BVH: HLBVH, SAH over LBVH clusters (reload scene)" );
+	m_commonCtrl.addToggle((S32*)&m_bvhMode, Bvh::BvhMode_SBVH, FW_KEY_NONE, "BVH: SBVH, SAH with spatial splits (reload scene)" );
+	m_commonCtrl.addToggle(&m_reportBvhScaling,								FW_KEY_NONE,	"BVH: Report build speedup per thread count (reload scene)" );
+	m_commonCtrl.addSeparator();
+
+	// Traversal modes
+	m_commonCtrl.addToggle((S32*)&m_traversalMode, RayTracer::TraversalMode_Binary, FW_KEY_NONE, "Traversal: Binary BVH (reload scene)" );
+	m_commonCtrl.addToggle((S32*)&m_traversalMode, RayTracer::TraversalMode_Wide4, FW_KEY_NONE, "Traversal: 4-wide BVH, SSE (reload scene)" );
+	m_commonCtrl.addToggle((S32*)&m_traversalMode, RayTracer::TraversalMode_Wide8, FW_KEY_NONE, "Traversal: 8-wide BVH, AVX (reload scene)" );
+	m_commonCtrl.addToggle((S32*)&m_leafKernel, LeafTriangles::Kernel_Scalar, FW_KEY_NONE, "Leaf test: scalar (reload scene)" );
+	m_commonCtrl.addToggle((S32*)&m_leafKernel, LeafTriangles::Kernel_SSE, FW_KEY_NONE, "Leaf test: 4 triangles, SSE (reload scene)" );
+	m_commonCtrl.addToggle((S32*)&m_leafKernel, LeafTriangles::Kernel_AVX, FW_KEY_NONE, "Leaf test: 8 triangles, AVX (reload scene)" );
+	m_commonCtrl.addButton((S32*)&m_action, Action_BenchmarkTraversal,		FW_KEY_NONE,	"Traversal: Benchmark primary rays of the current view" );
+	m_commonCtrl.addButton((S32*)&m_action, Action_TraversalHeatmaps,		FW_KEY_NONE,	"Traversal: Heatmaps of the current view (writes heatmap_*.pfm)" );
 	m_commonCtrl.addSeparator();
 
 	// 
 	m_commonCtrl.addButton((S32*)&m_action, Action_PathTraceMode,			FW_KEY_INSERT,  "Path trace mode (INSERT)");
 	m_commonCtrl.addButton((S32*)&m_action, Action_PlaceLightSourceAtCamera,FW_KEY_SPACE,   "Place light at camera (SPACE)");
 	m_commonCtrl.addToggle(&m_useRussianRoulette,   						FW_KEY_NONE,	"Use Russian Roulette" );
+	m_commonCtrl.addToggle(&m_wavefront,									FW_KEY_NONE,	"Wavefront path tracing, stages over all pixels (restart path tracing)" );
+	m_commonCtrl.addToggle(&m_tileSize, 8,									FW_KEY_NONE,	"Path tracing tiles: 8x8 (restart path tracing)" );
+	m_commonCtrl.addToggle(&m_tileSize, 16,									FW_KEY_NONE,	"Path tracing tiles: 16x16 (restart path tracing)" );
+	m_commonCtrl.addToggle(&m_tileSize, 32,									FW_KEY_NONE,	"Path tracing tiles: 32x32 (restart path tracing)" );
+	m_commonCtrl.addToggle(&m_adaptive,										FW_KEY_NONE,	"Adaptive sampling, stop tracing tiles below the target error (restart path tracing)" );
+	m_commonCtrl.addToggle(&m_preview,										FW_KEY_NONE,	"Coarse preview at 1/16 and 1/4 of the pixels first (restart path tracing)" );
+	m_commonCtrl.addButton((S32*)&m_action, Action_WriteErrorMap,			FW_KEY_NONE,	"Adaptive sampling: Error map of the path traced image (writes error.pfm)" );
 
     m_commonCtrl.beginSliderStack();
     m_commonCtrl.addSlider(&m_numBounces, 0, 8, false, FW_KEY_NONE, FW_KEY_NONE, "Number of indirect bounces= %d");
     m_commonCtrl.addSlider(&m_lightSize, 0.01f, 2.0f, false, FW_KEY_NONE, FW_KEY_NONE, "Light source area= %f");
+    m_commonCtrl.addSlider(&m_adaptiveWarmup, 2, 64, false, FW_KEY_NONE, FW_KEY_NONE, "Adaptive sampling warm-up passes (restart path tracing)= %d");
+    m_commonCtrl.addSlider(&m_adaptiveTarget, 0.005f, 0.2f, true, FW_KEY_NONE, FW_KEY_NONE, "Adaptive sampling target relative error (restart path tracing)= %f");
+    m_commonCtrl.addSlider(&m_targetBatchTime, 0.0f, 2.0f, false, FW_KEY_NONE, FW_KEY_NONE, "Path tracing seconds per update, 0 = whole passes (restart path tracing)= %f");
+    m_commonCtrl.addSlider(&m_sahBins, 2, 64, false, FW_KEY_NONE, FW_KEY_NONE, "Binned SAH bins (reload scene)= %d");
+    m_commonCtrl.addSlider(&m_splitBudget, 0.0f, 1.0f, false, FW_KEY_NONE, FW_KEY_NONE, "SBVH duplication budget (reload scene)= %f");
+    m_commonCtrl.addSlider(&m_rebuildThreshold, 0.0f, 2.0f, false, FW_KEY_NONE, FW_KEY_NONE, "Rebuild BVH when refits grow SAH cost by (0 = never)= %f");
+    m_commonCtrl.addSlider(&m_bvhThreads, 1, MulticoreLauncher::getNumCores(), false, FW_KEY_NONE, FW_KEY_NONE, "BVH build threads (reload scene)= %d");
     m_commonCtrl.endSliderStack();
 
     m_window.setTitle("Assignment 4");
@@ -208,7 +252,9 @@ bool App::handleEvent(const Window::Event& ev)
         {
             Vec3f lo, hi;
             m_mesh->getBBox(lo, hi);
+            beginMeshEdit();
             m_mesh->xform(Mat4f::scale(Vec3f(2.0f / (hi - lo).max())) * Mat4f::translate((lo + hi) * -0.5f));
+            refitTracer();
         }
         break;
 
@@ -216,8 +262,10 @@ bool App::handleEvent(const Window::Event& ev)
         std::swap(mat.col(0), mat.col(1));
         if (m_mesh)
         {
+            beginMeshEdit();
             m_mesh->xform(mat);
             m_mesh->flipTriangles();
+            refitTracer();
         }
         break;
 
@@ -225,8 +273,10 @@ bool App::handleEvent(const Window::Event& ev)
         std::swap(mat.col(1), mat.col(2));
         if (m_mesh)
         {
+            beginMeshEdit();
             m_mesh->xform(mat);
             m_mesh->flipTriangles();
+            refitTracer();
         }
         break;
 
@@ -234,8 +284,10 @@ bool App::handleEvent(const Window::Event& ev)
         mat.col(2) = -mat.col(2);
         if (m_mesh)
         {
+            beginMeshEdit();
             m_mesh->xform(mat);
             m_mesh->flipTriangles();
+            refitTracer();
         }
         break;
 
@@ -257,7 +309,11 @@ bool App::handleEvent(const Window::Event& ev)
 
     case Action_FlipTriangles:
         if (m_mesh)
+        {
+            beginMeshEdit();
             m_mesh->flipTriangles();
+            refitTracer();
+        }
         break;
 
     case Action_CleanMesh:
@@ -300,6 +356,26 @@ bool App::handleEvent(const Window::Event& ev)
 	    m_commonCtrl.message("Placed light at camera");
 		break;
 
+	case Action_BenchmarkTraversal:
+		benchmarkTraversal();
+		break;
+
+	case Action_TraversalHeatmaps:
+		if ( m_rt )
+		{
+			m_renderer->renderTraversalHeatmaps( m_rt, m_cameraCtrl, m_window.getSize(), "heatmap" );
+			m_commonCtrl.message( "Traversal heatmaps written to heatmap_*.pfm" );
+		}
+		break;
+
+	case Action_WriteErrorMap:
+		if ( m_RTMode )
+		{
+			m_renderer->writeErrorMap( "error.pfm" );
+			m_commonCtrl.message( "Error map written to error.pfm" );
+		}
+		break;
+
 	case Action_PathTraceMode:
 		m_RTMode = !m_RTMode;
 		if( m_RTMode )
@@ -312,8 +388,15 @@ bool App::handleEvent(const Window::Event& ev)
 			}
 
 			Sampler::setSequenceMode(App::m_sequenceType);
-
-			m_renderer->startPathTracingProcess( m_mesh, m_areaLight, m_rt, &m_img, m_useRussianRoulette ? -m_numBounces : m_numBounces, m_cameraCtrl );
+			Renderer::setTileSize(m_tileSize);
+			Renderer::setAdaptive(m_adaptive);
+			Renderer::setAdaptiveWarmup(m_adaptiveWarmup);
+			Renderer::setAdaptiveTarget(m_adaptiveTarget);
+			Renderer::setTargetBatchTime(m_targetBatchTime);
+			Renderer::setPreview(m_preview);
+
+			m_renderer->startPathTracingProcess( m_mesh, m_areaLight, m_rt, &m_img, m_useRussianRoulette ? -m_numBounces : m_numBounces, m_cameraCtrl, m_wavefront );
+			m_pathTraceCamera = m_cameraCtrl.getWorldToCamera();
 		}
 		else
 		{
@@ -326,6 +409,10 @@ bool App::handleEvent(const Window::Event& ev)
         break;
     }
 
+    // Pick up a background BVH rebuild while no rays are being traced
+    if (m_rt && !m_RTMode && m_rt->finishRebuild())
+        m_commonCtrl.message("Swapped in the rebuilt BVH");
+
     m_window.setVisible(true);
 
     if (ev.type == Window::EventType_Paint)
@@ -391,14 +478,19 @@ void App::renderFrame(GLContext* gl)
 
 	if ( m_RTMode )
 	{
-		// if we are computing radiosity, refresh mesh colors every 0.5 seconds
-		if ( m_renderer->isRunning() && m_updateClock.getElapsed() > 0.5f )
+		// A moved camera starts over from the coarse preview
+		if ( m_cameraCtrl.getWorldToCamera() != m_pathTraceCamera )
+		{
+			m_pathTraceCamera = m_cameraCtrl.getWorldToCamera();
+			m_renderer->restartPathTracingProcess();
+		}
+
+		// Start the next batch as soon as the last one is done, the tasks write
+		// their tiles to m_img themselves
+		if ( m_renderer->isRunning() )
 		{
 			m_renderer->updatePicture( &m_img );
 			m_renderer->checkFinish();
-
-			// restart cycle
-			m_updateClock.start();
 		}
 
 		gl->drawImage( m_img, Vec2f(0) );
@@ -496,6 +588,14 @@ void App::loadMesh(const String& fileName)
 
 	// build the BVH!
 	Bvh::setBvhMode(m_bvhMode);
+	Bvh::setBinCount(m_sahBins);
+	Bvh::setSplitBudget(m_splitBudget);
+	Bvh::setNumThreads(m_bvhThreads);
+	Bvh::setReportScaling(m_reportBvhScaling);
+	RayTracer::setRebuildThreshold(m_rebuildThreshold);
+	RayTracer::setTraversalMode(m_traversalMode);
+	LeafTriangles::setKernel(m_leafKernel);
+	Bvh::setLeafWidth(LeafTriangles::getKernelWidth(LeafTriangles::getKernel()));
 	constructTracer();
 }
 
@@ -585,16 +685,14 @@ void App::constructTracer()
 	// ..
 	m_rt = new RayTracer();
 
-	const bool tryLoadHieararchy = false;
+	const bool tryLoadHieararchy = true;
 
 	if ( tryLoadHieararchy )
 	{
-		// check if saved hierarchy exists
+		// check if a saved hierarchy exists and matches the current BVH settings
 		String hierarchyCacheFile = String("Hierarchy-") + md5 + String(".bin");
-		if ( fileExists( hierarchyCacheFile.getPtr() ) )
+		if ( fileExists( hierarchyCacheFile.getPtr() ) && m_rt->loadHierarchy( hierarchyCacheFile.getPtr(), m_rtTriangles ) )
 		{
-			// yes, load!
-			m_rt->loadHierarchy( hierarchyCacheFile.getPtr(), m_rtTriangles );
 			::printf( "Loaded hierarchy from %s\n", hierarchyCacheFile.getPtr() );
 		}
 		else
@@ -618,6 +716,91 @@ void App::constructTracer()
 
 //------------------------------------------------------------------------
 
+// The path tracer and a background BVH rebuild read the mesh, the triangle
+// vertices and the tree that a vertex transform rewrites. The path tracing
+// tasks are drained and the rebuild is finished before the mesh is touched,
+// and refitTracer starts path tracing again.
+void App::beginMeshEdit()
+{
+	m_renderer->stopAndWait();
+	if ( m_rt )
+		m_rt->finishRebuild( true );
+}
+
+// Vertex transforms keep the topology, so instead of constructing a new tracer
+// the positions are copied over and the BVH is refit. Flipping also reverses
+// the winding, which is why the vertex order of each triangle is re-read.
+void App::refitTracer()
+{
+	if ( !m_rt || (int)m_rtVertices.size() != m_mesh->numVertices() )
+		return;
+
+	for ( int i = 0; i < m_mesh->numVertices(); ++i )
+		m_rtVertices[ i ] = m_mesh->getVertexAttrib( i, FW::MeshBase::AttribType_Position ).getXYZ();
+
+	for ( size_t i = 0; i < m_rtTriangles.size(); ++i )
+	{
+		const RTToMesh* map = (const RTToMesh*)m_rtTriangles[ i ].m_userPointer;
+		Vec3i vindices = m_mesh->indices( map->submesh )[ map->tri_idx ];
+		for ( int j = 0; j < 3; ++j )
+		{
+			m_rtTriangles[ i ].m_vertices[ j ] = &m_rtVertices[0] + vindices[j];
+			m_rtTriangles[ i ].m_vertexNormals[ j ] = &(m_mesh->getVertexPtr(vindices[j])->n);
+		}
+	}
+
+	RayTracer::setRebuildThreshold( m_rebuildThreshold );
+	m_rt->refitHierarchy();
+
+	if ( m_RTMode )
+		m_renderer->restartPathTracingProcess();
+}
+
+//------------------------------------------------------------------------
+
+// One ray through the center of each window pixel, set up like the primary
+// rays of the renderer, so that traversal kernels can be compared on a fixed
+// view. Decode a camera signature first to reproduce a measurement. The rays
+// are listed in 4x4 pixel blocks, the packets of the packet traversal.
+void App::benchmarkTraversal()
+{
+	if ( !m_rt )
+		return;
+
+	Vec2i size = m_window.getSize();
+	Mat4f worldToCamera = m_cameraCtrl.getWorldToCamera();
+	Mat4f invP = (Mat4f::fitToView(Vec2f(-1,-1), Vec2f(2,2), size) * m_cameraCtrl.getCameraToClip() * worldToCamera).inverted();
+
+	std::vector<Vec3f> origins, dirs;
+	origins.reserve( size.x * size.y );
+	dirs.reserve( size.x * size.y );
+	for ( int by = 0; by < size.y; by += 4 )
+	for ( int bx = 0; bx < size.x; bx += 4 )
+	{
+		for ( int j = by; j < FW::min( by + 4, size.y ); ++j )
+		for ( int i = bx; i < FW::min( bx + 4, size.x ); ++i )
+		{
+			float x = (i + 0.5f) * 2.0f / size.x - 1.0f;
+			float y = (j + 0.5f) * -2.0f / size.y + 1.0f;
+
+			Vec4f P0( x, y, 0.0f, 1.0f );
+			Vec4f P1( x, y, 1.0f, 1.0f );
+			Vec4f Roh = invP * P0;
+			Vec3f Ro = (Roh/Roh.w).getXYZ();
+			Vec4f Rdh = invP * P1;
+			Vec3f Rd = (Rdh/Rdh.w).getXYZ() - Ro;
+
+			origins.push_back( Ro );
+			dirs.push_back( Rd );
+		}
+	}
+
+	m_rt->benchmarkTraversal( origins, dirs );
+	m_commonCtrl.message( "Traversal benchmark printed to the console" );
+}
+
+//------------------------------------------------------------------------
+
 void App::downscaleTextures(MeshBase* mesh)
 {
     FW_ASSERT(mesh);
@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "RayTracer.hpp"
+#include "LeafTriangles.hpp"
 #include "AreaLight.hpp"
 #include "Renderer.hpp"
 #include "Sequence.hpp"
@@ -59,6 +60,9 @@ private:
 		Action_ComputeRadiosity,
 		Action_LoadRadiosity,
 		Action_SaveRadiosity,
+		Action_BenchmarkTraversal,
+		Action_TraversalHeatmaps,
+		Action_WriteErrorMap,
 
 		// 
     };
@@ -99,6 +103,9 @@ private:
 
 	// 
 	void			constructTracer	(void);
+	void			beginMeshEdit	(void);
+	void			refitTracer		(void);
+	void			benchmarkTraversal(void);
 	void			trace			(GLContext*, Image&);
 
 private:
@@ -116,9 +123,24 @@ private:
     CullMode        m_cullMode;
 	Sequence::SequenceType m_sequenceType;
 	Bvh::BvhMode	m_bvhMode;
+	int				m_sahBins;
+	float			m_splitBudget;
+	float			m_rebuildThreshold;
+	int				m_bvhThreads;
+	bool			m_reportBvhScaling;
+	RayTracer::TraversalMode m_traversalMode;
+	LeafTriangles::Kernel m_leafKernel;
 
 	bool								m_RTMode;
 	bool								m_useRussianRoulette;
+	bool								m_wavefront;
+	S32									m_tileSize;
+	bool								m_adaptive;
+	S32									m_adaptiveWarmup;
+	F32									m_adaptiveTarget;
+	F32									m_targetBatchTime;
+	bool								m_preview;
+	Mat4f								m_pathTraceCamera;	// World to camera the path tracer was started with
 	Image								m_img;
 
 	Renderer*							m_renderer;
@@ -130,7 +152,6 @@ private:
 	std::vector<RTToMesh>				m_rtMap;
 	int									m_numBounces;
 	float								m_lightSize;
-	Timer								m_updateClock;
 };
 
 //------------------------------------------------------------------------
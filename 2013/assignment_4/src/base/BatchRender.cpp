@@ -0,0 +1,493 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+// Entry point of assignment4_batch, which path traces a single image from the
+// command line without opening a window or creating a GL context, e.g.
+//
+//   assignment4_batch_x64_Release scenes/crytek-sponza/sponza.obj
+//       --camera "<signature from the App>" --spp 256 --bounces 2 --out sponza
+//
+// The camera, light, mesh, bounces and russian roulette can also come from a
+// state file saved by the App with Alt+number, the arguments after it override
+// them. The image goes to <out>.pfm and <out>.png and the statistics of the
+// run to <out>.json. Run without arguments for the list of options.
+
+#include "base/Main.hpp"
+#include "base/Thread.hpp"
+#include "base/Timer.hpp"
+#include "gui/Image.hpp"
+#include "3d/CameraControls.hpp"
+#include "3d/Mesh.hpp"
+#include "io/File.hpp"
+#include "io/StateDump.hpp"
+
+#include "RayTracer.hpp"
+#include "RTTriangle.hpp"
+#include "LeafTriangles.hpp"
+#include "AreaLight.hpp"
+#include "Renderer.hpp"
+#include "Sampler.hpp"
+#include "Bvh.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace FW;
+
+//------------------------------------------------------------------------
+
+#define DEFAULT_WIDTH		640
+#define DEFAULT_HEIGHT		480
+#define DEFAULT_SPP			64		// when neither --spp nor --time is given
+#define DEFAULT_LIGHT_SIZE	0.25f	// as in the App
+
+namespace
+{
+
+struct BatchSettings
+{
+	String						meshFileName;
+	String						stateFileName;
+	String						cameraSignature;
+	String						outPrefix;
+	Vec2i						size;
+	int							spp;
+	float						timeBudget;			// secs, 0 for none
+	int							bounces;
+	bool						russianRoulette;
+	bool						lightAtCamera;
+	float						lightSize;			// <= 0 keeps the size of the state file
+	float						lightEmission;		// <= 0 keeps the emission of the state file
+	Bvh::BvhMode				bvhMode;
+	RayTracer::TraversalMode	traversalMode;
+	Sequence::SequenceType		sequenceType;
+	int							numThreads;			// 0 for a thread per core
+	float						adaptiveTarget;		// 0 disables adaptive sampling
+	bool						wavefront;
+};
+
+const char* const s_bvhModeNames[]			= { "spatial", "sah", "binned", "lbvh", "hlbvh", "sbvh" };
+const char* const s_traversalModeNames[]	= { "binary", "wide4", "wide8" };
+const char* const s_sequenceTypeNames[]		= { "random", "regular", "stratified", "halton" };
+
+//------------------------------------------------------------------------
+
+void printUsage( void )
+{
+	::printf(
+		"Usage: assignment4_batch [mesh] [options]\n"
+		"\n"
+		"  --state <file>         App state file for the mesh, camera, light, bounces and russian roulette\n"
+		"  --camera <signature>   Camera signature as shown by the App, default from --state or fitted to the mesh\n"
+		"  --light-at-camera      Place the light at the camera, the default without --state\n"
+		"  --light-size <s>       Edge of the square light (%g without --state)\n"
+		"  --light-emission <E>   Emission of the light, the same on each channel\n"
+		"  --size <w>x<h>         Image size (%dx%d)\n"
+		"  --spp <n>              Full passes, i.e. samples per pixel (%d unless --time is given)\n"
+		"  --time <secs>          Stop after the batch running at this time, together with --spp whichever comes first\n"
+		"  --bounces <n>          Indirect bounces (1)\n"
+		"  --rr                   Russian roulette after the given bounces\n"
+		"  --bvh <mode>           spatial, sah, binned, lbvh, hlbvh or sbvh (spatial)\n"
+		"  --traversal <mode>     binary, wide4 or wide8 (wide8)\n"
+		"  --sequence <type>      random, regular, stratified or halton (random)\n"
+		"  --threads <n>          Threads for the BVH build and path tracing (a thread per core)\n"
+		"  --adaptive <error>     Adaptive sampling down to this relative error\n"
+		"  --wavefront            Wavefront passes instead of tiles\n"
+		"  --out <prefix>         Writes <prefix>.pfm, <prefix>.png and <prefix>.json (batch)\n",
+		DEFAULT_LIGHT_SIZE, DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_SPP );
+}
+
+// Index of name in names, or -1
+int findName( const char* name, const char* const* names, int numNames )
+{
+	for ( int i = 0; i < numNames; ++i )
+		if ( strcmp( name, names[i] ) == 0 )
+			return i;
+	return -1;
+}
+
+bool parseArguments( BatchSettings& s )
+{
+	s.size				= Vec2i( DEFAULT_WIDTH, DEFAULT_HEIGHT );
+	s.outPrefix			= "batch";
+	s.spp				= 0;
+	s.timeBudget		= 0.0f;
+	s.bounces			= -1;		// from the state file, or 1
+	s.russianRoulette	= false;
+	s.lightAtCamera		= false;
+	s.lightSize			= 0.0f;
+	s.lightEmission		= 0.0f;
+	s.bvhMode			= Bvh::BvhMode_Spatial;
+	s.traversalMode		= RayTracer::TraversalMode_Wide8;
+	s.sequenceType		= Sequence::SequenceType_Random;
+	s.numThreads		= 0;
+	s.adaptiveTarget	= 0.0f;
+	s.wavefront			= false;
+
+	for ( int i = 1; i < FW::argc; ++i )
+	{
+		const char* arg = FW::argv[i];
+		const char* value = (i + 1 < FW::argc) ? FW::argv[i + 1] : NULL;
+		bool hasValue = true;
+
+		if ( arg[0] != '-' )
+		{
+			s.meshFileName = arg;
+			continue;
+		}
+
+		if		( strcmp( arg, "--light-at-camera" ) == 0 )	{ s.lightAtCamera = true; hasValue = false; }
+		else if	( strcmp( arg, "--rr" ) == 0 )				{ s.russianRoulette = true; hasValue = false; }
+		else if	( strcmp( arg, "--wavefront" ) == 0 )		{ s.wavefront = true; hasValue = false; }
+		else if	( !value )
+		{
+			::printf( "Missing value for %s\n", arg );
+			return false;
+		}
+		else if	( strcmp( arg, "--state" ) == 0 )			s.stateFileName = value;
+		else if	( strcmp( arg, "--camera" ) == 0 )			s.cameraSignature = value;
+		else if	( strcmp( arg, "--out" ) == 0 )				s.outPrefix = value;
+		else if	( strcmp( arg, "--light-size" ) == 0 )		s.lightSize = (float)atof( value );
+		else if	( strcmp( arg, "--light-emission" ) == 0 )	s.lightEmission = (float)atof( value );
+		else if	( strcmp( arg, "--spp" ) == 0 )				s.spp = atoi( value );
+		else if	( strcmp( arg, "--time" ) == 0 )			s.timeBudget = (float)atof( value );
+		else if	( strcmp( arg, "--bounces" ) == 0 )			s.bounces = atoi( value );
+		else if	( strcmp( arg, "--threads" ) == 0 )			s.numThreads = atoi( value );
+		else if	( strcmp( arg, "--adaptive" ) == 0 )		s.adaptiveTarget = (float)atof( value );
+		else if	( strcmp( arg, "--size" ) == 0 )
+		{
+			if ( sscanf( value, "%dx%d", &s.size.x, &s.size.y ) != 2 || s.size.x <= 0 || s.size.y <= 0 )
+			{
+				::printf( "Invalid image size '%s'\n", value );
+				return false;
+			}
+		}
+		else if	( strcmp( arg, "--bvh" ) == 0 || strcmp( arg, "--traversal" ) == 0 || strcmp( arg, "--sequence" ) == 0 )
+		{
+			int idx;
+			if ( arg[2] == 'b' )
+				s.bvhMode = (Bvh::BvhMode)(idx = findName( value, s_bvhModeNames, FW_ARRAY_SIZE(s_bvhModeNames) ));
+			else if ( arg[2] == 't' )
+				s.traversalMode = (RayTracer::TraversalMode)(idx = findName( value, s_traversalModeNames, FW_ARRAY_SIZE(s_traversalModeNames) ));
+			else
+				s.sequenceType = (Sequence::SequenceType)(idx = findName( value, s_sequenceTypeNames, FW_ARRAY_SIZE(s_sequenceTypeNames) ));
+			if ( idx < 0 )
+			{
+				::printf( "Unknown value '%s' for %s\n", value, arg );
+				return false;
+			}
+		}
+		else
+		{
+			::printf( "Unknown option %s\n", arg );
+			return false;
+		}
+
+		if ( hasValue )
+			++i;
+	}
+
+	if ( s.spp < 0 || s.timeBudget < 0.0f || s.numThreads < 0 || s.adaptiveTarget < 0.0f )
+	{
+		::printf( "Negative --spp, --time, --threads or --adaptive\n" );
+		return false;
+	}
+	// the wavefront passes are never adaptive
+	if ( s.spp == 0 && s.timeBudget == 0.0f && (s.adaptiveTarget == 0.0f || s.wavefront) )
+		s.spp = DEFAULT_SPP;
+	return true;
+}
+
+// Reads a state file written by CommonControls::saveState, see CommonControls::loadState
+bool loadStateFile( const String& fileName, StateDump& dump )
+{
+	FILE* pF = fopen( fileName.getPtr(), "rb" );
+	if ( !pF )
+	{
+		::printf( "Unable to open state file '%s'\n", fileName.getPtr() );
+		return false;
+	}
+	fclose( pF );
+
+	String oldError = clearError();
+	{
+		File file( fileName, File::Read );
+		char tag[9];
+		file.readFully( tag, 8 );
+		tag[8] = 0;
+		if ( String(tag) != "FWState " )
+			setError( "Invalid state file!" );
+		if ( !hasError() )
+			file >> dump;
+	}
+	String newError = getError();
+
+	if ( restoreError( oldError ) )
+	{
+		::printf( "Unable to load state from '%s': %s\n", fileName.getPtr(), newError.getPtr() );
+		return false;
+	}
+	return true;
+}
+
+MeshWithColors* loadMesh( const String& fileName )
+{
+	String oldError = clearError();
+	MeshBase* imported = importMesh( fileName );
+	String newError = getError();
+
+	if ( restoreError( oldError ) )
+	{
+		delete imported;
+		::printf( "Error while loading '%s': %s\n", fileName.getPtr(), newError.getPtr() );
+		return NULL;
+	}
+
+	// convert to the colored format and fix the colors to white, as the App does
+	MeshWithColors* mesh = new MeshWithColors( *imported );
+	delete imported;
+	for ( S32 i = 0; i < mesh->numVertices(); ++i )
+		mesh->mutableVertex(i).c = Vec3f(1,1,1);
+	return mesh;
+}
+
+// Heaps the triangles of all the submeshes together for the BVH, see App::constructTracer
+void gatherTriangles( const MeshWithColors* mesh, std::vector<Vec3f>& vertices, std::vector<RTTriangle>& triangles, std::vector<RTToMesh>& map )
+{
+	vertices.reserve( mesh->numVertices() );
+	triangles.reserve( mesh->numTriangles() );
+	map.reserve( mesh->numTriangles() );
+
+	for ( int i = 0; i < mesh->numVertices(); ++i )
+		vertices.push_back( mesh->getVertexAttrib( i, FW::MeshBase::AttribType_Position ).getXYZ() );
+
+	for ( int i = 0; i < mesh->numSubmeshes(); ++i )
+	{
+		const Array<Vec3i>& idx = mesh->indices( i );
+		for ( int j = 0; j < idx.getSize(); ++j )
+		{
+			RTToMesh m;
+			m.submesh = i;
+			m.tri_idx = j;
+			map.push_back( m );
+			triangles.push_back( RTTriangle( &vertices[0] + idx[j][0], &vertices[0] + idx[j][1], &vertices[0] + idx[j][2] ) );
+		}
+	}
+
+	for ( size_t i = 0; i < triangles.size(); ++i )
+	{
+		triangles[ i ].m_userPointer = &map[ i ];
+		Vec3i vindices = mesh->indices( map[ i ].submesh )[ map[ i ].tri_idx ];
+		for ( int j = 0; j < 3; ++j )
+			triangles[ i ].m_vertexNormals[ j ] = &(mesh->getVertexPtr( vindices[j] )->n);
+	}
+}
+
+// s as a JSON string literal
+String jsonString( const String& s )
+{
+	String r( '"' );
+	for ( int i = 0; i < s.getLength(); ++i )
+	{
+		char c = s[i];
+		if ( c == '"' || c == '\\' )
+			r += '\\';
+		if ( (unsigned char)c < 0x20 )
+			r += sprintf( "\\u%04x", c );
+		else
+			r += c;
+	}
+	r += '"';
+	return r;
+}
+
+//------------------------------------------------------------------------
+
+int runBatch( void )
+{
+	BatchSettings s;
+	if ( FW::argc < 2 || !parseArguments( s ) )
+	{
+		printUsage();
+		return 1;
+	}
+
+	// The state file fills in what the arguments leave out
+	CameraControls camera;
+	AreaLight light;
+	int bounces = 1;
+	bool russianRoulette = false;
+	bool hasCamera = false;
+	if ( s.stateFileName.getLength() )
+	{
+		StateDump dump;
+		if ( !loadStateFile( s.stateFileName, dump ) )
+			return 1;
+
+		String meshFileName;
+		dump.pushOwner( "App" );
+		dump.get( meshFileName, "m_meshFileName" );
+		dump.get( (S32&)bounces, "m_numBounces" );
+		dump.get( russianRoulette, "m_useRussianRoulette" );
+		dump.popOwner();
+		camera.readState( dump );
+		light.readState( dump );
+		hasCamera = true;
+
+		if ( !s.meshFileName.getLength() )
+			s.meshFileName = meshFileName;
+	}
+	else
+	{
+		light.setSize( Vec2f( DEFAULT_LIGHT_SIZE ) );
+		s.lightAtCamera = true;
+	}
+
+	if ( s.bounces >= 0 )
+		bounces = s.bounces;
+	russianRoulette = russianRoulette || s.russianRoulette;
+
+	if ( !s.meshFileName.getLength() )
+	{
+		::printf( "No mesh given\n" );
+		return 1;
+	}
+
+	MeshWithColors* mesh = loadMesh( s.meshFileName );
+	if ( !mesh )
+		return 1;
+	::printf( "Loaded mesh from '%s', %d triangles\n", s.meshFileName.getPtr(), mesh->numTriangles() );
+
+	if ( s.cameraSignature.getLength() )
+	{
+		String oldError = clearError();
+		camera.decodeSignature( s.cameraSignature );
+		String newError = getError();
+		if ( restoreError( oldError ) )
+		{
+			::printf( "%s\n", newError.getPtr() );
+			delete mesh;
+			return 1;
+		}
+		hasCamera = true;
+	}
+	if ( !hasCamera )
+		camera.initForMesh( mesh );
+
+	if ( s.lightAtCamera )
+	{
+		light.setOrientation( camera.getCameraToWorld().getXYZ() );
+		light.setPosition( camera.getPosition() );
+	}
+	if ( s.lightSize > 0.0f )
+		light.setSize( Vec2f( s.lightSize ) );
+	if ( s.lightEmission > 0.0f )
+		light.setEmission( Vec3f( s.lightEmission ) );
+
+	// build the BVH with the settings of the App
+	int numThreads = s.numThreads > 0 ? s.numThreads : MulticoreLauncher::getNumCores();
+	Bvh::setBvhMode( s.bvhMode );
+	Bvh::setNumThreads( numThreads );
+	RayTracer::setTraversalMode( s.traversalMode );
+	LeafTriangles::setKernel( LeafTriangles::Kernel_AVX );
+	Bvh::setLeafWidth( LeafTriangles::getKernelWidth( LeafTriangles::getKernel() ) );
+
+	std::vector<Vec3f> rtVertices;
+	std::vector<RTTriangle> rtTriangles;
+	std::vector<RTToMesh> rtMap;
+	gatherTriangles( mesh, rtVertices, rtTriangles, rtMap );
+
+	Timer timer;
+	timer.start();
+	RayTracer* rt = new RayTracer();
+	rt->constructHierarchy( rtTriangles );
+	float buildTime = timer.getElapsed();
+	::printf( "BVH built in %.4f secs\n", buildTime );
+
+	// path trace until the pass limit, the adaptive target or the time budget
+	Sampler::setSequenceMode( s.sequenceType );
+	Renderer::setNumThreads( numThreads );
+	Renderer::setPassLimit( s.spp );
+	Renderer::setAdaptive( s.adaptiveTarget > 0.0f );
+	if ( s.adaptiveTarget > 0.0f )
+		Renderer::setAdaptiveTarget( s.adaptiveTarget );
+	Renderer::setPreview( false );
+
+	Image image( s.size, ImageFormat::RGBA_Vec4f );
+	Renderer* renderer = new Renderer;
+	renderer->startPathTracingProcess( mesh, &light, rt, &image, russianRoulette ? -bounces : bounces, camera, s.wavefront );
+
+	bool outOfTime = false;
+	timer.start();
+	while ( renderer->isRunning() )
+	{
+		Thread::sleep( 1 );
+		if ( !outOfTime && s.timeBudget > 0.0f && timer.getElapsed() >= s.timeBudget )
+		{
+			renderer->stop();
+			outOfTime = true;
+		}
+		renderer->checkFinish();
+	}
+	float renderTime = timer.getElapsed();
+
+	// image and statistics
+	String oldError = clearError();
+	exportImage( s.outPrefix + ".pfm", &image );
+	exportImage( s.outPrefix + ".png", &image );
+	String newError = getError();
+	bool exported = !restoreError( oldError );
+	if ( !exported )
+		::printf( "Error while writing '%s': %s\n", s.outPrefix.getPtr(), newError.getPtr() );
+
+	String jsonFileName = s.outPrefix + ".json";
+	FILE* json = fopen( jsonFileName.getPtr(), "wt" );
+	if ( json )
+	{
+		fprintf( json, "{\n" );
+		fprintf( json, "\t\"mesh\": %s,\n", jsonString( s.meshFileName ).getPtr() );
+		fprintf( json, "\t\"camera\": %s,\n", jsonString( camera.encodeSignature() ).getPtr() );
+		fprintf( json, "\t\"width\": %d,\n\t\"height\": %d,\n", s.size.x, s.size.y );
+		fprintf( json, "\t\"triangles\": %d,\n", mesh->numTriangles() );
+		fprintf( json, "\t\"bvh_mode\": \"%s\",\n", s_bvhModeNames[s.bvhMode] );
+		fprintf( json, "\t\"traversal\": \"%s\",\n", s_traversalModeNames[s.traversalMode] );
+		fprintf( json, "\t\"sequence\": \"%s\",\n", s_sequenceTypeNames[s.sequenceType] );
+		fprintf( json, "\t\"mode\": \"%s\",\n", s.wavefront ? "wavefront" : "scanline" );
+		fprintf( json, "\t\"threads\": %d,\n", numThreads );
+		fprintf( json, "\t\"bounces\": %d,\n", bounces );
+		fprintf( json, "\t\"russian_roulette\": %s,\n", russianRoulette ? "true" : "false" );
+		fprintf( json, "\t\"spp_limit\": %d,\n", s.spp );
+		fprintf( json, "\t\"time_budget_secs\": %g,\n", s.timeBudget );
+		fprintf( json, "\t\"adaptive_target\": %g,\n", s.adaptiveTarget );
+		fprintf( json, "\t\"bvh_build_secs\": %.4f,\n", buildTime );
+		fprintf( json, "\t\"passes\": %d,\n", renderer->getNumPasses() );
+		fprintf( json, "\t\"stopped_by_time\": %s,\n", outOfTime ? "true" : "false" );
+		fprintf( json, "\t\"render_secs\": %.4f,\n", renderTime );
+		fprintf( json, "\t\"trace_secs\": %.4f,\n", renderer->getTotalTime() );
+		fprintf( json, "\t\"paths_per_sec\": %.0f\n", renderer->getPathsPerSecond() );
+		fprintf( json, "}\n" );
+		fclose( json );
+		::printf( "Wrote %s.pfm, %s.png and %s\n", s.outPrefix.getPtr(), s.outPrefix.getPtr(), jsonFileName.getPtr() );
+	}
+	else
+	{
+		::printf( "Unable to write '%s'\n", jsonFileName.getPtr() );
+		exported = false;
+	}
+
+	delete renderer;
+	delete rt;
+	delete mesh;
+	return exported ? 0 : 1;
+}
+
+} // namespace
+
+//------------------------------------------------------------------------
+
+// No window is opened, so main() returns right after this
+void FW::init(void)
+{
+	FW::exitCode = runBatch();
+}
\ No newline at end of file
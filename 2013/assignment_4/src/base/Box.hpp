@@ -17,12 +17,31 @@ public:
 
 	~Box		(void);
 
-	__forceinline float	area () 
+	__forceinline float	area () const
 	{
 		Vec3f whd = FW::abs(max - min);
 		return 2.0f * (whd.x*whd.z + whd.x*whd.y + whd.z*whd.y);
 	}
 
+	// Reset to an inverted box so that the first grow() snaps to its argument
+	__forceinline void	clear ()
+	{
+		min = Vec3f(FLT_MAX);
+		max = Vec3f(-FLT_MAX);
+	}
+
+	__forceinline void	grow (const Vec3f& p)
+	{
+		min = FW::min(min, p);
+		max = FW::max(max, p);
+	}
+
+	__forceinline void	grow (const Box& b)
+	{
+		min = FW::min(min, b.min);
+		max = FW::max(max, b.max);
+	}
+
 	Vec3f		min;
 	Vec3f		max;
 };
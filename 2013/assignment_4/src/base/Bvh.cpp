@@ -7,13 +7,722 @@
 #include <map>
 #include <iostream>
 #include <algorithm>
+#include <cstring>
+#include <malloc.h>
+#include <intrin.h>
 
 #define EPSILON 0.000001f
+
+// Leaf size for the scalar leaf test. The SIMD tests take leaves of exactly
+// one group of the triangles they test at once.
 #define MAX_TRIANGLES_PER_LEAF 5
 
+// Binned SAH parameters
+#define MAX_SAH_BINS 256
+#define DEFAULT_SAH_BINS 16
+
+// Relative costs of a node traversal step and a leaf test of up to
+// getLeafWidth() triangles, used when evaluating the SAH cost of a finished tree
+#define SAH_TRAVERSAL_COST 1.0f
+#define SAH_INTERSECTION_COST 1.0f
+
+// Alignment of the compiled node array, two nodes per cache line
+#define FLAT_NODE_ALIGNMENT 64
+
+// Refits cut the tree into subtrees of at most this many nodes, one task each
+#define REFIT_SUBTREE_SIZE 8192
+
+// Parallel build parameters. Nodes larger than PARALLEL_SUBTREE_SIZE are split
+// on the calling thread with chunked bounds/partition passes, everything below
+// is built by independent subtree tasks.
+#define PARALLEL_SUBTREE_SIZE 4096
+#define PARALLEL_CHUNK_SIZE 4096
+#define MAX_PARALLEL_CHUNKS 256
+
+// LBVH parameters. Meshes below LBVH_SHORT_CODE_LIMIT triangles get 30-bit
+// Morton codes (4 radix passes), larger ones 63-bit codes (8 passes). The
+// HLBVH mode groups the triangles by the top LBVH_CLUSTER_BITS of their codes
+// and builds the tree above these clusters with binned SAH.
+#define LBVH_SHORT_CODE_LIMIT (1 << 20)
+#define LBVH_CLUSTER_BITS 12
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+// SBVH parameters. Spatial splits are only evaluated where the children of the
+// best object split overlap by more than SBVH_MIN_OVERLAP of the root area.
+// Each build may add SBVH_DEFAULT_BUDGET times the triangle count in extra
+// references; a split passes what it does not use on to its children.
+#define SBVH_MIN_OVERLAP 1e-5f
+#define SBVH_DEFAULT_BUDGET 0.3f
+
 namespace FW
 {
 
+// --------------------------------------------------------------------------
+// Chunked helpers for the parallel build. A primitive range is cut into
+// numChunks pieces and the partial results are merged in chunk order, so the
+// outcome is the same no matter how many threads end up running the chunks.
+
+static __forceinline int chunkBegin(int startPrim, int endPrim, int numChunks, int chunk)
+{
+	S64 count = endPrim - startPrim + 1;
+	return startPrim + (int)(count * chunk / numChunks);
+}
+
+static void launchChunks(MulticoreLauncher::TaskFunc func, void* data, int numChunks)
+{
+	// A single chunk is just run inline
+	if (numChunks <= 1) {
+		MulticoreLauncher::Task task;
+		task.launcher = NULL;
+		task.func = func;
+		task.data = data;
+		task.idx = 0;
+		task.result = NULL;
+		func(task);
+		return;
+	}
+
+	MulticoreLauncher launcher;
+	launcher.push(func, data, 0, numChunks);
+	launcher.popAll();
+}
+
+struct BoundsJob
+{
+	const std::vector<BuildPrim>*	prims;
+	int								startPrim;
+	int								endPrim;
+	int								numChunks;
+	std::vector<Box>				bounds;		// Triangle bounds per chunk
+	std::vector<Box>				centroids;	// Centroid bounds per chunk
+};
+
+static void boundsTask(MulticoreLauncher::Task& task)
+{
+	BoundsJob& job = *(BoundsJob*)task.data;
+	int begin = chunkBegin(job.startPrim, job.endPrim, job.numChunks, task.idx);
+	int end = chunkBegin(job.startPrim, job.endPrim, job.numChunks, task.idx+1);
+
+	Box& bounds = job.bounds[task.idx];
+	Box& centroids = job.centroids[task.idx];
+	bounds.clear();
+	centroids.clear();
+
+	for (int i = begin; i < end; ++i) {
+		const BuildPrim& p = (*job.prims)[i];
+		bounds.grow(p.bounds);
+		centroids.grow(p.centroid);
+	}
+}
+
+// Computes both the triangle bounds and the centroid bounds of a range
+static void reduceBounds(const std::vector<BuildPrim>& prims, int startPrim, int endPrim, int numChunks, Box& bounds, Box& centroids)
+{
+	BoundsJob job;
+	job.prims = &prims;
+	job.startPrim = startPrim;
+	job.endPrim = endPrim;
+	job.numChunks = numChunks;
+	job.bounds.resize(numChunks);
+	job.centroids.resize(numChunks);
+
+	launchChunks(boundsTask, &job, numChunks);
+
+	bounds.clear();
+	centroids.clear();
+	for (int c = 0; c < numChunks; ++c) {
+		bounds.grow(job.bounds[c]);
+		centroids.grow(job.centroids[c]);
+	}
+}
+
+struct SAHBin
+{
+	Box		bounds;
+	int		count;
+};
+
+static __forceinline int binIndex(float centroid, float axisMin, float binScale, int numBins)
+{
+	return FW::min((int)((centroid - axisMin) * binScale), numBins-1);
+}
+
+struct BinJob
+{
+	const std::vector<BuildPrim>*	prims;
+	int								startPrim;
+	int								endPrim;
+	int								numChunks;
+	int								numBins;
+	Box								centroidBounds;
+	Vec3f							binScale;	// Zero on axes with no centroid extent
+	std::vector<SAHBin>				bins;		// numChunks x 3 axes x numBins
+};
+
+static void binTask(MulticoreLauncher::Task& task)
+{
+	BinJob& job = *(BinJob*)task.data;
+	int begin = chunkBegin(job.startPrim, job.endPrim, job.numChunks, task.idx);
+	int end = chunkBegin(job.startPrim, job.endPrim, job.numChunks, task.idx+1);
+
+	SAHBin* bins = &job.bins[task.idx * 3 * job.numBins];
+	for (int b = 0; b < 3 * job.numBins; ++b) {
+		bins[b].bounds.clear();
+		bins[b].count = 0;
+	}
+
+	for (int i = begin; i < end; ++i) {
+		const BuildPrim& p = (*job.prims)[i];
+		for (int axis = 0; axis < 3; ++axis) {
+			if (job.binScale[axis] == 0.0f)
+				continue;
+
+			SAHBin& bin = bins[axis * job.numBins + binIndex(p.centroid[axis], job.centroidBounds.min[axis], job.binScale[axis], job.numBins)];
+			bin.bounds.grow(p.bounds);
+			bin.count++;
+		}
+	}
+}
+
+// Split predicate of the spatial median mode
+struct SpatialSplit
+{
+	int		axis;
+	float	mid;
+
+	__forceinline bool operator() (const BuildPrim& p) const
+	{
+		return p.centroid[axis] > mid;
+	}
+};
+
+// Split predicate of the binned SAH mode, left side = bins below the split bin
+struct BinSplit
+{
+	int		axis;
+	int		bin;
+	int		numBins;
+	float	axisMin;
+	float	binScale;
+
+	__forceinline bool operator() (const BuildPrim& p) const
+	{
+		return binIndex(p.centroid[axis], axisMin, binScale, numBins) < bin;
+	}
+};
+
+template <class Pred>
+struct PartitionJob
+{
+	std::vector<BuildPrim>*			prims;
+	int								startPrim;
+	int								endPrim;
+	int								numChunks;
+	Pred							pred;
+	std::vector<int>				leftOffsets;	// Per chunk left count, then output offset
+	std::vector<int>				rightOffsets;
+	std::vector<BuildPrim>			scratch;
+};
+
+template <class Pred>
+static void partitionCountTask(MulticoreLauncher::Task& task)
+{
+	PartitionJob<Pred>& job = *(PartitionJob<Pred>*)task.data;
+	int begin = chunkBegin(job.startPrim, job.endPrim, job.numChunks, task.idx);
+	int end = chunkBegin(job.startPrim, job.endPrim, job.numChunks, task.idx+1);
+
+	int left = 0;
+	for (int i = begin; i < end; ++i) {
+		const BuildPrim& p = (*job.prims)[i];
+		job.scratch[i - job.startPrim] = p;
+		if (job.pred(p))
+			++left;
+	}
+	job.leftOffsets[task.idx] = left;
+	job.rightOffsets[task.idx] = (end - begin) - left;
+}
+
+template <class Pred>
+static void partitionScatterTask(MulticoreLauncher::Task& task)
+{
+	PartitionJob<Pred>& job = *(PartitionJob<Pred>*)task.data;
+	int begin = chunkBegin(job.startPrim, job.endPrim, job.numChunks, task.idx);
+	int end = chunkBegin(job.startPrim, job.endPrim, job.numChunks, task.idx+1);
+
+	int left = job.leftOffsets[task.idx];
+	int right = job.rightOffsets[task.idx];
+	for (int i = begin; i < end; ++i) {
+		const BuildPrim& p = job.scratch[i - job.startPrim];
+		if (job.pred(p))
+			(*job.prims)[left++] = p;
+		else
+			(*job.prims)[right++] = p;
+	}
+}
+
+// Stable partition of the range, returns the index of the first primitive on
+// the right side. The chunked version produces exactly the std::stable_partition
+// order, which keeps the parallel build identical to the serial one.
+template <class Pred>
+static int stablePartition(std::vector<BuildPrim>& prims, int startPrim, int endPrim, const Pred& pred, int numChunks)
+{
+	if (numChunks <= 1)
+		return std::stable_partition(prims.begin()+startPrim, prims.begin()+endPrim+1, pred) - prims.begin();
+
+	PartitionJob<Pred> job;
+	job.prims = &prims;
+	job.startPrim = startPrim;
+	job.endPrim = endPrim;
+	job.numChunks = numChunks;
+	job.pred = pred;
+	job.leftOffsets.resize(numChunks);
+	job.rightOffsets.resize(numChunks);
+	job.scratch.resize(endPrim - startPrim + 1);
+
+	launchChunks(partitionCountTask<Pred>, &job, numChunks);
+
+	// Turn the counts into output offsets
+	int totalLeft = 0;
+	for (int c = 0; c < numChunks; ++c)
+		totalLeft += job.leftOffsets[c];
+
+	int left = startPrim;
+	int right = startPrim + totalLeft;
+	for (int c = 0; c < numChunks; ++c) {
+		int leftCount = job.leftOffsets[c];
+		int rightCount = job.rightOffsets[c];
+		job.leftOffsets[c] = left;
+		job.rightOffsets[c] = right;
+		left += leftCount;
+		right += rightCount;
+	}
+
+	launchChunks(partitionScatterTask<Pred>, &job, numChunks);
+
+	return startPrim + totalLeft;
+}
+
+// --------------------------------------------------------------------------
+// LBVH helpers. The triangles are sorted along a Morton curve laid over their
+// centroid bounds, and the hierarchy is read off the sorted codes: each node
+// splits its range where the highest bit that differs within the range flips.
+
+// Spreads the low 10 bits of v out so that there are two zero bits between each
+static __forceinline U64 expandBits10(U64 v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x30000ffull;
+	v = (v | (v << 8)) & 0x300f00full;
+	v = (v | (v << 4)) & 0x30c30c3ull;
+	v = (v | (v << 2)) & 0x9249249ull;
+	return v;
+}
+
+// Same for the low 21 bits
+static __forceinline U64 expandBits21(U64 v)
+{
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x1f00000000ffffull;
+	v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+	v = (v | (v << 8)) & 0x100f00f00f00f00full;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+	v = (v | (v << 2)) & 0x1249249249249249ull;
+	return v;
+}
+
+U64 Bvh::mortonCode(U64 x, U64 y, U64 z, int bitsPerAxis)
+{
+	if (bitsPerAxis == 10)
+		return (expandBits10(x) << 2) | (expandBits10(y) << 1) | expandBits10(z);
+	else
+		return (expandBits21(x) << 2) | (expandBits21(y) << 1) | expandBits21(z);
+}
+
+static __forceinline int highestBit(U64 x)
+{
+	unsigned long idx;
+	if (_BitScanReverse(&idx, (unsigned long)(x >> 32)))
+		return (int)idx + 32;
+	_BitScanReverse(&idx, (unsigned long)x);
+	return (int)idx;
+}
+
+// Index of the first code in [first, last] that has the highest differing bit of the range set
+static int mortonSplit(const U64* codes, int first, int last)
+{
+	// Identical codes, just halve the range
+	if (codes[first] == codes[last])
+		return first + (last - first + 1) / 2;
+
+	// The codes are sorted, so the bit is clear up to some index and set after it
+	int bit = highestBit(codes[first] ^ codes[last]);
+	int lo = first;
+	int hi = last;
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+		if ((codes[mid] >> bit) & 1)
+			hi = mid;
+		else
+			lo = mid;
+	}
+	return hi;
+}
+
+struct MortonJob
+{
+	const std::vector<BuildPrim>*	prims;
+	int								numChunks;
+	int								bitsPerAxis;
+	Vec3f							origin;
+	Vec3f							scale;		// Maps the centroid bounds to [0, 2^bitsPerAxis)
+	U64*							codes;
+	S32*							indices;
+};
+
+static void mortonTask(MulticoreLauncher::Task& task)
+{
+	MortonJob& job = *(MortonJob*)task.data;
+	int count = (int)job.prims->size();
+	int begin = chunkBegin(0, count-1, job.numChunks, task.idx);
+	int end = chunkBegin(0, count-1, job.numChunks, task.idx+1);
+	float maxCell = (float)((1 << job.bitsPerAxis) - 1);
+
+	for (int i = begin; i < end; ++i) {
+		Vec3f p = ((*job.prims)[i].centroid - job.origin) * job.scale;
+		U64 x = (U64)FW::clamp(p.x, 0.0f, maxCell);
+		U64 y = (U64)FW::clamp(p.y, 0.0f, maxCell);
+		U64 z = (U64)FW::clamp(p.z, 0.0f, maxCell);
+
+		job.codes[i] = Bvh::mortonCode(x, y, z, job.bitsPerAxis);
+		job.indices[i] = i;
+	}
+}
+
+struct RadixJob
+{
+	int								count;
+	int								numChunks;
+	int								shift;
+	const U64*						keysIn;
+	const S32*						valuesIn;
+	U64*							keysOut;
+	S32*							valuesOut;
+	std::vector<int>				offsets;	// numChunks x RADIX_SIZE, digit counts, then output offsets
+};
+
+static void radixCountTask(MulticoreLauncher::Task& task)
+{
+	RadixJob& job = *(RadixJob*)task.data;
+	int begin = chunkBegin(0, job.count-1, job.numChunks, task.idx);
+	int end = chunkBegin(0, job.count-1, job.numChunks, task.idx+1);
+
+	int* counts = &job.offsets[task.idx * RADIX_SIZE];
+	for (int d = 0; d < RADIX_SIZE; ++d)
+		counts[d] = 0;
+	for (int i = begin; i < end; ++i)
+		counts[(job.keysIn[i] >> job.shift) & (RADIX_SIZE-1)]++;
+}
+
+static void radixScatterTask(MulticoreLauncher::Task& task)
+{
+	RadixJob& job = *(RadixJob*)task.data;
+	int begin = chunkBegin(0, job.count-1, job.numChunks, task.idx);
+	int end = chunkBegin(0, job.count-1, job.numChunks, task.idx+1);
+
+	int* offsets = &job.offsets[task.idx * RADIX_SIZE];
+	for (int i = begin; i < end; ++i) {
+		int dst = offsets[(job.keysIn[i] >> job.shift) & (RADIX_SIZE-1)]++;
+		job.keysOut[dst] = job.keysIn[i];
+		job.valuesOut[dst] = job.valuesIn[i];
+	}
+}
+
+// Stable LSD radix sort of the (key, value) pairs on the low keyBits of the keys
+void Bvh::radixSort(std::vector<U64>& keys, std::vector<S32>& values, int keyBits, int numChunks)
+{
+	int count = (int)keys.size();
+	if (count <= 1)
+		return;
+
+	std::vector<U64> keysTmp(count);
+	std::vector<S32> valuesTmp(count);
+
+	RadixJob job;
+	job.count = count;
+	job.numChunks = numChunks;
+	job.offsets.resize(numChunks * RADIX_SIZE);
+
+	for (int shift = 0; shift < keyBits; shift += RADIX_BITS) {
+		job.shift = shift;
+		job.keysIn = &keys[0];
+		job.valuesIn = &values[0];
+		job.keysOut = &keysTmp[0];
+		job.valuesOut = &valuesTmp[0];
+
+		launchChunks(radixCountTask, &job, numChunks);
+
+		// Digit-major, chunk-minor prefix sum keeps the sort stable
+		int sum = 0;
+		for (int d = 0; d < RADIX_SIZE; ++d) {
+			for (int c = 0; c < numChunks; ++c) {
+				int n = job.offsets[c * RADIX_SIZE + d];
+				job.offsets[c * RADIX_SIZE + d] = sum;
+				sum += n;
+			}
+		}
+
+		launchChunks(radixScatterTask, &job, numChunks);
+
+		keys.swap(keysTmp);
+		values.swap(valuesTmp);
+	}
+}
+
+template <class T>
+struct GatherJob
+{
+	const std::vector<T>*			src;
+	std::vector<T>*					dst;
+	const S32*						indices;
+	int								numChunks;
+};
+
+template <class T>
+static void gatherTask(MulticoreLauncher::Task& task)
+{
+	GatherJob<T>& job = *(GatherJob<T>*)task.data;
+	int count = (int)job.dst->size();
+	int begin = chunkBegin(0, count-1, job.numChunks, task.idx);
+	int end = chunkBegin(0, count-1, job.numChunks, task.idx+1);
+
+	for (int i = begin; i < end; ++i)
+		(*job.dst)[i] = (*job.src)[job.indices[i]];
+}
+
+// Replaces v with the elements v[indices[0]], v[indices[1]], ...
+template <class T>
+static void gather(std::vector<T>& v, const std::vector<S32>& indices, int numChunks)
+{
+	std::vector<T> sorted(indices.size());
+	if (!indices.empty()) {
+		GatherJob<T> job;
+		job.src = &v;
+		job.dst = &sorted;
+		job.indices = &indices[0];
+		job.numChunks = FW::min(numChunks, (int)indices.size());
+		launchChunks(gatherTask<T>, &job, job.numChunks);
+	}
+	v.swap(sorted);
+}
+
+// A run of triangles sharing the top LBVH_CLUSTER_BITS of their Morton codes
+struct LBVHCluster
+{
+	int								begin;		// Range in the Morton sorted order
+	int								count;
+	Box								bounds;
+	Vec3f							centroid;	// Center of the bounds
+};
+
+struct ClusterBoundsJob
+{
+	const std::vector<BuildPrim>*	prims;
+	const S32*						indices;	// Morton sorted primitive indices
+	std::vector<LBVHCluster>*		clusters;
+	int								numChunks;
+};
+
+static void clusterBoundsTask(MulticoreLauncher::Task& task)
+{
+	ClusterBoundsJob& job = *(ClusterBoundsJob*)task.data;
+	int numClusters = (int)job.clusters->size();
+	int begin = chunkBegin(0, numClusters-1, job.numChunks, task.idx);
+	int end = chunkBegin(0, numClusters-1, job.numChunks, task.idx+1);
+
+	for (int c = begin; c < end; ++c) {
+		LBVHCluster& cluster = (*job.clusters)[c];
+		cluster.bounds.clear();
+		for (int i = cluster.begin; i < cluster.begin + cluster.count; ++i)
+			cluster.bounds.grow((*job.prims)[job.indices[i]].bounds);
+		cluster.centroid = (cluster.bounds.min + cluster.bounds.max) * 0.5f;
+	}
+}
+
+// Binned SAH split of the clusters [first, last], weighted by triangle counts.
+// Returns the index of the first cluster of the right side after partitioning.
+static int splitClustersSAH(std::vector<LBVHCluster>& clusters, int first, int last, int numBins)
+{
+	SAHBin bins[MAX_SAH_BINS];
+	float rightArea[MAX_SAH_BINS];
+	int rightCount[MAX_SAH_BINS];
+
+	Box centroidBounds;
+	centroidBounds.clear();
+	for (int c = first; c <= last; ++c)
+		centroidBounds.grow(clusters[c].centroid);
+	Vec3f extent = centroidBounds.max - centroidBounds.min;
+
+	float bestCost = FLT_MAX;
+	int bestAxis = -1;
+	int bestBin = -1;
+
+	for (int axis = 0; axis < 3; ++axis) {
+		if (extent[axis] <= 0.0f)
+			continue;
+
+		float binScale = numBins / extent[axis];
+		for (int b = 0; b < numBins; ++b) {
+			bins[b].bounds.clear();
+			bins[b].count = 0;
+		}
+		for (int c = first; c <= last; ++c) {
+			SAHBin& bin = bins[binIndex(clusters[c].centroid[axis], centroidBounds.min[axis], binScale, numBins)];
+			bin.bounds.grow(clusters[c].bounds);
+			bin.count += clusters[c].count;
+		}
+
+		Box accum;
+		accum.clear();
+		int count = 0;
+		for (int b = numBins-1; b > 0; --b) {
+			accum.grow(bins[b].bounds);
+			count += bins[b].count;
+			rightArea[b] = count ? accum.area() : 0.0f;
+			rightCount[b] = count;
+		}
+
+		accum.clear();
+		count = 0;
+		for (int b = 1; b < numBins; ++b) {
+			accum.grow(bins[b-1].bounds);
+			count += bins[b-1].count;
+			if (count == 0 || rightCount[b] == 0)
+				continue;
+
+			float cost = accum.area() * Bvh::leafTests(count) + rightArea[b] * Bvh::leafTests(rightCount[b]);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
+	}
+
+	// No split separates the centroids, halve the cluster list
+	if (bestAxis == -1)
+		return first + (last - first + 1) / 2;
+
+	float axisMin = centroidBounds.min[bestAxis];
+	float binScale = numBins / extent[bestAxis];
+	return (int)(std::stable_partition(clusters.begin()+first, clusters.begin()+last+1, [&](const LBVHCluster& c) -> bool {
+					return binIndex(c.centroid[bestAxis], axisMin, binScale, numBins) < bestBin; }) - clusters.begin());
+}
+
+struct LBVHSubtreeJob
+{
+	Bvh*							bvh;
+	std::vector<Node*>*				subtrees;
+	const U64*						codes;
+};
+
+struct SubtreeJob
+{
+	Bvh*							bvh;
+	std::vector<Node*>*				subtrees;
+};
+
+struct RefitJob
+{
+	Bvh*							bvh;
+	std::vector<S32>				begins;		// Node range of each subtree
+	std::vector<S32>				ends;
+};
+
+// --------------------------------------------------------------------------
+// SBVH helpers. A reference is the part of a triangle inside its bounds.
+// Spatial splits clip the references they cut, so one triangle can end up in
+// several leaves, each time with bounds that only cover its piece.
+
+struct SbvhRef
+{
+	Box								bounds;
+	S32								tri;		// Input index of the triangle
+};
+
+struct SbvhSubtree
+{
+	Node*							node;
+	std::vector<SbvhRef>			refs;		// References to build from
+	std::vector<SbvhRef>			leafRefs;	// References in leaf order, filled by the task
+	int								budget;
+};
+
+struct SbvhSubtreeJob
+{
+	Bvh*							bvh;
+	std::vector<SbvhSubtree>*		subtrees;
+	std::vector<int>				order;		// Subtree per task, largest first
+	float							minOverlap;
+};
+
+static __forceinline bool isValidBox(const Box& b)
+{
+	return b.min.x <= b.max.x && b.min.y <= b.max.y && b.min.z <= b.max.z;
+}
+
+static __forceinline Box intersectBoxes(const Box& a, const Box& b)
+{
+	return Box(FW::max(a.min, b.min), FW::min(a.max, b.max));
+}
+
+// Bounds of the triangle piece of ref on either side of the plane axis = pos.
+// A side the piece does not reach comes back as an invalid box.
+static void splitReference(const RTTriangle& t, const SbvhRef& ref, int axis, float pos, Box& left, Box& right)
+{
+	left.clear();
+	right.clear();
+
+	for (int i = 0; i < 3; ++i) {
+		const Vec3f& v0 = *t.m_vertices[i];
+		const Vec3f& v1 = *t.m_vertices[(i+1) % 3];
+		float a0 = v0[axis];
+		float a1 = v1[axis];
+
+		if (a0 <= pos)
+			left.grow(v0);
+		if (a0 >= pos)
+			right.grow(v0);
+
+		// Edges crossing the plane add their intersection point to both sides
+		if ((a0 < pos && a1 > pos) || (a0 > pos && a1 < pos)) {
+			Vec3f p = v0 + (v1 - v0) * FW::clamp((pos - a0) / (a1 - a0), 0.0f, 1.0f);
+			p[axis] = pos;
+			left.grow(p);
+			right.grow(p);
+		}
+	}
+
+	left = intersectBoxes(left, ref.bounds);
+	right = intersectBoxes(right, ref.bounds);
+}
+
+// Shifts the triangle ranges of a subtree built into its own reference list
+static void offsetPrims(Node* root, int offset)
+{
+	std::vector<Node*> stack(1, root);
+	while (!stack.empty()) {
+		Node* n = stack.back();
+		stack.pop_back();
+		n->startPrim += offset;
+		n->endPrim += offset;
+		if (n->leftChild) {
+			stack.push_back(n->leftChild);
+			stack.push_back(n->rightChild);
+		}
+	}
+}
+
 // --------------------------------------------------------------------------
 
 
@@ -31,66 +740,367 @@ Node::~Node(void)
 
 // --------------------------------------------------------------------------
 Bvh::BvhMode Bvh::mode = Bvh::BvhMode_Spatial;
+int Bvh::binCount = DEFAULT_SAH_BINS;
+int Bvh::numThreads = 0;
+bool Bvh::reportScaling = false;
+float Bvh::splitBudget = SBVH_DEFAULT_BUDGET;
+int Bvh::leafWidth = 1;
 
-Bvh::Bvh(std::vector<RTTriangle>& triangles) : m_triangles(&triangles), m_root(new Node(0, (int)(triangles.size()-1)))
+Bvh::Bvh(std::vector<RTTriangle>& triangles) : m_triangles(&triangles), m_root(new Node(0, (int)(triangles.size()-1))), m_nodes(NULL), m_ownsNodes(true)
 {
+	int threads = numThreads > 0 ? numThreads : MulticoreLauncher::getNumCores();
+
+	// The build reorders the triangles, keep the input order for the scaling runs
+	std::vector<RTTriangle> original;
+	if (reportScaling)
+		original = triangles;
+
+	m_stats.numTriangles = (S32)triangles.size();
+
 	Timer stopwatch;
 	stopwatch.start();
-	constructTree(m_root);
+	build(threads);
+	flatten();
 	stopwatch.end();
+	m_buildSahCost = m_stats.sahCost;
 
 	std::cout << "BVH construction complete:" << std::endl;
 	std::cout << "--------------------------" << std::endl;
-	std::cout << "BVH mode.....: " << (mode ? "SAH" : "Spatial") << std::endl;
+	std::cout << "BVH mode.....: " << getBvhModeName(mode) << std::endl;
+	if (mode == BvhMode_BinnedSAH || mode == BvhMode_HLBVH || mode == BvhMode_SBVH)
+		std::cout << "SAH bins.....: " << binCount << std::endl;
+	if (mode == BvhMode_SBVH)
+		std::cout << "Split budget.: " << splitBudget << std::endl;
+	if (mode == BvhMode_LBVH || mode == BvhMode_HLBVH)
+		std::cout << "Morton bits..: " << (triangles.size() < LBVH_SHORT_CODE_LIMIT ? 30 : 63) << std::endl;
+	std::cout << "Threads......: " << threads << std::endl;
 	std::cout << "Build time...: " << stopwatch.getTotal() << " sec" << std::endl;
 	std::cout << "Total nodes..: " << getNumOfNodes() << std::endl;
 	std::cout << "Leaf nodes...: " << getNumOfLeafNodes() << std::endl;
-	std::cout << "Maximum depth: " << getDepth() << std::endl << std::endl;
+	std::cout << "Maximum depth: " << getDepth() << std::endl;
+	std::cout << "SAH cost.....: " << getSAHCost() << std::endl;
+	std::cout << "Duplication..: " << getDuplicationRatio() << "x (" << m_stats.numReferences << " references)" << std::endl << std::endl;
+
+	if (reportScaling)
+		measureScaling(original, stopwatch.getTotal());
+}
+
+Bvh::Bvh(std::vector<RTTriangle>& triangles, int threads) : m_triangles(&triangles), m_root(new Node(0, (int)(triangles.size()-1))), m_nodes(NULL), m_ownsNodes(true)
+{
+	m_stats.numTriangles = (S32)triangles.size();
+	build(threads);
+	flatten();
+	m_buildSahCost = m_stats.sahCost;
+}
+
+Bvh::Bvh(std::vector<RTTriangle>& triangles, const FlatNode* nodes, const BvhStats& stats) : 
+	m_triangles(&triangles), m_root(NULL), m_nodes(const_cast<FlatNode*>(nodes)), m_ownsNodes(false), m_stats(stats), m_buildSahCost(stats.sahCost)
+{
+}
+
+// The builders sort and partition BuildPrim records, a fraction of the size of
+// a triangle, and the triangles are moved only once, when the final order is
+// known. The input index of each record gives the permutation that is stored
+// in hierarchy files.
+void Bvh::build(int threads)
+{
+	std::vector<RTTriangle>& triangles = *m_triangles;
+	int count = (int)triangles.size();
+	int numChunks = threads > 1 ? FW::min((count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE, MAX_PARALLEL_CHUNKS) : 1;
+
+	// SBVH builds over references of its own
+	if (Bvh::mode == BvhMode_SBVH) {
+		buildSBVH(threads);
+		gather(triangles, m_triIndices, numChunks);
+		return;
+	}
+
+	m_prims.resize(count);
+	for (int i = 0; i < count; ++i) {
+		m_prims[i].bounds = triangles[i].m_bbox;
+		m_prims[i].centroid = triangles[i].m_centroid;
+		m_prims[i].index = i;
+	}
+
+	// The parallel builds restore the thread count they found, such as the
+	// one the renderer set
+	int oldThreads = MulticoreLauncher::getNumThreads();
+	if (Bvh::mode == BvhMode_LBVH || Bvh::mode == BvhMode_HLBVH) {
+		if (threads > 1)
+			MulticoreLauncher::setNumThreads(threads);
+		buildLBVH(threads);
+		if (threads > 1)
+			MulticoreLauncher::setNumThreads(oldThreads);
+	}
+	else if (threads <= 1) {
+		constructTree(m_root);
+	}
+	else {
+		MulticoreLauncher::setNumThreads(threads);
+
+		// Split the top of the tree here with chunked passes, then build
+		// the remaining subtrees as independent tasks, largest first
+		std::vector<Node*> subtrees;
+		constructTreeTop(m_root, subtrees);
+
+		std::sort(subtrees.begin(), subtrees.end(), [](const Node* a, const Node* b) -> bool {
+			return (a->endPrim - a->startPrim) > (b->endPrim - b->startPrim);
+		});
+
+		SubtreeJob job;
+		job.bvh = this;
+		job.subtrees = &subtrees;
+
+		MulticoreLauncher launcher;
+		launcher.push(subtreeTask, &job, 0, (int)subtrees.size());
+		launcher.popAll();
+
+		MulticoreLauncher::setNumThreads(oldThreads);
+	}
+
+	m_triIndices.resize(count);
+	for (int i = 0; i < count; ++i)
+		m_triIndices[i] = m_prims[i].index;
+	std::vector<BuildPrim>().swap(m_prims);
+
+	gather(triangles, m_triIndices, numChunks);
+}
+
+void Bvh::subtreeTask(MulticoreLauncher::Task& task)
+{
+	SubtreeJob& job = *(SubtreeJob*)task.data;
+	job.bvh->constructTree((*job.subtrees)[task.idx]);
+}
+
+void Bvh::measureScaling(const std::vector<RTTriangle>& original, float buildTime) const
+{
+	std::cout << "Build scaling:" << std::endl;
+	std::cout << "--------------" << std::endl;
+
+	int cores = MulticoreLauncher::getNumCores();
+	float serialTime = 0.0f;
+
+	for (int threads = 1; ; threads = FW::min(threads * 2, cores)) {
+		std::vector<RTTriangle> triangles = original;
+
+		Timer stopwatch;
+		stopwatch.start();
+		Bvh bvh(triangles, threads);
+		stopwatch.end();
+
+		if (threads == 1)
+			serialTime = stopwatch.getTotal();
+
+		// The tree and the triangle order must match the main build exactly
+		bool identical = m_stats.numNodes == bvh.m_stats.numNodes && triangles.size() == m_triangles->size() && memcmp(m_nodes, bvh.m_nodes, m_stats.numNodes * sizeof(FlatNode)) == 0;
+		for (size_t i = 0; identical && i < triangles.size(); ++i)
+			identical = memcmp(triangles[i].m_vertices, (*m_triangles)[i].m_vertices, sizeof(triangles[i].m_vertices)) == 0;
+
+		std::cout << threads << " threads: " << stopwatch.getTotal() << " sec, speedup " 
+				  << serialTime / stopwatch.getTotal() << "x, " << (identical ? "identical" : "DIFFERENT") << std::endl;
+
+		if (threads == cores)
+			break;
+	}
+
+	std::cout << "Speedup of this build: " << serialTime / buildTime << "x" << std::endl << std::endl;
 }
 
 Bvh::~Bvh(void)
 {
 	delete m_root;
+	if (m_ownsNodes)
+		_aligned_free(m_nodes);
 }
 
-const Node*	Bvh::getRoot(void) const {
-	return m_root;
+const FlatNode*	Bvh::getNodes(void) const {
+	return m_nodes;
 }
 
-int	Bvh::getDepth(void) const 
+// Turns the pointer tree into the depth-first node array and gathers the tree
+// statistics on the way. The walk uses an explicit stack and frees the pointer
+// nodes as it goes, so the tree is never recursed into, not even for deletion.
+void Bvh::flatten(void)
 {
-	return depthRecurse(m_root);
+	struct StackEntry
+	{
+		Node*	node;
+		int		parent;		// Inner node whose right child this is, -1 for left children
+		int		depth;
+	};
+
+	std::vector<FlatNode> nodes;
+	nodes.reserve(2 * (m_root->endPrim - m_root->startPrim + 1) / getMaxLeafSize() + 1);
+
+	std::vector<StackEntry> stack;
+	StackEntry root = { m_root, -1, 1 };
+	stack.push_back(root);
+
+	m_stats.numNodes = 0;
+	m_stats.numLeafNodes = 0;
+	m_stats.depth = 0;
+	m_stats.numReferences = (S32)m_triangles->size();
+
+	while (!stack.empty()) {
+		StackEntry e = stack.back();
+		stack.pop_back();
+
+		Node* n = e.node;
+		int idx = (int)nodes.size();
+		if (e.parent != -1)
+			nodes[e.parent].rightChild = idx;
+
+		FlatNode f;
+		memset(&f, 0, sizeof(f));
+		f.bbMin = n->bbMin;
+		f.bbMax = n->bbMax;
+
+		if (!n->leftChild && !n->rightChild) {
+			f.startPrim = n->startPrim;
+			f.numPrims = (U16)(n->endPrim - n->startPrim + 1);
+			f.flags = FlatNode::Flag_Leaf;
+			m_stats.numLeafNodes++;
+		}
+		else {
+			// Right child goes under the left one so that the left child ends up next in the array
+			StackEntry right = { n->rightChild, idx, e.depth + 1 };
+			StackEntry left = { n->leftChild, -1, e.depth + 1 };
+			stack.push_back(right);
+			stack.push_back(left);
+		}
+
+		nodes.push_back(f);
+		m_stats.numNodes++;
+		m_stats.depth = FW::max(m_stats.depth, e.depth);
+
+		n->leftChild = NULL;
+		n->rightChild = NULL;
+		delete n;
+	}
+	m_root = NULL;
+
+	// One cache-aligned block for the traversal
+	m_nodes = (FlatNode*)_aligned_malloc(nodes.size() * sizeof(FlatNode), FLAT_NODE_ALIGNMENT);
+	memcpy(m_nodes, &nodes[0], nodes.size() * sizeof(FlatNode));
+
+	m_stats.sahCost = computeSAHCost();
 }
 
-int Bvh::depthRecurse(const Node* n) const
+// SAH cost of the node array, normalized by the root area
+float Bvh::computeSAHCost(void) const
 {
-	if (!n) return 0;
-	return std::max(depthRecurse(n->leftChild)+1, depthRecurse(n->rightChild)+1);
+	float cost = 0.0f;
+	for (int i = 0; i < m_stats.numNodes; ++i) {
+		const FlatNode& n = m_nodes[i];
+		float area = calculateBBoxArea(std::make_pair(n.bbMin, n.bbMax));
+		if (n.isLeaf())
+			cost += SAH_INTERSECTION_COST * area * leafTests(n.numPrims);
+		else
+			cost += SAH_TRAVERSAL_COST * area;
+	}
+
+	float rootArea = calculateBBoxArea(std::make_pair(m_nodes[0].bbMin, m_nodes[0].bbMax));
+	return rootArea > 0.0f ? cost / rootArea : 0.0f;
 }
 
-int Bvh::getNumOfNodes(void) const 
+// In the depth-first array a subtree is a contiguous node range and every
+// child comes after its parent, so the range is fit by walking it backwards.
+// SBVH leaves get the full triangle bounds, the clipped ones are not kept.
+void Bvh::refitRange(int begin, int end)
 {
-	return numOfNodesRecurse(m_root);
+	std::vector<RTTriangle>& triangles = *m_triangles;
+	for (int i = end-1; i >= begin; --i) {
+		FlatNode& n = m_nodes[i];
+		Box bounds;
+		bounds.clear();
+
+		if (n.isLeaf()) {
+			for (int p = n.startPrim; p < n.startPrim + n.numPrims; ++p) {
+				triangles[p].update();
+				bounds.grow(triangles[p].m_bbox);
+			}
+		}
+		else {
+			const FlatNode& left = m_nodes[i+1];
+			const FlatNode& right = m_nodes[n.rightChild];
+			bounds.grow(Box(left.bbMin, left.bbMax));
+			bounds.grow(Box(right.bbMin, right.bbMax));
+		}
+
+		n.bbMin = bounds.min;
+		n.bbMax = bounds.max;
+	}
 }
 
-int Bvh::numOfNodesRecurse(const Node* n) const
+void Bvh::refitTask(MulticoreLauncher::Task& task)
 {
-	if (!n) return 0;
-	return 1 + numOfNodesRecurse(n->leftChild) + numOfNodesRecurse(n->rightChild);
+	RefitJob& job = *(RefitJob*)task.data;
+	job.bvh->refitRange(job.begins[task.idx], job.ends[task.idx]);
 }
 
-int Bvh::getNumOfLeafNodes(void) const 
+float Bvh::refit(void)
 {
-	return numOfLeafNodesRecurse(m_root);
+	if (!m_ownsNodes) {
+		FlatNode* nodes = (FlatNode*)_aligned_malloc(m_stats.numNodes * sizeof(FlatNode), FLAT_NODE_ALIGNMENT);
+		memcpy(nodes, m_nodes, m_stats.numNodes * sizeof(FlatNode));
+		m_nodes = nodes;
+		m_ownsNodes = true;
+	}
+
+	// Cut the tree into subtrees for the tasks, the nodes above them are
+	// collected and fit afterwards, children before parents
+	RefitJob job;
+	job.bvh = this;
+	std::vector<S32> top;
+
+	std::vector<std::pair<S32, S32> > stack(1, std::make_pair(0, m_stats.numNodes));
+	while (!stack.empty()) {
+		std::pair<S32, S32> range = stack.back();
+		stack.pop_back();
+
+		const FlatNode& n = m_nodes[range.first];
+		if (n.isLeaf() || range.second - range.first <= REFIT_SUBTREE_SIZE) {
+			job.begins.push_back(range.first);
+			job.ends.push_back(range.second);
+			continue;
+		}
+
+		top.push_back(range.first);
+		stack.push_back(std::make_pair(range.first + 1, n.rightChild));
+		stack.push_back(std::make_pair(n.rightChild, range.second));
+	}
+
+	launchChunks(refitTask, &job, (int)job.begins.size());
+
+	std::sort(top.begin(), top.end());
+	for (int i = (int)top.size()-1; i >= 0; --i)
+		refitRange(top[i], top[i]+1);
+
+	m_stats.sahCost = computeSAHCost();
+	return m_stats.sahCost;
 }
 
-int Bvh::numOfLeafNodesRecurse(const Node* n) const
+int Bvh::getMaxLeafSize(void)
 {
-	if (!n) return 0;
-	if (!n->leftChild && !n->rightChild)
-		return 1;
-	else
-		return numOfLeafNodesRecurse(n->leftChild) + numOfLeafNodesRecurse(n->rightChild);
+	return leafWidth > 1 ? leafWidth : MAX_TRIANGLES_PER_LEAF;
+}
+
+void Bvh::setBinCount(int count)
+{
+	Bvh::binCount = FW::clamp(count, 2, MAX_SAH_BINS);
+}
+
+const char* Bvh::getBvhModeName(BvhMode m)
+{
+	switch (m) {
+		case BvhMode_Spatial:		return "Spatial";
+		case BvhMode_SAH:			return "SAH";
+		case BvhMode_BinnedSAH:		return "Binned SAH";
+		case BvhMode_LBVH:			return "LBVH";
+		case BvhMode_HLBVH:			return "HLBVH";
+		case BvhMode_SBVH:			return "SBVH";
+		default:					return "Unknown";
+	}
 }
 /*
 int Bvh::partitionPrimitivesSAH(int startPrim, int endPrim)
@@ -139,9 +1149,9 @@ int Bvh::partitionPrimitivesSAH(int startPrim, int endPrim)
 
 	// For each axis do
 	for (int i = 0; i < 3; ++i) {
-		std::sort(m_triangles->begin()+startPrim, m_triangles->begin()+endPrim+1, [&](const RTTriangle& t1, const RTTriangle& t2) -> bool 
+		std::sort(m_prims.begin()+startPrim, m_prims.begin()+endPrim+1, [&](const BuildPrim& p1, const BuildPrim& p2) -> bool 
 		{
-			return t1.m_centroid[i] < t2.m_centroid[i];
+			return p1.centroid[i] < p2.centroid[i];
 		});
 
 		// For each primitive in the node do
@@ -159,9 +1169,9 @@ int Bvh::partitionPrimitivesSAH(int startPrim, int endPrim)
 		}
 	}
 
-	std::sort(m_triangles->begin()+startPrim, m_triangles->begin()+endPrim+1, [&](const RTTriangle& t1, const RTTriangle& t2) -> bool 
+	std::sort(m_prims.begin()+startPrim, m_prims.begin()+endPrim+1, [&](const BuildPrim& p1, const BuildPrim& p2) -> bool 
 	{
-		return t1.m_centroid[bestAxis] < t2.m_centroid[bestAxis];
+		return p1.centroid[bestAxis] < p2.centroid[bestAxis];
 	});
 
 	delete [] costs;
@@ -169,6 +1179,103 @@ int Bvh::partitionPrimitivesSAH(int startPrim, int endPrim)
 	return bestPos;
 }
 
+// Binned SAH: the centroids are bucketed into binCount equal slots along each axis
+// of the centroid bounds, and the split is only evaluated at the bin boundaries.
+// Prefix and suffix sweeps over the bins give the cost of every candidate in
+// O(binCount), so a node costs O(n) instead of the O(n^2) of the full sweep.
+int Bvh::partitionPrimitivesBinnedSAH(int startPrim, int endPrim, int numChunks)
+{
+	float rightArea[MAX_SAH_BINS];
+	int rightCount[MAX_SAH_BINS];
+
+	const int numBins = Bvh::binCount;
+
+	// Compute the centroid bounds, the bins are placed inside them
+	Box bounds, centroidBounds;
+	reduceBounds(m_prims, startPrim, endPrim, numChunks, bounds, centroidBounds);
+
+	Vec3f extent = centroidBounds.max - centroidBounds.min;
+
+	// Drop the primitives into the bins, per chunk
+	BinJob job;
+	job.prims = &m_prims;
+	job.startPrim = startPrim;
+	job.endPrim = endPrim;
+	job.numChunks = numChunks;
+	job.numBins = numBins;
+	job.centroidBounds = centroidBounds;
+	for (int axis = 0; axis < 3; ++axis)
+		job.binScale[axis] = extent[axis] > 0.0f ? numBins / extent[axis] : 0.0f;
+	job.bins.resize(numChunks * 3 * numBins);
+
+	launchChunks(binTask, &job, numChunks);
+
+	// Merge the chunks into the first one
+	SAHBin* bins = &job.bins[0];
+	for (int c = 1; c < numChunks; ++c) {
+		const SAHBin* chunkBins = &job.bins[c * 3 * numBins];
+		for (int b = 0; b < 3 * numBins; ++b) {
+			bins[b].bounds.grow(chunkBins[b].bounds);
+			bins[b].count += chunkBins[b].count;
+		}
+	}
+
+	float bestCost = FLT_MAX;
+	int bestAxis = -1;
+	int bestBin = -1;
+
+	// For each axis do
+	for (int axis = 0; axis < 3; ++axis) {
+		// All centroids on the same plane, nothing to split here
+		if (job.binScale[axis] == 0.0f)
+			continue;
+
+		const SAHBin* axisBins = bins + axis * numBins;
+
+		// Sweep from the right to get the area and count right of each bin boundary
+		Box accum;
+		accum.clear();
+		int count = 0;
+		for (int b = numBins-1; b > 0; --b) {
+			accum.grow(axisBins[b].bounds);
+			count += axisBins[b].count;
+			rightArea[b] = count ? accum.area() : 0.0f;
+			rightCount[b] = count;
+		}
+
+		// Sweep from the left and evaluate the cost at each boundary
+		accum.clear();
+		count = 0;
+		for (int b = 1; b < numBins; ++b) {
+			accum.grow(axisBins[b-1].bounds);
+			count += axisBins[b-1].count;
+
+			if (count == 0 || rightCount[b] == 0)
+				continue;
+
+			float cost = accum.area()*leafTests(count) + rightArea[b]*leafTests(rightCount[b]);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
+	}
+
+	// Degenerate node (all centroids coincide), split in the middle
+	if (bestAxis == -1)
+		return startPrim + (endPrim - startPrim + 1) / 2;
+
+	BinSplit split;
+	split.axis = bestAxis;
+	split.bin = bestBin;
+	split.numBins = numBins;
+	split.axisMin = centroidBounds.min[bestAxis];
+	split.binScale = job.binScale[bestAxis];
+
+	return stablePartition(m_prims, startPrim, endPrim, split, numChunks);
+}
+
 void Bvh::constructTree(Node* n)
 {
 	if (n->endPrim < n->startPrim) {
@@ -181,21 +1288,13 @@ void Bvh::constructTree(Node* n)
 	n->bbMin = bb.first;
 	n->bbMax = bb.second;
 
-	if (n->endPrim - n->startPrim + 1 > MAX_TRIANGLES_PER_LEAF)
+	if (n->endPrim - n->startPrim + 1 > getMaxLeafSize())
 	{
 		// Decide how to split the primitives and
 		// perform the actual split: shuffle the indices in the global list
 		// so that they're split into two intervals; return the index that
 		// separates the two intervals
-		int splitPrim;
-		switch (Bvh::mode) {
-			case BvhMode_Spatial:
-				splitPrim = partitionPrimitives(n->startPrim, n->endPrim);
-				break;
-			case BvhMode_SAH:
-				splitPrim = partitionPrimitivesSAH(n->startPrim, n->endPrim);
-				break;
-		}
+		int splitPrim = splitNode(n, 1);
 
 		// Create the left child and recursively call this
 		// function with the left triangle interval
@@ -209,67 +1308,577 @@ void Bvh::constructTree(Node* n)
 	}
 }
 
-float Bvh::calculateBBoxArea(const std::pair<Vec3f, Vec3f>& bb) const 
+// Same as constructTree, but for the large nodes near the root: their bounds and
+// partitions are computed in parallel chunks, and nodes small enough to be built
+// by a single thread are collected into subtrees instead of being recursed into.
+void Bvh::constructTreeTop(Node* n, std::vector<Node*>& subtrees)
 {
-	Vec3f whd = FW::abs(bb.second - bb.first);
-	return 2.0f * (whd.x*whd.z + whd.x*whd.y + whd.z*whd.y);
+	int count = n->endPrim - n->startPrim + 1;
+	if (count <= PARALLEL_SUBTREE_SIZE) {
+		subtrees.push_back(n);
+		return;
+	}
+
+	int numChunks = FW::min((count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE, MAX_PARALLEL_CHUNKS);
+
+	std::pair<Vec3f, Vec3f> bb = computeBB(n->startPrim, n->endPrim, numChunks);
+	n->bbMin = bb.first;
+	n->bbMax = bb.second;
+
+	int splitPrim = splitNode(n, numChunks);
+
+	n->leftChild = new Node(n->startPrim, splitPrim-1);
+	constructTreeTop(n->leftChild, subtrees);
+
+	n->rightChild = new Node(splitPrim, n->endPrim);
+	constructTreeTop(n->rightChild, subtrees);
 }
 
-std::pair<Vec3f, Vec3f>	Bvh::computeBB(int startPrim, int endPrim) const
+int Bvh::splitNode(Node* n, int numChunks)
+{
+	int splitPrim = n->startPrim;
+	switch (Bvh::mode) {
+		case BvhMode_Spatial:
+			splitPrim = partitionPrimitives(n->startPrim, n->endPrim, numChunks);
+			break;
+		case BvhMode_SAH:
+			splitPrim = partitionPrimitivesSAH(n->startPrim, n->endPrim);
+			break;
+		case BvhMode_BinnedSAH:
+			splitPrim = partitionPrimitivesBinnedSAH(n->startPrim, n->endPrim, numChunks);
+			break;
+	}
+
+	// Never leave a child empty, e.g. when all the centroids coincide
+	if (splitPrim <= n->startPrim || splitPrim > n->endPrim)
+		splitPrim = n->startPrim + (n->endPrim - n->startPrim + 1) / 2;
+
+	return splitPrim;
+}
+
+// --------------------------------------------------------------------------
+// LBVH: Morton codes of the centroids are radix sorted and the tree is emitted
+// from the sorted code prefixes. Every pass is chunked or split into subtree
+// tasks, and like the other builders the result does not depend on the thread
+// count. BvhMode_HLBVH replaces the Morton splits above the clusters with SAH.
+void Bvh::buildLBVH(int threads)
 {
-	Vec3f max(-FLT_MAX);
-	Vec3f min(FLT_MAX);
+	int count = (int)m_prims.size();
+	if (count <= getMaxLeafSize()) {
+		constructTree(m_root);
+		return;
+	}
+
+	int numChunks = threads > 1 ? FW::min((count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE, MAX_PARALLEL_CHUNKS) : 1;
+
+	// Quantize the centroids inside their bounds and sort along the curve
+	Box bounds, centroids;
+	reduceBounds(m_prims, 0, count-1, numChunks, bounds, centroids);
+
+	int bitsPerAxis = count < LBVH_SHORT_CODE_LIMIT ? 10 : 21;
+	Vec3f extent = centroids.max - centroids.min;
 
-	//#pragma omp parallel for shared(max,min)
-	for (int i = startPrim; i <= endPrim; ++i) {
-		const Box& bbox = ((*m_triangles)[i]).m_bbox;
-		if (bbox.max[0] > max[0])
-			max[0] = bbox.max[0];
-		if (bbox.min[0] < min[0])
-			min[0] = bbox.min[0];
+	std::vector<U64> codes(count);
+	std::vector<S32> order(count);
 
-		if (bbox.max[1] > max[1])
-			max[1] = bbox.max[1];
-		if (bbox.min[1] < min[1])
-			min[1] = bbox.min[1];
+	MortonJob morton;
+	morton.prims = &m_prims;
+	morton.numChunks = numChunks;
+	morton.bitsPerAxis = bitsPerAxis;
+	morton.origin = centroids.min;
+	for (int axis = 0; axis < 3; ++axis)
+		morton.scale[axis] = extent[axis] > 0.0f ? (float)(1 << bitsPerAxis) / extent[axis] : 0.0f;
+	morton.codes = &codes[0];
+	morton.indices = &order[0];
+	launchChunks(mortonTask, &morton, numChunks);
 
-		if (bbox.max[2] > max[2])
-			max[2] = bbox.max[2];
-		if (bbox.min[2] < min[2])
-			min[2] = bbox.min[2];
+	radixSort(codes, order, 3 * bitsPerAxis, numChunks);
+
+	// Nodes above the subtrees are collected in preorder and fitted last
+	std::vector<Node*> topNodes;
+	std::vector<Node*> subtrees;
+
+	if (Bvh::mode == BvhMode_HLBVH) {
+		// Cut the sorted codes into clusters
+		int clusterShift = 3 * bitsPerAxis - LBVH_CLUSTER_BITS;
+		std::vector<LBVHCluster> clusters;
+		for (int i = 0; i < count; ) {
+			int j = i + 1;
+			while (j < count && (codes[j] >> clusterShift) == (codes[i] >> clusterShift))
+				++j;
+
+			LBVHCluster cluster;
+			cluster.begin = i;
+			cluster.count = j - i;
+			clusters.push_back(cluster);
+			i = j;
+		}
+
+		ClusterBoundsJob clusterBounds;
+		clusterBounds.prims = &m_prims;
+		clusterBounds.indices = &order[0];
+		clusterBounds.clusters = &clusters;
+		clusterBounds.numChunks = FW::min(numChunks, (int)clusters.size());
+		launchChunks(clusterBoundsTask, &clusterBounds, clusterBounds.numChunks);
+
+		// SAH tree over the clusters, its leaves are the cluster subtrees
+		delete m_root;
+		m_root = constructClusterTree(clusters, 0, (int)clusters.size()-1, 0, topNodes, subtrees);
+
+		// Lay the primitives out in the final cluster order
+		std::vector<U64> clusterCodes(count);
+		std::vector<S32> clusterOrder(count);
+		int dst = 0;
+		for (size_t c = 0; c < clusters.size(); ++c) {
+			for (int i = clusters[c].begin; i < clusters[c].begin + clusters[c].count; ++i, ++dst) {
+				clusterCodes[dst] = codes[i];
+				clusterOrder[dst] = order[i];
+			}
+		}
+		codes.swap(clusterCodes);
+		order.swap(clusterOrder);
+	}
+	else {
+		emitMorton(m_root, &codes[0], &topNodes, &subtrees);
+	}
+
+	// The leaves take their bounds from the primitives in curve order
+	gather(m_prims, order, numChunks);
+
+	// Emit the subtrees, largest first
+	if (threads > 1) {
+		std::vector<Node*> tasks(subtrees);
+		std::sort(tasks.begin(), tasks.end(), [](const Node* a, const Node* b) -> bool {
+			return (a->endPrim - a->startPrim) > (b->endPrim - b->startPrim);
+		});
+
+		LBVHSubtreeJob job;
+		job.bvh = this;
+		job.subtrees = &tasks;
+		job.codes = &codes[0];
+
+		MulticoreLauncher launcher;
+		launcher.push(lbvhSubtreeTask, &job, 0, (int)tasks.size());
+		launcher.popAll();
+	}
+	else {
+		for (size_t i = 0; i < subtrees.size(); ++i)
+			emitMorton(subtrees[i], &codes[0], NULL, NULL);
+	}
+
+	// Children come after their parents in preorder, fit bottom-up
+	for (int i = (int)topNodes.size()-1; i >= 0; --i) {
+		Node* n = topNodes[i];
+		n->bbMin = FW::min(n->leftChild->bbMin, n->rightChild->bbMin);
+		n->bbMax = FW::max(n->leftChild->bbMax, n->rightChild->bbMax);
 	}
-	
-	return std::make_pair(min, max);
 }
 
-int Bvh::partitionPrimitives(int startPrim, int endPrim)
+void Bvh::lbvhSubtreeTask(MulticoreLauncher::Task& task)
 {
-	// Use the centroids to split the plane, i.e. find the longest axis 
-	// defined by the max and min triangle centroids
-	Vec3f maximum(-FLT_MAX);
-	Vec3f minimum(FLT_MAX);
+	LBVHSubtreeJob& job = *(LBVHSubtreeJob*)task.data;
+	job.bvh->emitMorton((*job.subtrees)[task.idx], job.codes, NULL, NULL);
+}
+
+// Splits the node at its highest differing Morton bit. With subtrees given,
+// nodes down to PARALLEL_SUBTREE_SIZE are split and the rest collected for the
+// subtree tasks; otherwise the whole subtree is emitted and its bounds fitted.
+void Bvh::emitMorton(Node* n, const U64* codes, std::vector<Node*>* topNodes, std::vector<Node*>* subtrees)
+{
+	int count = n->endPrim - n->startPrim + 1;
+	if (subtrees && count <= PARALLEL_SUBTREE_SIZE) {
+		subtrees->push_back(n);
+		return;
+	}
+
+	if (count <= getMaxLeafSize()) {
+		std::pair<Vec3f, Vec3f> bb = computeBB(n->startPrim, n->endPrim);
+		n->bbMin = bb.first;
+		n->bbMax = bb.second;
+		return;
+	}
+
+	int splitPrim = mortonSplit(codes, n->startPrim, n->endPrim);
+	n->leftChild = new Node(n->startPrim, splitPrim-1);
+	n->rightChild = new Node(splitPrim, n->endPrim);
+
+	if (topNodes)
+		topNodes->push_back(n);
+
+	emitMorton(n->leftChild, codes, topNodes, subtrees);
+	emitMorton(n->rightChild, codes, topNodes, subtrees);
+
+	if (!topNodes) {
+		n->bbMin = FW::min(n->leftChild->bbMin, n->rightChild->bbMin);
+		n->bbMax = FW::max(n->leftChild->bbMax, n->rightChild->bbMax);
+	}
+}
+
+// Builds the HLBVH top tree over the clusters [first, last], whose triangles
+// start at startPrim in the final order. Single clusters become subtrees.
+Node* Bvh::constructClusterTree(std::vector<LBVHCluster>& clusters, int first, int last, int startPrim, std::vector<Node*>& topNodes, std::vector<Node*>& subtrees)
+{
+	int count = 0;
+	for (int c = first; c <= last; ++c)
+		count += clusters[c].count;
+
+	Node* n = new Node(startPrim, startPrim + count - 1);
+	if (first == last) {
+		subtrees.push_back(n);
+		return n;
+	}
+
+	topNodes.push_back(n);
+
+	int split = splitClustersSAH(clusters, first, last, Bvh::binCount);
+	int leftCount = 0;
+	for (int c = first; c < split; ++c)
+		leftCount += clusters[c].count;
+
+	n->leftChild = constructClusterTree(clusters, first, split-1, startPrim, topNodes, subtrees);
+	n->rightChild = constructClusterTree(clusters, split, last, startPrim + leftCount, topNodes, subtrees);
+	return n;
+}
+
+// --------------------------------------------------------------------------
+// SBVH (Stich et al. 2009): binned SAH over the reference centroids, plus
+// spatial splits that cut references at a plane where the object split would
+// leave overlapping children. The tree is built over references, and the
+// triangle list is rebuilt at the end with one triangle per leaf reference.
+// As with the other builders, the top splits are done here and the subtrees
+// below PARALLEL_SUBTREE_SIZE references by tasks, each with its own budget,
+// so the result does not depend on the thread count.
+void Bvh::buildSBVH(int threads)
+{
+	std::vector<RTTriangle>& triangles = *m_triangles;
+	int numTris = (int)triangles.size();
+
+	std::vector<SbvhRef> refs(numTris);
+	Box rootBounds;
+	rootBounds.clear();
+	for (int i = 0; i < numTris; ++i) {
+		refs[i].bounds = triangles[i].m_bbox;
+		refs[i].tri = i;
+		rootBounds.grow(refs[i].bounds);
+	}
+
+	float minOverlap = SBVH_MIN_OVERLAP * rootBounds.area();
+	int budget = (int)(splitBudget * numTris);
+
+	std::vector<SbvhRef> leafRefs;
+	if (threads <= 1) {
+		constructTreeSBVH(m_root, refs, budget, minOverlap, leafRefs, NULL);
+	}
+	else {
+		int oldThreads = MulticoreLauncher::getNumThreads();
+		MulticoreLauncher::setNumThreads(threads);
+
+		std::vector<SbvhSubtree> subtrees;
+		constructTreeSBVH(m_root, refs, budget, minOverlap, leafRefs, &subtrees);
+
+		SbvhSubtreeJob job;
+		job.bvh = this;
+		job.subtrees = &subtrees;
+		job.minOverlap = minOverlap;
+		for (int i = 0; i < (int)subtrees.size(); ++i)
+			job.order.push_back(i);
+		std::sort(job.order.begin(), job.order.end(), [&](int a, int b) -> bool {
+			return subtrees[a].refs.size() > subtrees[b].refs.size();
+		});
+
+		MulticoreLauncher launcher;
+		launcher.push(sbvhSubtreeTask, &job, 0, (int)subtrees.size());
+		launcher.popAll();
+
+		MulticoreLauncher::setNumThreads(oldThreads);
+
+		// The subtrees were collected left to right, so appending their
+		// references in that order gives the same list as the serial build
+		for (size_t i = 0; i < subtrees.size(); ++i) {
+			offsetPrims(subtrees[i].node, (int)leafRefs.size());
+			leafRefs.insert(leafRefs.end(), subtrees[i].leafRefs.begin(), subtrees[i].leafRefs.end());
+		}
+	}
+
+	// build() gathers one triangle per reference
+	m_triIndices.resize(leafRefs.size());
+	for (size_t i = 0; i < leafRefs.size(); ++i)
+		m_triIndices[i] = leafRefs[i].tri;
+
+	m_root->startPrim = 0;
+	m_root->endPrim = (int)leafRefs.size() - 1;
+}
+
+void Bvh::sbvhSubtreeTask(MulticoreLauncher::Task& task)
+{
+	SbvhSubtreeJob& job = *(SbvhSubtreeJob*)task.data;
+	SbvhSubtree& subtree = (*job.subtrees)[job.order[task.idx]];
+	job.bvh->constructTreeSBVH(subtree.node, subtree.refs, subtree.budget, job.minOverlap, subtree.leafRefs, NULL);
+}
+
+// Leaves append their references to leafRefs. With subtrees given, nodes of up
+// to PARALLEL_SUBTREE_SIZE references are collected for the subtree tasks. The
+// references of refs are consumed.
+void Bvh::constructTreeSBVH(Node* n, std::vector<SbvhRef>& refs, int budget, float minOverlap, std::vector<SbvhRef>& leafRefs, std::vector<SbvhSubtree>* subtrees)
+{
+	Box bounds;
+	bounds.clear();
+	for (size_t i = 0; i < refs.size(); ++i)
+		bounds.grow(refs[i].bounds);
+	n->bbMin = bounds.min;
+	n->bbMax = bounds.max;
+
+	if (subtrees && refs.size() <= PARALLEL_SUBTREE_SIZE) {
+		subtrees->push_back(SbvhSubtree());
+		SbvhSubtree& subtree = subtrees->back();
+		subtree.node = n;
+		subtree.refs.swap(refs);
+		subtree.budget = budget;
+		return;
+	}
+
+	if ((int)refs.size() <= getMaxLeafSize()) {
+		n->startPrim = (int)leafRefs.size();
+		n->endPrim = n->startPrim + (int)refs.size() - 1;
+		leafRefs.insert(leafRefs.end(), refs.begin(), refs.end());
+		return;
+	}
+
+	std::vector<SbvhRef> left, right;
+	splitReferences(refs, bounds, budget, minOverlap, left, right);
+
+	// What the split did not use is shared by the children by size
+	int remaining = budget - ((int)left.size() + (int)right.size() - (int)refs.size());
+	int leftBudget = (int)((S64)remaining * left.size() / (left.size() + right.size()));
+	std::vector<SbvhRef>().swap(refs);
+
+	n->leftChild = new Node();
+	constructTreeSBVH(n->leftChild, left, leftBudget, minOverlap, leafRefs, subtrees);
+
+	n->rightChild = new Node();
+	constructTreeSBVH(n->rightChild, right, remaining - leftBudget, minOverlap, leafRefs, subtrees);
+}
+
+// Picks the cheaper of the best binned object split and, if the children of
+// that overlap and the budget allows, the best spatial split, and distributes
+// the references accordingly. References cut by a spatial split go to both
+// sides, clipped.
+void Bvh::splitReferences(const std::vector<SbvhRef>& refs, const Box& bounds, int budget, float minOverlap, std::vector<SbvhRef>& left, std::vector<SbvhRef>& right) const
+{
+	SAHBin bins[MAX_SAH_BINS];
+	int exits[MAX_SAH_BINS];
+	float rightArea[MAX_SAH_BINS];
+	int rightCount[MAX_SAH_BINS];
 
-	//#pragma omp parallel for shared(maximum,minimum)
-	for (int i = startPrim; i <= endPrim; ++i) {
-		const Vec3f& centroid = ((*m_triangles)[i]).m_centroid;
-		if (centroid[0] > maximum[0])	// X-axis 
-			maximum[0] = centroid[0];
-		if (centroid[0] < minimum[0])
-			minimum[0] = centroid[0];
+	const std::vector<RTTriangle>& triangles = *m_triangles;
+	const int numBins = Bvh::binCount;
+	const int count = (int)refs.size();
 
-		if (centroid[1] > maximum[1])   // Y-axis
-			maximum[1] = centroid[1];
-		if (centroid[1] < minimum[1])
-			minimum[1] = centroid[1];
+	// Object split: bin the reference centroids
+	Box centroidBounds;
+	centroidBounds.clear();
+	for (int i = 0; i < count; ++i)
+		centroidBounds.grow((refs[i].bounds.min + refs[i].bounds.max) * 0.5f);
+	Vec3f centroidExtent = centroidBounds.max - centroidBounds.min;
 
-		if (centroid[2] > maximum[2])	// Z-axis
-			maximum[2] = centroid[2];
-		if (centroid[2] < minimum[2])
-			minimum[2] = centroid[2];
+	float objectCost = FLT_MAX;
+	int objectAxis = -1;
+	int objectBin = -1;
+
+	for (int axis = 0; axis < 3; ++axis) {
+		if (centroidExtent[axis] <= 0.0f)
+			continue;
+
+		float binScale = numBins / centroidExtent[axis];
+		for (int b = 0; b < numBins; ++b) {
+			bins[b].bounds.clear();
+			bins[b].count = 0;
+		}
+		for (int i = 0; i < count; ++i) {
+			float centroid = (refs[i].bounds.min[axis] + refs[i].bounds.max[axis]) * 0.5f;
+			SAHBin& bin = bins[binIndex(centroid, centroidBounds.min[axis], binScale, numBins)];
+			bin.bounds.grow(refs[i].bounds);
+			bin.count++;
+		}
+
+		Box accum;
+		accum.clear();
+		int n = 0;
+		for (int b = numBins-1; b > 0; --b) {
+			accum.grow(bins[b].bounds);
+			n += bins[b].count;
+			rightArea[b] = n ? accum.area() : 0.0f;
+			rightCount[b] = n;
+		}
+
+		accum.clear();
+		n = 0;
+		for (int b = 1; b < numBins; ++b) {
+			accum.grow(bins[b-1].bounds);
+			n += bins[b-1].count;
+			if (n == 0 || rightCount[b] == 0)
+				continue;
+
+			float cost = accum.area()*leafTests(n) + rightArea[b]*leafTests(rightCount[b]);
+			if (cost < objectCost) {
+				objectCost = cost;
+				objectAxis = axis;
+				objectBin = b;
+			}
+		}
+	}
+
+	float objectScale = objectAxis != -1 ? numBins / centroidExtent[objectAxis] : 0.0f;
+	auto objectLeft = [&](const SbvhRef& r) -> bool {
+		float centroid = (r.bounds.min[objectAxis] + r.bounds.max[objectAxis]) * 0.5f;
+		return binIndex(centroid, centroidBounds.min[objectAxis], objectScale, numBins) < objectBin;
+	};
+
+	// Spatial splits only pay off where the object split children overlap
+	bool trySpatial = budget > 0;
+	if (trySpatial && objectAxis != -1) {
+		Box l, r;
+		l.clear();
+		r.clear();
+		for (int i = 0; i < count; ++i)
+			(objectLeft(refs[i]) ? l : r).grow(refs[i].bounds);
+
+		Box overlap = intersectBoxes(l, r);
+		trySpatial = isValidBox(overlap) && overlap.area() > minOverlap;
+	}
+
+	// Spatial split: bins evenly spaced over the node bounds, each reference
+	// clipped into every bin it spans, counted where it enters and exits
+	float spatialCost = FLT_MAX;
+	int spatialAxis = -1;
+	int spatialBin = -1;
+	Vec3f extent = bounds.max - bounds.min;
+
+	for (int axis = 0; trySpatial && axis < 3; ++axis) {
+		if (extent[axis] <= 0.0f)
+			continue;
+
+		float binScale = numBins / extent[axis];
+		float binWidth = extent[axis] / numBins;
+		for (int b = 0; b < numBins; ++b) {
+			bins[b].bounds.clear();
+			bins[b].count = 0;
+			exits[b] = 0;
+		}
+
+		for (int i = 0; i < count; ++i) {
+			const SbvhRef& r = refs[i];
+			int first = binIndex(r.bounds.min[axis], bounds.min[axis], binScale, numBins);
+			int last = binIndex(r.bounds.max[axis], bounds.min[axis], binScale, numBins);
+
+			SbvhRef piece = r;
+			for (int b = first; b < last && isValidBox(piece.bounds); ++b) {
+				Box l;
+				splitReference(triangles[r.tri], piece, axis, bounds.min[axis] + binWidth*(b+1), l, piece.bounds);
+				if (isValidBox(l))
+					bins[b].bounds.grow(l);
+			}
+			if (isValidBox(piece.bounds))
+				bins[last].bounds.grow(piece.bounds);
+
+			bins[first].count++;	// Entries
+			exits[last]++;
+		}
+
+		Box accum;
+		accum.clear();
+		int n = 0;
+		for (int b = numBins-1; b > 0; --b) {
+			accum.grow(bins[b].bounds);
+			n += exits[b];
+			rightArea[b] = n ? accum.area() : 0.0f;
+			rightCount[b] = n;
+		}
+
+		accum.clear();
+		n = 0;
+		for (int b = 1; b < numBins; ++b) {
+			accum.grow(bins[b-1].bounds);
+			n += bins[b-1].count;
+			if (n == 0 || rightCount[b] == 0 || n + rightCount[b] - count > budget)
+				continue;
+
+			float cost = accum.area()*leafTests(n) + rightArea[b]*leafTests(rightCount[b]);
+			if (cost < spatialCost) {
+				spatialCost = cost;
+				spatialAxis = axis;
+				spatialBin = b;
+			}
+		}
+	}
+
+	if (spatialCost < objectCost) {
+		int axis = spatialAxis;
+		float binScale = numBins / extent[axis];
+		float pos = bounds.min[axis] + (extent[axis] / numBins) * spatialBin;
+
+		// Classify by bin like above, so the duplicates match the evaluated split
+		for (int i = 0; i < count; ++i) {
+			const SbvhRef& r = refs[i];
+			int first = binIndex(r.bounds.min[axis], bounds.min[axis], binScale, numBins);
+			int last = binIndex(r.bounds.max[axis], bounds.min[axis], binScale, numBins);
+
+			if (last < spatialBin) {
+				left.push_back(r);
+			}
+			else if (first >= spatialBin) {
+				right.push_back(r);
+			}
+			else {
+				SbvhRef l = r, rr = r;
+				splitReference(triangles[r.tri], r, axis, pos, l.bounds, rr.bounds);
+				if (isValidBox(l.bounds))
+					left.push_back(l);
+				if (isValidBox(rr.bounds))
+					right.push_back(rr);
+			}
+		}
+	}
+	else if (objectAxis != -1) {
+		for (int i = 0; i < count; ++i)
+			(objectLeft(refs[i]) ? left : right).push_back(refs[i]);
 	}
 
+	// Degenerate node (all centroids coincide), split the list in the middle
+	if (left.empty() || right.empty()) {
+		left.assign(refs.begin(), refs.begin() + count/2);
+		right.assign(refs.begin() + count/2, refs.end());
+	}
+}
+
+float Bvh::calculateBBoxArea(const std::pair<Vec3f, Vec3f>& bb) const 
+{
+	Vec3f whd = FW::abs(bb.second - bb.first);
+	return 2.0f * (whd.x*whd.z + whd.x*whd.y + whd.z*whd.y);
+}
+
+std::pair<Vec3f, Vec3f>	Bvh::computeBB(int startPrim, int endPrim) const
+{
+	return computeBB(startPrim, endPrim, 1);
+}
+
+std::pair<Vec3f, Vec3f>	Bvh::computeBB(int startPrim, int endPrim, int numChunks) const
+{
+	Box bounds, centroids;
+	reduceBounds(m_prims, startPrim, endPrim, numChunks, bounds, centroids);
+	
+	return std::make_pair(bounds.min, bounds.max);
+}
+
+int Bvh::partitionPrimitives(int startPrim, int endPrim, int numChunks)
+{
+	// Use the centroids to split the plane, i.e. find the longest axis 
+	// defined by the max and min triangle centroids
+	Box bounds, centroids;
+	reduceBounds(m_prims, startPrim, endPrim, numChunks, bounds, centroids);
+
 	// Calculate the axis lengths (max-min)
-	Vec3f axisLengths = maximum - minimum;
+	Vec3f axisLengths = centroids.max - centroids.min;
 
 	// Pick the longest axis amongst x, y, z
 	int axis;
@@ -278,14 +1887,13 @@ int Bvh::partitionPrimitives(int startPrim, int endPrim)
 
 	// Distribute the primitives to positive/negative based on where
 	// the primitive's centroid lies
-	float mid = longestAxis*0.5f + minimum[axis];
+	SpatialSplit split;
+	split.axis = axis;
+	split.mid = longestAxis*0.5f + centroids.min[axis];
 
 	// Sort the interval according to where the triangles centroid lies in 
 	// the longest axis
-	int splitPrim = std::partition(m_triangles->begin()+startPrim, m_triangles->begin()+endPrim+1, [&](const RTTriangle& t) -> bool {
-						return ( ( (*(t.m_vertices[0]))[axis] + (*(t.m_vertices[1]))[axis] + (*(t.m_vertices[2]))[axis] ) / 3.0f) > mid; }) - m_triangles->begin();
-
-	return splitPrim;
+	return stablePartition(m_prims, startPrim, endPrim, split, numChunks);
 }
 
 }
\ No newline at end of file
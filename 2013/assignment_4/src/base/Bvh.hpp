@@ -1,6 +1,7 @@
 #pragma once
 
 #include "base/Math.hpp"
+#include "base/MulticoreLauncher.hpp"
 #include <vector>
 #include "Box.hpp"
 #include "RTTriangle.hpp"
@@ -9,6 +10,9 @@ namespace FW
 {
 
 class RTTriangle;
+struct LBVHCluster;
+struct SbvhRef;
+struct SbvhSubtree;
 
 // The BVH node class
 class Node
@@ -28,6 +32,57 @@ public:
 };
 
 
+// Compiled BVH node used for traversal. The nodes are stored depth-first in a
+// single array: the left child of an inner node is the next node in the array,
+// the right child is at index rightChild. Leaves reference numPrims triangles
+// starting at startPrim in the global list.
+struct FlatNode
+{
+	enum
+	{
+		Flag_Leaf = 1 << 0,
+	};
+
+	Vec3f					bbMin;		// Axis-aligned BB
+	Vec3f					bbMax;
+
+	union
+	{
+		S32					startPrim;	// Leaf: first triangle in the global list
+		S32					rightChild;	// Inner node: index of the right child
+	};
+
+	U16						numPrims;	// Leaf: number of triangles, 0 for inner nodes
+	U16						flags;
+
+	__forceinline bool		isLeaf		(void) const	{ return (flags & Flag_Leaf) != 0; }
+};
+
+static_assert(sizeof(FlatNode) == 32, "FlatNode must be 32 bytes");
+
+
+// What the builders sort and partition in place of the triangles. The
+// triangles themselves are reordered once, after the build.
+struct BuildPrim
+{
+	Box						bounds;
+	Vec3f					centroid;
+	S32						index;		// Input index of the triangle
+};
+
+
+// Statistics of a finished tree, gathered while flattening
+struct BvhStats
+{
+	S32						numNodes;
+	S32						numLeafNodes;
+	S32						depth;
+	F32						sahCost;		// Normalized by the root area
+	S32						numTriangles;	// Input triangles
+	S32						numReferences;	// Triangles referenced by the leaves, more with SBVH duplicates
+};
+
+
 // The BVH class
 class Bvh
 {
@@ -36,21 +91,94 @@ public:
 	{
 		BvhMode_Spatial = 0,
 		BvhMode_SAH,
+		BvhMode_BinnedSAH,
+		BvhMode_LBVH,		// Morton code emission, for fast rebuilds
+		BvhMode_HLBVH,		// LBVH with binned SAH above the Morton clusters
+		BvhMode_SBVH,		// Binned SAH plus spatial splits that duplicate triangles
 	};
 
+	// BvhMode_SBVH may reference a triangle from several leaves. The vector
+	// then grows and holds a copy of the triangle for each reference.
 	Bvh						(std::vector<RTTriangle>& triangles);
+
+	// Wraps an existing node array, e.g. one mapped from a hierarchy file. The
+	// triangles must already be in tree order and the nodes are not freed.
+	Bvh						(std::vector<RTTriangle>& triangles, const FlatNode* nodes, const BvhStats& stats);
+
+	// Quiet build with the given number of threads, without the summary. Used
+	// for scaling measurements and background rebuilds.
+	Bvh						(std::vector<RTTriangle>& triangles, int threads);
 	~Bvh					(void);
 
-	const Node*				getRoot					(void) const;
+	// Refreshes the triangles and fits the node bounds bottom-up after the
+	// vertices moved, keeping the tree topology. Subtrees are refit in
+	// parallel. A wrapped node array is copied on the first refit. Returns
+	// the new SAH cost.
+	float					refit					(void);
+
+	// Points the tree at another vector holding the same triangles in the same order
+	void					rebind					(std::vector<RTTriangle>& triangles)	{ m_triangles = &triangles; }
+
+	// The compiled tree, the root is the first node
+	const FlatNode*			getNodes				(void) const;
+
+	const BvhStats&			getStats				(void) const	{ return m_stats; }
 
-	int						getDepth				(void) const;
-	int						getNumOfNodes			(void) const;
-	int						getNumOfLeafNodes		(void) const;
+	// Input index of each triangle in tree order, empty for wrapped trees
+	const std::vector<S32>&	getTriangleIndices		(void) const	{ return m_triIndices; }
+
+	int						getDepth				(void) const	{ return m_stats.depth; }
+	int						getNumOfNodes			(void) const	{ return m_stats.numNodes; }
+	int						getNumOfLeafNodes		(void) const	{ return m_stats.numLeafNodes; }
+
+	// Surface area heuristic cost of the whole tree, normalized by the root area
+	float					getSAHCost				(void) const	{ return m_stats.sahCost; }
+
+	// SAH cost when the tree was built, refits only change getSAHCost()
+	float					getBuildSAHCost			(void) const	{ return m_buildSahCost; }
+
+	// Triangle references per input triangle, 1 unless spatial splits duplicated some
+	float					getDuplicationRatio		(void) const	{ return m_stats.numTriangles ? (float)m_stats.numReferences / m_stats.numTriangles : 1.0f; }
 
 	static void				setBvhMode				(BvhMode m)
 	{
 		Bvh::mode = m;
 	}
+	static BvhMode			getBvhMode				(void)	{ return Bvh::mode; }
+
+	// Number of centroid bins used by BvhMode_BinnedSAH, clamped to [2, MAX_SAH_BINS]
+	static void				setBinCount				(int count);
+	static int				getBinCount				(void)	{ return Bvh::binCount; }
+
+	static const char*		getBvhModeName			(BvhMode m);
+
+	// Extra references BvhMode_SBVH may create, as a fraction of the triangle count
+	static void				setSplitBudget			(float budget)	{ Bvh::splitBudget = FW::max(budget, 0.0f); }
+	static float			getSplitBudget			(void)	{ return Bvh::splitBudget; }
+
+	// Number of threads used for construction, 0 = one per core, 1 = serial build
+	static void				setNumThreads			(int n)		{ Bvh::numThreads = n; }
+
+	// When enabled, the build is repeated with 1, 2, 4, ... threads and the
+	// speedup of each thread count is appended to the build summary
+	static void				setReportScaling		(bool b)	{ Bvh::reportScaling = b; }
+
+	// Triangles the leaf test takes at once. Leaves hold up to that many, or
+	// MAX_TRIANGLES_PER_LEAF for the scalar test, and the SAH weighs a triangle
+	// range by the leaf tests it takes instead of by its triangle count.
+	static void				setLeafWidth			(int width)	{ Bvh::leafWidth = FW::max(width, 1); }
+	static int				getLeafWidth			(void)		{ return Bvh::leafWidth; }
+	static int				getMaxLeafSize			(void);
+	static int				leafTests				(int count)	{ return (count + Bvh::leafWidth - 1) / Bvh::leafWidth; }
+
+	// Stable parallel LSD radix sort of the (key, value) pairs on the low keyBits
+	// of the keys, the one that orders the Morton codes of the LBVH builds
+	static void				radixSort				(std::vector<U64>& keys, std::vector<S32>& values, int keyBits, int numChunks);
+
+	// Morton code of the grid cell (x, y, z) with 10 or 21 bits per axis, the
+	// bits of x above those of y and z. The LBVH builds sort the triangles on
+	// it and the batch queries of RayTracer the ray origins.
+	static U64				mortonCode				(U64 x, U64 y, U64 z, int bitsPerAxis);
 
 	std::pair<Vec3f, Vec3f>	computeBB				(int startPrim, int endPrim) const;
 	float					calculateBBoxArea		(const std::pair<Vec3f, Vec3f>& bb) const;
@@ -61,7 +189,7 @@ public:
 
 		//#pragma omp parallel for shared(max,min)
 		for (int i = startPrim; i <= endPrim; ++i) {
-			const Box& bbox = ((*m_triangles)[i]).m_bbox;
+			const Box& bbox = m_prims[i].bounds;
 			if (bbox.max[0] > max[0])
 				max[0] = bbox.max[0];
 			if (bbox.min[0] < min[0])
@@ -83,16 +211,52 @@ public:
 	}
 
 
-	int						partitionPrimitives		(int startPrim, int endPrim);
+	// Build helpers, the ranges index the build primitives. numChunks > 1 splits
+	// the bounds reduction, binning and partitioning into that many tasks; the
+	// result is identical to the serial version
+	std::pair<Vec3f, Vec3f>	computeBB				(int startPrim, int endPrim, int numChunks) const;
+	int						partitionPrimitives		(int startPrim, int endPrim, int numChunks =1);
 	int						partitionPrimitivesSAH	(int startPrim, int endPrim);
+	int						partitionPrimitivesBinnedSAH(int startPrim, int endPrim, int numChunks =1);
 
 private:
 	static BvhMode									mode;
+	static int										binCount;
+	static int										numThreads;
+	static bool										reportScaling;
+	static float									splitBudget;
+	static int										leafWidth;
 
 	std::vector<RTTriangle>*						m_triangles;
-	Node*											m_root;
+	Node*											m_root;		// Pointer tree, only alive during the build
+	std::vector<BuildPrim>							m_prims;	// Also only alive during the build
+	FlatNode*										m_nodes;
+	bool											m_ownsNodes;
+	BvhStats										m_stats;
+	float											m_buildSahCost;
+	std::vector<S32>								m_triIndices;
 
+	void					build					(int threads);
 	void					constructTree			(Node* n);
+	void					flatten					(void);
+	float					computeSAHCost			(void) const;
+	void					refitRange				(int begin, int end);
+	void					constructTreeTop		(Node* n, std::vector<Node*>& subtrees);
+	int						splitNode				(Node* n, int numChunks);
+	void					measureScaling			(const std::vector<RTTriangle>& original, float buildTime) const;
+
+	void					buildLBVH				(int threads);
+	void					emitMorton				(Node* n, const U64* codes, std::vector<Node*>* topNodes, std::vector<Node*>* subtrees);
+	Node*					constructClusterTree	(std::vector<LBVHCluster>& clusters, int first, int last, int startPrim, std::vector<Node*>& topNodes, std::vector<Node*>& subtrees);
+
+	void					buildSBVH				(int threads);
+	void					constructTreeSBVH		(Node* n, std::vector<SbvhRef>& refs, int budget, float minOverlap, std::vector<SbvhRef>& leafRefs, std::vector<SbvhSubtree>* subtrees);
+	void					splitReferences			(const std::vector<SbvhRef>& refs, const Box& bounds, int budget, float minOverlap, std::vector<SbvhRef>& left, std::vector<SbvhRef>& right) const;
+
+	static void				subtreeTask				(MulticoreLauncher::Task& task);
+	static void				lbvhSubtreeTask			(MulticoreLauncher::Task& task);
+	static void				sbvhSubtreeTask			(MulticoreLauncher::Task& task);
+	static void				refitTask				(MulticoreLauncher::Task& task);
 
 	__forceinline float		calculateCostSAH		(int splitPrim, int startPrim, int endPrim) const
 	{
@@ -102,13 +266,9 @@ private:
 		float leftArea = calculateBBoxArea(startPrim, splitPrim-1);
 		float rightArea = calculateBBoxArea(splitPrim, endPrim);
 
-		return (leftArea*leftCount + rightArea*rightCount);
+		return (leftArea*leafTests(leftCount) + rightArea*leafTests(rightCount));
 	}
 
-	int						depthRecurse			(const Node* n) const;
-	int						numOfNodesRecurse		(const Node* n) const;
-	int						numOfLeafNodesRecurse	(const Node* n) const;
-
 };
 
 }
\ No newline at end of file
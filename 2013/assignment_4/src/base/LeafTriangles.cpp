@@ -0,0 +1,103 @@
+#include "LeafTriangles.hpp"
+#include "WideBvh.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <malloc.h>
+
+// Alignment of the block array, a block spans whole 32-byte rows
+#define TRIANGLE_BLOCK_ALIGNMENT 64
+
+namespace FW
+{
+
+LeafTriangles::Kernel LeafTriangles::kernel = LeafTriangles::Kernel_SSE;
+
+void LeafTriangles::setKernel(Kernel k)
+{
+	if (k == Kernel_AVX && !isAvxSupported()) {
+		::printf("AVX is not supported, using the SSE leaf kernel\n");
+		k = Kernel_SSE;
+	}
+	LeafTriangles::kernel = k;
+}
+
+const char* LeafTriangles::getKernelName(Kernel k)
+{
+	switch (k) {
+	case Kernel_Scalar:	return "scalar";
+	case Kernel_SSE:	return "SSE, 4 triangles";
+	case Kernel_AVX:	return "AVX, 8 triangles";
+	default:			return "unknown";
+	}
+}
+
+int LeafTriangles::getKernelWidth(Kernel k)
+{
+	switch (k) {
+	case Kernel_SSE:	return 4;
+	case Kernel_AVX:	return 8;
+	default:			return 1;
+	}
+}
+
+LeafTriangles::LeafTriangles(const Bvh& bvh, const std::vector<RTTriangle>& triangles) : m_blocks(NULL), m_numBlocks(0)
+{
+	const FlatNode* nodes = bvh.getNodes();
+	int numNodes = bvh.getNumOfNodes();
+
+	m_leafBlocks.assign(triangles.size(), -1);
+	for (int i = 0; i < numNodes; ++i) {
+		if (!nodes[i].isLeaf())
+			continue;
+		m_leafBlocks[nodes[i].startPrim] = m_numBlocks;
+		m_numBlocks += (nodes[i].numPrims + TriangleBlock::Width - 1) / TriangleBlock::Width;
+	}
+
+	m_blocks = (TriangleBlock*)_aligned_malloc(FW::max(m_numBlocks, 1) * sizeof(TriangleBlock), TRIANGLE_BLOCK_ALIGNMENT);
+	memset(m_blocks, 0, m_numBlocks * sizeof(TriangleBlock));
+
+	for (int i = 0; i < numNodes; ++i) {
+		const FlatNode& n = nodes[i];
+		if (!n.isLeaf())
+			continue;
+
+		TriangleBlock* b = m_blocks + m_leafBlocks[n.startPrim];
+		for (int j = 0; j < ((n.numPrims + TriangleBlock::Width - 1) & ~(TriangleBlock::Width - 1)); ++j) {
+			TriangleBlock& block = b[j / TriangleBlock::Width];
+			int lane = j % TriangleBlock::Width;
+			if (j >= n.numPrims) {
+				block.triangle[lane] = -1;
+				continue;
+			}
+
+			const RTTriangle& t = triangles[n.startPrim + j];
+			Vec3f v0 = *t.m_vertices[0];
+			Vec3f e1 = *t.m_vertices[1] - v0;
+			Vec3f e2 = *t.m_vertices[2] - v0;
+
+			block.v0x[lane] = v0.x;
+			block.v0y[lane] = v0.y;
+			block.v0z[lane] = v0.z;
+			block.e1x[lane] = e1.x;
+			block.e1y[lane] = e1.y;
+			block.e1z[lane] = e1.z;
+			block.e2x[lane] = e2.x;
+			block.e2y[lane] = e2.y;
+			block.e2z[lane] = e2.z;
+			block.triangle[lane] = n.startPrim + j;
+		}
+	}
+}
+
+LeafTriangles::~LeafTriangles(void)
+{
+	_aligned_free(m_blocks);
+}
+
+size_t LeafTriangles::getMemoryUsage(void) const
+{
+	return m_numBlocks * sizeof(TriangleBlock) + m_leafBlocks.size() * sizeof(S32);
+}
+
+}
\ No newline at end of file
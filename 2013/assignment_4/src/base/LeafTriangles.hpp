@@ -0,0 +1,411 @@
+#pragma once
+
+#include "Bvh.hpp"
+#include "Ray.hpp"
+
+#include <immintrin.h>
+
+namespace FW
+{
+
+// Up to Width triangles of a leaf in the form the intersection test uses:
+// the first vertex and the two edges leaving it, one coordinate per array.
+// Unused lanes have zero edges, which the determinant test rejects.
+struct TriangleBlock
+{
+	enum
+	{
+		Width	= 4,
+	};
+
+	F32						v0x[Width];
+	F32						v0y[Width];
+	F32						v0z[Width];
+	F32						e1x[Width];		// v1 - v0
+	F32						e1y[Width];
+	F32						e1z[Width];
+	F32						e2x[Width];		// v2 - v0
+	F32						e2y[Width];
+	F32						e2z[Width];
+	S32						triangle[Width];	// Index in the triangle list, -1 for unused lanes
+};
+
+static_assert(sizeof(TriangleBlock) == 160, "TriangleBlock must be 160 bytes");
+
+
+// The triangles of a Bvh copied out of the RTTriangles into consecutive,
+// aligned blocks, each leaf starting a new block. A leaf test then streams
+// through its blocks instead of following three vertex pointers per triangle.
+// The blocks are a snapshot, they have to be rebuilt when the vertices move.
+class LeafTriangles
+{
+public:
+	// The leaf tests. The SIMD kernels test a block (SSE) or two consecutive
+	// blocks (AVX) with one ray at a time, lane by lane with the arithmetic of
+	// the scalar kernel, so all three find the same hits.
+	enum Kernel
+	{
+		Kernel_Scalar = 0,
+		Kernel_SSE,
+		Kernel_AVX,
+		Kernel_Max
+	};
+
+	LeafTriangles			(const Bvh& bvh, const std::vector<RTTriangle>& triangles);
+	~LeafTriangles			(void);
+
+	// Kernel_AVX falls back to Kernel_SSE where the CPU or the OS lacks AVX
+	static void				setKernel				(Kernel k);
+	static Kernel			getKernel				(void)	{ return LeafTriangles::kernel; }
+	static const char*		getKernelName			(Kernel k);
+	static int				getKernelWidth			(Kernel k);	// Triangles tested at once
+
+	const TriangleBlock*	getBlocks				(void) const	{ return m_blocks; }
+	int						getFirstBlock			(int startPrim) const	{ return m_leafBlocks[startPrim]; }	// Of the leaf starting at startPrim
+	int						getNumOfBlocks			(void) const	{ return m_numBlocks; }
+	size_t					getMemoryUsage			(void) const;
+
+	// Closest hit with the numPrims triangles of the leaf starting at startPrim
+	// with t in (ray.tmin, tmax), tmax being the closest hit so far. Updates
+	// tmax, u and v and returns the index of the triangle, or -1 if there was none.
+	__forceinline int		intersect				(int startPrim, int numPrims, const Ray& ray, float& tmax, float& u, float& v) const;
+
+	// True if any triangle of the leaf is hit with t in (ray.tmin, ray.tmax).
+	// Stops at the first one and leaves out the barycentrics.
+	__forceinline bool		occluded				(int startPrim, int numPrims, const Ray& ray) const;
+
+	// The kernels behind intersect and occluded, callable directly for verification
+	__forceinline int		intersectScalar			(int startPrim, int numPrims, const Ray& ray, float& tmax, float& u, float& v) const;
+	__forceinline int		intersectSSE			(int startPrim, int numPrims, const Ray& ray, float& tmax, float& u, float& v) const;
+	__forceinline int		intersectAVX			(int startPrim, int numPrims, const Ray& ray, float& tmax, float& u, float& v) const;
+	__forceinline bool		occludedScalar			(int startPrim, int numPrims, const Ray& ray) const;
+	__forceinline bool		occludedSSE				(int startPrim, int numPrims, const Ray& ray) const;
+	__forceinline bool		occludedAVX				(int startPrim, int numPrims, const Ray& ray) const;
+
+private:
+	static Kernel			kernel;
+
+	TriangleBlock*			m_blocks;
+	int						m_numBlocks;
+	std::vector<S32>		m_leafBlocks;	// First block of the leaf starting at each triangle
+
+	LeafTriangles			(const LeafTriangles&);	// Not copyable
+	LeafTriangles&			operator=				(const LeafTriangles&);
+};
+
+// Same arithmetic as intersect_triangle1 with the edges precomputed, so the
+// hits are bit for bit those of the pointer based test
+__forceinline int LeafTriangles::intersectScalar(int startPrim, int numPrims, const Ray& ray, float& tmax, float& u, float& v) const
+{
+	static const float EPSILON = 0.000001f;
+	const Vec3f& orig = ray.orig;
+	const Vec3f& dir = ray.dir;
+
+	int hit = -1;
+	const TriangleBlock* b = m_blocks + m_leafBlocks[startPrim];
+	const TriangleBlock* end = b + (numPrims + TriangleBlock::Width - 1) / TriangleBlock::Width;
+	for (; b < end; ++b) {
+		for (int i = 0; i < TriangleBlock::Width; ++i) {
+			Vec3f e1(b->e1x[i], b->e1y[i], b->e1z[i]);
+			Vec3f e2(b->e2x[i], b->e2y[i], b->e2z[i]);
+
+			Vec3f pvec(dir.y*e2.z - dir.z*e2.y, dir.z*e2.x - dir.x*e2.z, dir.x*e2.y - dir.y*e2.x);
+			float det = e1.x*pvec.x + e1.y*pvec.y + e1.z*pvec.z;
+			if (det > -EPSILON && det < EPSILON)
+				continue;
+
+			Vec3f tvec(orig.x - b->v0x[i], orig.y - b->v0y[i], orig.z - b->v0z[i]);
+			float uu = tvec.x*pvec.x + tvec.y*pvec.y + tvec.z*pvec.z;
+			if (det > 0.0f ? (uu < 0.0f || uu > det) : (uu > 0.0f || uu < det))
+				continue;
+
+			Vec3f qvec(tvec.y*e1.z - tvec.z*e1.y, tvec.z*e1.x - tvec.x*e1.z, tvec.x*e1.y - tvec.y*e1.x);
+			float vv = dir.x*qvec.x + dir.y*qvec.y + dir.z*qvec.z;
+			if (det > 0.0f ? (vv < 0.0f || uu + vv > det) : (vv > 0.0f || uu + vv < det))
+				continue;
+
+			float invDet = 1.0f / det;
+			float t = (e2.x*qvec.x + e2.y*qvec.y + e2.z*qvec.z) * invDet;
+			if (t > ray.tmin && t < tmax) {
+				hit = b->triangle[i];
+				tmax = t;
+				u = uu * invDet;
+				v = vv * invDet;
+			}
+		}
+	}
+	return hit;
+}
+
+__forceinline bool LeafTriangles::occludedScalar(int startPrim, int numPrims, const Ray& ray) const
+{
+	static const float EPSILON = 0.000001f;
+	const Vec3f& orig = ray.orig;
+	const Vec3f& dir = ray.dir;
+
+	const TriangleBlock* b = m_blocks + m_leafBlocks[startPrim];
+	const TriangleBlock* end = b + (numPrims + TriangleBlock::Width - 1) / TriangleBlock::Width;
+	for (; b < end; ++b) {
+		for (int i = 0; i < TriangleBlock::Width; ++i) {
+			Vec3f e1(b->e1x[i], b->e1y[i], b->e1z[i]);
+			Vec3f e2(b->e2x[i], b->e2y[i], b->e2z[i]);
+
+			Vec3f pvec(dir.y*e2.z - dir.z*e2.y, dir.z*e2.x - dir.x*e2.z, dir.x*e2.y - dir.y*e2.x);
+			float det = e1.x*pvec.x + e1.y*pvec.y + e1.z*pvec.z;
+			if (det > -EPSILON && det < EPSILON)
+				continue;
+
+			Vec3f tvec(orig.x - b->v0x[i], orig.y - b->v0y[i], orig.z - b->v0z[i]);
+			float uu = tvec.x*pvec.x + tvec.y*pvec.y + tvec.z*pvec.z;
+			if (det > 0.0f ? (uu < 0.0f || uu > det) : (uu > 0.0f || uu < det))
+				continue;
+
+			Vec3f qvec(tvec.y*e1.z - tvec.z*e1.y, tvec.z*e1.x - tvec.x*e1.z, tvec.x*e1.y - tvec.y*e1.x);
+			float vv = dir.x*qvec.x + dir.y*qvec.y + dir.z*qvec.z;
+			if (det > 0.0f ? (vv < 0.0f || uu + vv > det) : (vv > 0.0f || uu + vv < det))
+				continue;
+
+			float t = (e2.x*qvec.x + e2.y*qvec.y + e2.z*qvec.z) * (1.0f / det);
+			if (t > ray.tmin && t < ray.tmax)
+				return true;
+		}
+	}
+	return false;
+}
+
+// One ray against 4 triangles of a block, or 8 of two consecutive blocks.
+// test() returns the mask of the lanes hit with t in (tmin, tmax) and stores
+// t, u and v of every lane.
+struct LeafRay4
+{
+	__m128	ox, oy, oz;
+	__m128	dx, dy, dz;
+
+	LeafRay4(const Ray& ray)
+	{
+		ox = _mm_set1_ps(ray.orig.x);
+		oy = _mm_set1_ps(ray.orig.y);
+		oz = _mm_set1_ps(ray.orig.z);
+		dx = _mm_set1_ps(ray.dir.x);
+		dy = _mm_set1_ps(ray.dir.y);
+		dz = _mm_set1_ps(ray.dir.z);
+	}
+
+	__forceinline int test(const TriangleBlock* b, float tmin, float tmax, float* t, float* u, float* v) const
+	{
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 eps = _mm_set1_ps(0.000001f);
+
+		__m128 e1x = _mm_load_ps(b->e1x), e1y = _mm_load_ps(b->e1y), e1z = _mm_load_ps(b->e1z);
+		__m128 e2x = _mm_load_ps(b->e2x), e2y = _mm_load_ps(b->e2y), e2z = _mm_load_ps(b->e2z);
+
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 parallel = _mm_and_ps(_mm_cmpgt_ps(det, _mm_sub_ps(zero, eps)), _mm_cmplt_ps(det, eps));
+		__m128 front = _mm_cmpgt_ps(det, zero);
+
+		__m128 tx = _mm_sub_ps(ox, _mm_load_ps(b->v0x));
+		__m128 ty = _mm_sub_ps(oy, _mm_load_ps(b->v0y));
+		__m128 tz = _mm_sub_ps(oz, _mm_load_ps(b->v0z));
+		__m128 uu = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz));
+		__m128 outU = _mm_or_ps(
+			_mm_and_ps(front, _mm_or_ps(_mm_cmplt_ps(uu, zero), _mm_cmpgt_ps(uu, det))),
+			_mm_andnot_ps(front, _mm_or_ps(_mm_cmpgt_ps(uu, zero), _mm_cmplt_ps(uu, det))));
+
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+		__m128 vv = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz));
+		__m128 uv = _mm_add_ps(uu, vv);
+		__m128 outV = _mm_or_ps(
+			_mm_and_ps(front, _mm_or_ps(_mm_cmplt_ps(vv, zero), _mm_cmpgt_ps(uv, det))),
+			_mm_andnot_ps(front, _mm_or_ps(_mm_cmpgt_ps(vv, zero), _mm_cmplt_ps(uv, det))));
+
+		__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+		__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+		__m128 inside = _mm_and_ps(_mm_cmpgt_ps(tt, _mm_set1_ps(tmin)), _mm_cmplt_ps(tt, _mm_set1_ps(tmax)));
+
+		_mm_storeu_ps(t, tt);
+		_mm_storeu_ps(u, _mm_mul_ps(uu, invDet));
+		_mm_storeu_ps(v, _mm_mul_ps(vv, invDet));
+		return _mm_movemask_ps(_mm_andnot_ps(_mm_or_ps(parallel, _mm_or_ps(outU, outV)), inside));
+	}
+};
+
+struct LeafRay8
+{
+	__m256	ox, oy, oz;
+	__m256	dx, dy, dz;
+
+	LeafRay8(const Ray& ray)
+	{
+		ox = _mm256_set1_ps(ray.orig.x);
+		oy = _mm256_set1_ps(ray.orig.y);
+		oz = _mm256_set1_ps(ray.orig.z);
+		dx = _mm256_set1_ps(ray.dir.x);
+		dy = _mm256_set1_ps(ray.dir.y);
+		dz = _mm256_set1_ps(ray.dir.z);
+	}
+
+	// The lanes of b[0] and b[1] in the low and high half
+	static __forceinline __m256 load(const float* lo, const float* hi)
+	{
+		return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(lo)), _mm_load_ps(hi), 1);
+	}
+
+	__forceinline int test(const TriangleBlock* b, float tmin, float tmax, float* t, float* u, float* v) const
+	{
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 eps = _mm256_set1_ps(0.000001f);
+
+		__m256 e1x = load(b[0].e1x, b[1].e1x), e1y = load(b[0].e1y, b[1].e1y), e1z = load(b[0].e1z, b[1].e1z);
+		__m256 e2x = load(b[0].e2x, b[1].e2x), e2y = load(b[0].e2y, b[1].e2y), e2z = load(b[0].e2z, b[1].e2z);
+
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+		__m256 parallel = _mm256_and_ps(_mm256_cmp_ps(det, _mm256_sub_ps(zero, eps), _CMP_GT_OQ), _mm256_cmp_ps(det, eps, _CMP_LT_OQ));
+		__m256 front = _mm256_cmp_ps(det, zero, _CMP_GT_OQ);
+
+		__m256 tx = _mm256_sub_ps(ox, load(b[0].v0x, b[1].v0x));
+		__m256 ty = _mm256_sub_ps(oy, load(b[0].v0y, b[1].v0y));
+		__m256 tz = _mm256_sub_ps(oz, load(b[0].v0z, b[1].v0z));
+		__m256 uu = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz));
+		__m256 outU = _mm256_or_ps(
+			_mm256_and_ps(front, _mm256_or_ps(_mm256_cmp_ps(uu, zero, _CMP_LT_OQ), _mm256_cmp_ps(uu, det, _CMP_GT_OQ))),
+			_mm256_andnot_ps(front, _mm256_or_ps(_mm256_cmp_ps(uu, zero, _CMP_GT_OQ), _mm256_cmp_ps(uu, det, _CMP_LT_OQ))));
+
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+		__m256 vv = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz));
+		__m256 uv = _mm256_add_ps(uu, vv);
+		__m256 outV = _mm256_or_ps(
+			_mm256_and_ps(front, _mm256_or_ps(_mm256_cmp_ps(vv, zero, _CMP_LT_OQ), _mm256_cmp_ps(uv, det, _CMP_GT_OQ))),
+			_mm256_andnot_ps(front, _mm256_or_ps(_mm256_cmp_ps(vv, zero, _CMP_GT_OQ), _mm256_cmp_ps(uv, det, _CMP_LT_OQ))));
+
+		__m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+		__m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+		__m256 inside = _mm256_and_ps(_mm256_cmp_ps(tt, _mm256_set1_ps(tmin), _CMP_GT_OQ), _mm256_cmp_ps(tt, _mm256_set1_ps(tmax), _CMP_LT_OQ));
+
+		_mm256_storeu_ps(t, tt);
+		_mm256_storeu_ps(u, _mm256_mul_ps(uu, invDet));
+		_mm256_storeu_ps(v, _mm256_mul_ps(vv, invDet));
+		return _mm256_movemask_ps(_mm256_andnot_ps(_mm256_or_ps(parallel, _mm256_or_ps(outU, outV)), inside));
+	}
+};
+
+// The nearest of the lanes in mask, the first one on ties like in the scalar loop
+static __forceinline int nearestLane(int mask, const float* t)
+{
+	int lane = -1;
+	for (int i = 0; mask; ++i, mask >>= 1)
+		if ((mask & 1) && (lane == -1 || t[i] < t[lane]))
+			lane = i;
+	return lane;
+}
+
+__forceinline int LeafTriangles::intersect(int startPrim, int numPrims, const Ray& ray, float& tmax, float& u, float& v) const
+{
+	switch (LeafTriangles::kernel) {
+	case Kernel_AVX:	return intersectAVX(startPrim, numPrims, ray, tmax, u, v);
+	case Kernel_SSE:	return intersectSSE(startPrim, numPrims, ray, tmax, u, v);
+	default:			return intersectScalar(startPrim, numPrims, ray, tmax, u, v);
+	}
+}
+
+__forceinline bool LeafTriangles::occluded(int startPrim, int numPrims, const Ray& ray) const
+{
+	switch (LeafTriangles::kernel) {
+	case Kernel_AVX:	return occludedAVX(startPrim, numPrims, ray);
+	case Kernel_SSE:	return occludedSSE(startPrim, numPrims, ray);
+	default:			return occludedScalar(startPrim, numPrims, ray);
+	}
+}
+
+__forceinline int LeafTriangles::intersectSSE(int startPrim, int numPrims, const Ray& ray, float& tmax, float& u, float& v) const
+{
+	const LeafRay4 ray4(ray);
+	float t[4], uu[4], vv[4];
+
+	int hit = -1;
+	const TriangleBlock* b = m_blocks + m_leafBlocks[startPrim];
+	const TriangleBlock* end = b + (numPrims + TriangleBlock::Width - 1) / TriangleBlock::Width;
+	for (; b < end; ++b) {
+		int lane = nearestLane(ray4.test(b, ray.tmin, tmax, t, uu, vv), t);
+		if (lane != -1) {
+			hit = b->triangle[lane];
+			tmax = t[lane];
+			u = uu[lane];
+			v = vv[lane];
+		}
+	}
+	return hit;
+}
+
+// Pairs of blocks go through the 8-wide test, an odd last block through the 4-wide one
+__forceinline int LeafTriangles::intersectAVX(int startPrim, int numPrims, const Ray& ray, float& tmax, float& u, float& v) const
+{
+	const LeafRay8 ray8(ray);
+	float t[8], uu[8], vv[8];
+
+	int hit = -1;
+	const TriangleBlock* b = m_blocks + m_leafBlocks[startPrim];
+	const TriangleBlock* end = b + (numPrims + TriangleBlock::Width - 1) / TriangleBlock::Width;
+	for (; b + 1 < end; b += 2) {
+		int lane = nearestLane(ray8.test(b, ray.tmin, tmax, t, uu, vv), t);
+		if (lane != -1) {
+			hit = b[lane / TriangleBlock::Width].triangle[lane % TriangleBlock::Width];
+			tmax = t[lane];
+			u = uu[lane];
+			v = vv[lane];
+		}
+	}
+	_mm256_zeroupper();
+
+	if (b < end) {
+		int lane = nearestLane(LeafRay4(ray).test(b, ray.tmin, tmax, t, uu, vv), t);
+		if (lane != -1) {
+			hit = b->triangle[lane];
+			tmax = t[lane];
+			u = uu[lane];
+			v = vv[lane];
+		}
+	}
+	return hit;
+}
+
+__forceinline bool LeafTriangles::occludedSSE(int startPrim, int numPrims, const Ray& ray) const
+{
+	const LeafRay4 ray4(ray);
+	float t[4], u[4], v[4];
+
+	const TriangleBlock* b = m_blocks + m_leafBlocks[startPrim];
+	const TriangleBlock* end = b + (numPrims + TriangleBlock::Width - 1) / TriangleBlock::Width;
+	for (; b < end; ++b)
+		if (ray4.test(b, ray.tmin, ray.tmax, t, u, v))
+			return true;
+	return false;
+}
+
+__forceinline bool LeafTriangles::occludedAVX(int startPrim, int numPrims, const Ray& ray) const
+{
+	const LeafRay8 ray8(ray);
+	float t[8], u[8], v[8];
+
+	const TriangleBlock* b = m_blocks + m_leafBlocks[startPrim];
+	const TriangleBlock* end = b + (numPrims + TriangleBlock::Width - 1) / TriangleBlock::Width;
+	bool hit = false;
+	for (; !hit && b + 1 < end; b += 2)
+		hit = ray8.test(b, ray.tmin, ray.tmax, t, u, v) != 0;
+	_mm256_zeroupper();
+
+	if (!hit && b < end)
+		hit = LeafRay4(ray).test(b, ray.tmin, ray.tmax, t, u, v) != 0;
+	return hit;
+}
+
+}
\ No newline at end of file
@@ -18,6 +18,14 @@ RTTriangle::RTTriangle (const Vec3f* v0, const Vec3f* v1, const Vec3f* v2) {
 
 	m_userPointer = 0;
 
+	update();
+}
+
+void RTTriangle::update (void) {
+	const Vec3f* v0 = m_vertices[0];
+	const Vec3f* v1 = m_vertices[1];
+	const Vec3f* v2 = m_vertices[2];
+
 	// Calculate the triangle normal from the vertices
 	m_normal = FW::cross((*m_vertices[1]) - (*m_vertices[0]),
 		(*m_vertices[2]) - (*m_vertices[0])).normalized();
@@ -26,6 +26,9 @@ public:
 	
 	~RTTriangle (void);
 
+	// Recomputes the normal, centroid and bounds, e.g. after the vertices moved
+	void update (void);
+
 	__forceinline const Vec3f&	getNormal			(void) const 
 	{
 		return m_normal;
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "base/Math.hpp"
+#include <cfloat>
+#include <vector>
+
+// Smallest direction component used for the reciprocal, keeps the slab
+// distances finite so they never compute 0 * inf
+#define RAY_MIN_DIR 1e-20f
+
+namespace FW
+{
+
+// A ray orig + t*dir that is only hit for t in (tmin, tmax). The reciprocal
+// direction and its sign bits are computed once here instead of in every box
+// test of a traversal.
+struct Ray
+{
+	Vec3f		orig;
+	Vec3f		dir;
+	Vec3f		invDir;		// 1/dir, tiny components clamped to RAY_MIN_DIR first
+	S32			sign[3];	// 1 where dir is negative, the box is entered through bbMax on that axis
+	F32			tmin;
+	F32			tmax;
+
+	Ray			(void) {}
+
+	// dir is normalized, so t is the distance from orig
+	Ray			(const Vec3f& orig, const Vec3f& dir, float tmin = 0.0f, float tmax = FLT_MAX)
+		: orig(orig), dir(dir.normalized()), tmin(tmin), tmax(tmax)	{ setup(); }
+
+	// dir as given, so t = 1 is at orig + dir. This is the segment the
+	// (orig, dir) functions of RayTracer trace.
+	static Ray	segment		(const Vec3f& orig, const Vec3f& dir, float tmin = 0.0f, float tmax = 1.0f)
+	{
+		Ray r;
+		r.orig = orig;
+		r.dir = dir;
+		r.tmin = tmin;
+		r.tmax = tmax;
+		r.setup();
+		return r;
+	}
+
+	Vec3f		at			(float t) const	{ return orig + t*dir; }
+
+	// Recomputes invDir and sign after dir has changed
+	void		setup		(void)
+	{
+		for (int i = 0; i < 3; ++i) {
+			float d = dir[i];
+			if (FW::abs(d) < RAY_MIN_DIR)
+				d = (d < 0.0f) ? -RAY_MIN_DIR : RAY_MIN_DIR;
+			invDir[i] = 1.0f / d;
+			sign[i] = dir[i] < 0.0f;
+		}
+	}
+};
+
+// Rays of a batch query, one array per component. Like with Ray::segment
+// the directions are used as given, t is in (tmin, tmax) along them.
+struct RayBatch
+{
+	std::vector<F32>	ox, oy, oz;
+	std::vector<F32>	dx, dy, dz;
+	std::vector<F32>	tmin, tmax;
+
+	int			size		(void) const	{ return (int)ox.size(); }
+
+	void		clear		(void)
+	{
+		ox.clear(); oy.clear(); oz.clear();
+		dx.clear(); dy.clear(); dz.clear();
+		tmin.clear(); tmax.clear();
+	}
+
+	void		add			(const Vec3f& orig, const Vec3f& dir, float t0 = 0.0f, float t1 = 1.0f)
+	{
+		ox.push_back(orig.x); oy.push_back(orig.y); oz.push_back(orig.z);
+		dx.push_back(dir.x); dy.push_back(dir.y); dz.push_back(dir.z);
+		tmin.push_back(t0); tmax.push_back(t1);
+	}
+
+	void		add			(const Ray& ray)	{ add(ray.orig, ray.dir, ray.tmin, ray.tmax); }
+
+	Ray			get			(int i) const
+	{
+		return Ray::segment(Vec3f(ox[i], oy[i], oz[i]), Vec3f(dx[i], dy[i], dz[i]), tmin[i], tmax[i]);
+	}
+};
+
+// Closest hit of a ray without the Hit object: the index of the triangle in
+// the list of the RayTracer, -1 for none, and t, u and v of the hit
+struct RayHit
+{
+	S32			triangle;
+	F32			t;
+	F32			u;
+	F32			v;
+};
+
+// Work of one traversal, counted by RayTracer::rayCastStats and occludedStats:
+// nodes and leaves visited, ray-box and ray-triangle tests, and the most
+// entries the traversal stack held at once
+struct TraversalStats
+{
+	S32			nodes;
+	S32			boxes;
+	S32			triangles;
+	S32			stackDepth;
+
+	TraversalStats	(void) : nodes(0), boxes(0), triangles(0), stackDepth(0) {}
+};
+
+}
\ No newline at end of file
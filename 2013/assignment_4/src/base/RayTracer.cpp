@@ -12,6 +12,15 @@
 #include "Bvh.hpp"
 #include "Hit.hpp"
 #include "RTTriangle.hpp"
+#include "WideBvh.hpp"
+#include "LeafTriangles.hpp"
+#include "io/File.hpp"
+#include "base/Timer.hpp"
+#include "base/Thread.hpp"
+#include "base/MulticoreLauncher.hpp"
+#include <algorithm>
+#include <tuple>
+#include <immintrin.h>
 
 // Helper function for hashing scene data for caching BVHs
 extern "C" void MD5Buffer( void* buffer, size_t bufLen, unsigned int* pDigest );
@@ -34,89 +43,1200 @@ String RayTracer::computeMD5( const std::vector<Vec3f>& vertices )
 }
 // --------------------------------------------------------------------------
 
+// Hierarchy cache files. The header is followed by the node array and the
+// triangle permutation, both stored exactly as they are in memory, so a mapped
+// file is traversed in place without parsing the nodes. Files written by a
+// different version, byte order or build setting are rejected and rebuilt.
+#define HIERARCHY_VERSION 3
+#define HIERARCHY_ENDIAN_TAG 0x01020304u
+#define HIERARCHY_NODE_OFFSET 128
 
-RayTracer::RayTracer() : m_bvh(NULL)
+static const char s_hierarchyMagic[8] = { 'F', 'W', 'B', 'V', 'H', 0, 0, 0 };
+
+struct HierarchyHeader
+{
+	char		magic[8];
+	U32			endianTag;		// HIERARCHY_ENDIAN_TAG in the byte order of the writer
+	U32			version;
+	U32			nodeSize;		// sizeof(FlatNode)
+	S32			bvhMode;
+	S32			binCount;
+	F32			splitBudget;
+	S32			leafWidth;
+	S32			numTriangles;
+	BvhStats	stats;
+	S64			nodeOffset;		// Byte offset of the node array
+	S64			indexOffset;	// Byte offset of the triangle permutation, stats.numReferences entries
+};
+
+static_assert(sizeof(HierarchyHeader) <= HIERARCHY_NODE_OFFSET, "HierarchyHeader must fit before the nodes");
+// --------------------------------------------------------------------------
+
+// Wide traversal. Each node visit tests all children with one slab test and
+// pushes the hit ones farthest first, so the nearest child is popped next and
+// the shrinking closest hit culls the rest. A full node pushes N-1 entries on
+// top of the one it replaced, which bounds the stack by depth*(N-1)+1.
+#define WIDE_STACK_SIZE 512
+
+struct WideStackEntry
+{
+	S32		child;		// Node index, or first triangle of a leaf
+	S32		numPrims;	// -1 for inner nodes
+	F32		tnear;		// Entry distance of the child's box
+};
+
+// The ray broadcast to all lanes, and the slab test against the N child boxes
+// of a node. Returns a bit mask of the children entered before tmax and
+// stores their entry distances to tnear. The sign bits of the ray pick the
+// entry and exit planes of each axis once, instead of a min and max per node.
+template <int N> struct WideRay;
+
+template <>
+struct WideRay<4>
+{
+	__m128	ox, oy, oz;
+	__m128	idx, idy, idz;
+	S32		nearX, nearY, nearZ;	// Float offsets of the entry planes in WideNode, the exit planes are 3*N away
+	S32		farX, farY, farZ;
+
+	WideRay(const Ray& ray)
+	{
+		ox = _mm_set1_ps(ray.orig.x);
+		oy = _mm_set1_ps(ray.orig.y);
+		oz = _mm_set1_ps(ray.orig.z);
+		idx = _mm_set1_ps(ray.invDir.x);
+		idy = _mm_set1_ps(ray.invDir.y);
+		idz = _mm_set1_ps(ray.invDir.z);
+		nearX = (0 + 3*ray.sign[0]) * 4;
+		nearY = (1 + 3*ray.sign[1]) * 4;
+		nearZ = (2 + 3*ray.sign[2]) * 4;
+		farX = (3 - 3*ray.sign[0]) * 4;
+		farY = (4 - 3*ray.sign[1]) * 4;
+		farZ = (5 - 3*ray.sign[2]) * 4;
+	}
+
+	__forceinline int intersect(const WideNode<4>& node, float tmin, float tmax, float* tnear) const
+	{
+		const float* b = node.bbMinX;
+		__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b + nearX), ox), idx);
+		__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b + farX), ox), idx);
+		__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b + nearY), oy), idy);
+		__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b + farY), oy), idy);
+		__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b + nearZ), oz), idz);
+		__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b + farZ), oz), idz);
+
+		__m128 tn = _mm_max_ps(_mm_max_ps(tx0, ty0), _mm_max_ps(tz0, _mm_set1_ps(tmin)));
+		__m128 tf = _mm_min_ps(_mm_min_ps(tx1, ty1), _mm_min_ps(tz1, _mm_set1_ps(tmax)));
+
+		_mm_storeu_ps(tnear, tn);
+		return _mm_movemask_ps(_mm_cmple_ps(tn, tf)) & ((1 << node.numChildren) - 1);
+	}
+
+	__forceinline void leave(void) const {}
+};
+
+template <>
+struct WideRay<8>
+{
+	__m256	ox, oy, oz;
+	__m256	idx, idy, idz;
+	S32		nearX, nearY, nearZ;	// Float offsets of the entry planes in WideNode, the exit planes are 3*N away
+	S32		farX, farY, farZ;
+
+	WideRay(const Ray& ray)
+	{
+		ox = _mm256_set1_ps(ray.orig.x);
+		oy = _mm256_set1_ps(ray.orig.y);
+		oz = _mm256_set1_ps(ray.orig.z);
+		idx = _mm256_set1_ps(ray.invDir.x);
+		idy = _mm256_set1_ps(ray.invDir.y);
+		idz = _mm256_set1_ps(ray.invDir.z);
+		nearX = (0 + 3*ray.sign[0]) * 8;
+		nearY = (1 + 3*ray.sign[1]) * 8;
+		nearZ = (2 + 3*ray.sign[2]) * 8;
+		farX = (3 - 3*ray.sign[0]) * 8;
+		farY = (4 - 3*ray.sign[1]) * 8;
+		farZ = (5 - 3*ray.sign[2]) * 8;
+	}
+
+	__forceinline int intersect(const WideNode<8>& node, float tmin, float tmax, float* tnear) const
+	{
+		const float* b = node.bbMinX;
+		__m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b + nearX), ox), idx);
+		__m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b + farX), ox), idx);
+		__m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b + nearY), oy), idy);
+		__m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b + farY), oy), idy);
+		__m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b + nearZ), oz), idz);
+		__m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b + farZ), oz), idz);
+
+		__m256 tn = _mm256_max_ps(_mm256_max_ps(tx0, ty0), _mm256_max_ps(tz0, _mm256_set1_ps(tmin)));
+		__m256 tf = _mm256_min_ps(_mm256_min_ps(tx1, ty1), _mm256_min_ps(tz1, _mm256_set1_ps(tmax)));
+
+		_mm256_storeu_ps(tnear, tn);
+		return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ)) & ((1 << node.numChildren) - 1);
+	}
+
+	// Avoids the AVX to SSE transition penalty in the code that follows
+	__forceinline void leave(void) const { _mm256_zeroupper(); }
+};
+
+// The reciprocal computed like Ray::setup, for the lanes of a packet
+static __forceinline Vec3f safeInverse(const Vec3f& dir)
+{
+	Vec3f invDir;
+	for (int i = 0; i < 3; ++i) {
+		float d = dir[i];
+		if (FW::abs(d) < RAY_MIN_DIR)
+			d = (d < 0.0f) ? -RAY_MIN_DIR : RAY_MIN_DIR;
+		invDir[i] = 1.0f / d;
+	}
+	return invDir;
+}
+
+static __forceinline RayHit makeRayHit(int triangle, float t, float u, float v)
+{
+	RayHit h = { triangle, t, u, v };
+	return h;
+}
+
+static __forceinline Hit toHit(const std::vector<RTTriangle>& triangles, const Ray& ray, const RayHit& h)
+{
+	if (h.triangle != -1)
+		return Hit(&triangles[h.triangle], ray.at(h.t), h.t, h.u, h.v);
+	else
+		return Hit(NULL);
+}
+
+// The kernels below take a Stats flag. The instantiations with Stats = true
+// count their work into the TraversalStats they are given, the ones with
+// Stats = false are the plain kernels with the counting compiled out.
+template <bool Stats>
+static __forceinline void countStack(TraversalStats* stats, int stackSize)
+{
+	if (Stats)
+		stats->stackDepth = FW::max(stats->stackDepth, (S32)stackSize);
+}
+
+// Closest hit in (ray.tmin, ray.tmax)
+template <int N, bool Stats>
+static RayHit traverseWide(const WideNode<N>* nodes, const LeafTriangles& leaves, const Ray& ray, TraversalStats* stats)
+{
+	const WideRay<N> wide(ray);
+
+	WideStackEntry stack[WIDE_STACK_SIZE];
+	WideStackEntry root = { 0, -1, ray.tmin };
+	stack[0] = root;
+	int stackSize = 1;
+
+	float umin = 0.0f, vmin = 0.0f, tmin = ray.tmax;
+	int imin = -1;
+
+	while (stackSize > 0) {
+		countStack<Stats>(stats, stackSize);
+		const WideStackEntry e = stack[--stackSize];
+		if (e.tnear >= tmin)
+			continue;
+		if (Stats)
+			++stats->nodes;
+
+		if (e.numPrims >= 0) {
+			if (Stats)
+				stats->triangles += e.numPrims;
+			int i = leaves.intersect(e.child, e.numPrims, ray, tmin, umin, vmin);
+			if (i != -1)
+				imin = i;
+			continue;
+		}
+
+		const WideNode<N>& node = nodes[e.child];
+		float tnear[N];
+		int mask = wide.intersect(node, ray.tmin, tmin, tnear);
+		if (Stats)
+			stats->boxes += N;
+
+		// Insertion sort of the hit children, farthest first
+		WideStackEntry hits[N];
+		int numHits = 0;
+		for (int i = 0; i < N; ++i) {
+			if (!(mask & (1 << i)))
+				continue;
+
+			WideStackEntry h = { node.child[i], node.isLeaf(i) ? (S32)node.numPrims[i] : -1, tnear[i] };
+			int j = numHits++;
+			for (; j > 0 && hits[j-1].tnear < h.tnear; --j)
+				hits[j] = hits[j-1];
+			hits[j] = h;
+		}
+		for (int i = 0; i < numHits; ++i)
+			stack[stackSize++] = hits[i];
+	}
+
+	wide.leave();
+	return makeRayHit(imin, tmin, umin, vmin);
+}
+
+// Any hit in (ray.tmin, ray.tmax). The interval never shrinks, so the children
+// are pushed in node order and the first leaf with a hit ends the traversal.
+template <int N, bool Stats>
+static bool occludedWide(const WideNode<N>* nodes, const LeafTriangles& leaves, const Ray& ray, TraversalStats* stats)
+{
+	const WideRay<N> wide(ray);
+
+	WideStackEntry stack[WIDE_STACK_SIZE];
+	WideStackEntry root = { 0, -1, ray.tmin };
+	stack[0] = root;
+	int stackSize = 1;
+
+	bool hit = false;
+	while (stackSize > 0) {
+		countStack<Stats>(stats, stackSize);
+		const WideStackEntry e = stack[--stackSize];
+		if (Stats)
+			++stats->nodes;
+
+		if (e.numPrims >= 0) {
+			if (Stats)
+				stats->triangles += e.numPrims;
+			if (leaves.occluded(e.child, e.numPrims, ray)) {
+				hit = true;
+				break;
+			}
+			continue;
+		}
+
+		const WideNode<N>& node = nodes[e.child];
+		float tnear[N];
+		int mask = wide.intersect(node, ray.tmin, ray.tmax, tnear);
+		if (Stats)
+			stats->boxes += N;
+		for (int i = 0; i < N; ++i) {
+			if (!(mask & (1 << i)))
+				continue;
+
+			WideStackEntry h = { node.child[i], node.isLeaf(i) ? (S32)node.numPrims[i] : -1, tnear[i] };
+			stack[stackSize++] = h;
+		}
+	}
+
+	wide.leave();
+	return hit;
+}
+
+// Binary traversal, the same scheme one node at a time: both children are
+// tested and the hit ones pushed farther first. Each visit replaces one entry
+// with at most two, so the stack holds at most depth+1 entries; deeper trees
+// use the recursive traversal.
+#define BINARY_STACK_SIZE 1024
+
+struct BinaryStackEntry
+{
+	S32		node;
+	F32		tnear;
+};
+
+// bbMin and bbMax are consecutive, the sign bits of the ray index the entry
+// and exit planes
+static __forceinline bool intersectBox(const FlatNode& n, const Ray& ray, float tmin, float tmax, float& tnear)
+{
+	const Vec3f* b = &n.bbMin;
+	float tx0 = (b[ray.sign[0]].x - ray.orig.x) * ray.invDir.x;
+	float tx1 = (b[1 - ray.sign[0]].x - ray.orig.x) * ray.invDir.x;
+	float ty0 = (b[ray.sign[1]].y - ray.orig.y) * ray.invDir.y;
+	float ty1 = (b[1 - ray.sign[1]].y - ray.orig.y) * ray.invDir.y;
+	float tz0 = (b[ray.sign[2]].z - ray.orig.z) * ray.invDir.z;
+	float tz1 = (b[1 - ray.sign[2]].z - ray.orig.z) * ray.invDir.z;
+
+	tnear = FW::max(FW::max(tx0, ty0), FW::max(tz0, tmin));
+	float tfar = FW::min(FW::min(tx1, ty1), FW::min(tz1, tmax));
+	return tnear <= tfar;
+}
+
+// Closest hit below rootNode, whose box the ray is known to enter, with t in
+// (ray.tmin, tmin). Updates tmin, umin, vmin and imin when one is found.
+template <bool Stats>
+static void traverseBinarySubtree(const FlatNode* nodes, const LeafTriangles& leaves, const Ray& ray,
+	int rootNode, float& tmin, float& umin, float& vmin, int& imin, TraversalStats* stats)
+{
+	BinaryStackEntry stack[BINARY_STACK_SIZE];
+	BinaryStackEntry root = { rootNode, ray.tmin };
+	stack[0] = root;
+	int stackSize = 1;
+
+	while (stackSize > 0) {
+		countStack<Stats>(stats, stackSize);
+		const BinaryStackEntry e = stack[--stackSize];
+		if (e.tnear >= tmin)
+			continue;
+		if (Stats)
+			++stats->nodes;
+
+		const FlatNode& node = nodes[e.node];
+		if (node.isLeaf()) {
+			if (Stats)
+				stats->triangles += node.numPrims;
+			int i = leaves.intersect(node.startPrim, node.numPrims, ray, tmin, umin, vmin);
+			if (i != -1)
+				imin = i;
+			continue;
+		}
+
+		// The left child is stored right after its parent
+		BinaryStackEntry left = { e.node + 1, 0.0f };
+		BinaryStackEntry right = { node.rightChild, 0.0f };
+		bool hitLeft = intersectBox(nodes[left.node], ray, ray.tmin, tmin, left.tnear);
+		bool hitRight = intersectBox(nodes[right.node], ray, ray.tmin, tmin, right.tnear);
+		if (Stats)
+			stats->boxes += 2;
+
+		if (hitLeft && hitRight && left.tnear < right.tnear) {
+			stack[stackSize++] = right;
+			stack[stackSize++] = left;
+		}
+		else {
+			if (hitLeft)
+				stack[stackSize++] = left;
+			if (hitRight)
+				stack[stackSize++] = right;
+		}
+	}
+}
+
+template <bool Stats>
+static RayHit traverseBinary(const FlatNode* nodes, const LeafTriangles& leaves, const Ray& ray, TraversalStats* stats)
+{
+	float umin = 0.0f, vmin = 0.0f, tmin = ray.tmax;
+	int imin = -1;
+	traverseBinarySubtree<Stats>(nodes, leaves, ray, 0, tmin, umin, vmin, imin, stats);
+	return makeRayHit(imin, tmin, umin, vmin);
+}
+
+template <bool Stats>
+static bool occludedBinary(const FlatNode* nodes, const LeafTriangles& leaves, const Ray& ray, TraversalStats* stats)
+{
+	S32 stack[BINARY_STACK_SIZE];
+	stack[0] = 0;
+	int stackSize = 1;
+
+	while (stackSize > 0) {
+		countStack<Stats>(stats, stackSize);
+		const FlatNode& node = nodes[stack[--stackSize]];
+		float tnear;
+		if (Stats)
+			++stats->boxes;
+		if (!intersectBox(node, ray, ray.tmin, ray.tmax, tnear))
+			continue;
+		if (Stats)
+			++stats->nodes;
+
+		if (node.isLeaf()) {
+			if (Stats)
+				stats->triangles += node.numPrims;
+			if (leaves.occluded(node.startPrim, node.numPrims, ray))
+				return true;
+			continue;
+		}
+
+		// The left child is stored right after its parent
+		stack[stackSize++] = node.rightChild;
+		stack[stackSize++] = (S32)(&node - nodes) + 1;
+	}
+	return false;
+}
+
+// Packet traversal of the binary tree, four rays to an SSE register. A node
+// is first tested against the packet as a whole: with the direction signs
+// shared by all rays, interval arithmetic over the origins and reciprocals
+// bounds the slab distances of every ray, and a box outside those bounds is
+// culled without looking at the rays. The per ray tests and the triangle
+// tests use the arithmetic of the single ray kernels, so the hits are the
+// same. Subtrees entered by fewer than PACKET_MIN_ACTIVE rays are finished
+// one ray at a time.
+#define PACKET_GROUPS (RayTracer::PacketSize / 4)
+#define PACKET_MIN_ACTIVE 2
+
+struct RayPacket
+{
+	__m128	ox[PACKET_GROUPS], oy[PACKET_GROUPS], oz[PACKET_GROUPS];
+	__m128	dx[PACKET_GROUPS], dy[PACKET_GROUPS], dz[PACKET_GROUPS];
+	__m128	idx[PACKET_GROUPS], idy[PACKET_GROUPS], idz[PACKET_GROUPS];
+	__m128	tmin[PACKET_GROUPS];		// Closest hit so far, -1 in unused lanes
+	__m128	u[PACKET_GROUPS], v[PACKET_GROUPS];
+	__m128	triangle[PACKET_GROUPS];	// S32 index of the closest hit, -1 for none
+
+	Vec3f	orgMin, orgMax;				// Bounds over the rays of the packet
+	Vec3f	invMin, invMax;
+	Vec3f	meanDir;
+
+	__forceinline float&	lane	(__m128* a, int r)	{ return ((float*)a)[r]; }
+	__forceinline S32&		index	(int r)				{ return ((S32*)triangle)[r]; }
+};
+
+static __forceinline __m128 blend(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// Distance range to the plane at coordinate p over all origins and
+// reciprocals. Rounding is monotonic, so it contains the distance each ray
+// computes for itself.
+static __forceinline void slabInterval(float p, float oMin, float oMax, float iMin, float iMax, float& lo, float& hi)
+{
+	float a = (p - oMax) * iMin, b = (p - oMax) * iMax;
+	float c = (p - oMin) * iMin, d = (p - oMin) * iMax;
+	lo = FW::min(FW::min(a, b), FW::min(c, d));
+	hi = FW::max(FW::max(a, b), FW::max(c, d));
+}
+
+// False if no ray of the packet can enter the box before tmax
+static __forceinline bool intersectFrustum(const RayPacket& p, const FlatNode& n, float tmax)
+{
+	float tnear = 0.0f, tfar = tmax;
+	for (int a = 0; a < 3; ++a) {
+		bool positive = p.invMin[a] > 0.0f;
+		float lo, hi, unused;
+		slabInterval(positive ? n.bbMin[a] : n.bbMax[a], p.orgMin[a], p.orgMax[a], p.invMin[a], p.invMax[a], lo, unused);
+		slabInterval(positive ? n.bbMax[a] : n.bbMin[a], p.orgMin[a], p.orgMax[a], p.invMin[a], p.invMax[a], unused, hi);
+		tnear = FW::max(tnear, lo);
+		tfar = FW::min(tfar, hi);
+	}
+	return tnear <= tfar;
+}
+
+// Same slab test as intersectBox for the four rays of group g
+static __forceinline int intersectBoxPacket(const RayPacket& p, int g, const FlatNode& n)
+{
+	__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.bbMin.x), p.ox[g]), p.idx[g]);
+	__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.bbMax.x), p.ox[g]), p.idx[g]);
+	__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.bbMin.y), p.oy[g]), p.idy[g]);
+	__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.bbMax.y), p.oy[g]), p.idy[g]);
+	__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.bbMin.z), p.oz[g]), p.idz[g]);
+	__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.bbMax.z), p.oz[g]), p.idz[g]);
+
+	__m128 tn = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+	__m128 tf = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), p.tmin[g]));
+	return _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+}
+
+// LeafTriangles::intersect for the rays of group g set in mask, one triangle
+// against four rays at a time
+static __forceinline void intersectLeafPacket(RayPacket& p, int g, int mask, const TriangleBlock* b, const TriangleBlock* end)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 eps = _mm_set1_ps(0.000001f);
+	const __m128 negEps = _mm_set1_ps(-0.000001f);
+	const __m128 active = _mm_castsi128_ps(_mm_setr_epi32(-(mask & 1), -((mask >> 1) & 1), -((mask >> 2) & 1), -((mask >> 3) & 1)));
+
+	const __m128 dx = p.dx[g], dy = p.dy[g], dz = p.dz[g];
+	for (; b < end; ++b) {
+		for (int i = 0; i < TriangleBlock::Width && b->triangle[i] != -1; ++i) {
+			__m128 e1x = _mm_set1_ps(b->e1x[i]), e1y = _mm_set1_ps(b->e1y[i]), e1z = _mm_set1_ps(b->e1z[i]);
+			__m128 e2x = _mm_set1_ps(b->e2x[i]), e2y = _mm_set1_ps(b->e2y[i]), e2z = _mm_set1_ps(b->e2z[i]);
+
+			__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+			__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+			__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+			__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+			__m128 tx = _mm_sub_ps(p.ox[g], _mm_set1_ps(b->v0x[i]));
+			__m128 ty = _mm_sub_ps(p.oy[g], _mm_set1_ps(b->v0y[i]));
+			__m128 tz = _mm_sub_ps(p.oz[g], _mm_set1_ps(b->v0z[i]));
+			__m128 uu = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz));
+
+			__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+			__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+			__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+			__m128 vv = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz));
+			__m128 uv = _mm_add_ps(uu, vv);
+
+			// Inside tests for both windings, as in intersect_triangle1
+			__m128 front = _mm_and_ps(_mm_cmpge_ps(det, eps),
+				_mm_and_ps(_mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, det)), _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(uv, det))));
+			__m128 back = _mm_and_ps(_mm_cmple_ps(det, negEps),
+				_mm_and_ps(_mm_and_ps(_mm_cmple_ps(uu, zero), _mm_cmpge_ps(uu, det)), _mm_and_ps(_mm_cmple_ps(vv, zero), _mm_cmpge_ps(uv, det))));
+
+			__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+			__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+			__m128 hit = _mm_and_ps(_mm_and_ps(active, _mm_or_ps(front, back)), _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, p.tmin[g])));
+			if (!_mm_movemask_ps(hit))
+				continue;
+
+			p.tmin[g] = blend(hit, t, p.tmin[g]);
+			p.u[g] = blend(hit, _mm_mul_ps(uu, invDet), p.u[g]);
+			p.v[g] = blend(hit, _mm_mul_ps(vv, invDet), p.v[g]);
+			p.triangle[g] = blend(hit, _mm_castsi128_ps(_mm_set1_epi32(b->triangle[i])), p.triangle[g]);
+		}
+	}
+}
+
+static __forceinline float packetTmax(const RayPacket& p)
+{
+	__m128 m = p.tmin[0];
+	for (int g = 1; g < PACKET_GROUPS; ++g)
+		m = _mm_max_ps(m, p.tmin[g]);
+	float t[4];
+	_mm_storeu_ps(t, m);
+	return FW::max(FW::max(t[0], t[1]), FW::max(t[2], t[3]));
+}
+
+// Closest hits of up to RayTracer::PacketSize rays. Returns false, leaving
+// hits untouched, if the rays do not share their direction signs. With Stats
+// a node counts once for the whole packet and the stack is the packet's; the
+// subtrees finished one ray at a time count as in traverseBinary.
+template <bool Stats>
+static bool tracePacket(const FlatNode* nodes, const LeafTriangles& leaves, const std::vector<RTTriangle>& triangles,
+	const Vec3f* origs, const Vec3f* dirs, int numRays, Hit* hits, TraversalStats* stats)
+{
+	for (int r = 1; r < numRays; ++r)
+		for (int a = 0; a < 3; ++a)
+			if ((dirs[r][a] < 0.0f) != (dirs[0][a] < 0.0f))
+				return false;
+
+	RayPacket p;
+	p.orgMin = p.orgMax = origs[0];
+	p.invMin = p.invMax = safeInverse(dirs[0]);
+	p.meanDir = Vec3f(0.0f);
+	for (int r = 0; r < RayTracer::PacketSize; ++r) {
+		// Unused lanes repeat the first ray and never hit anything
+		int s = r < numRays ? r : 0;
+		Vec3f invDir = safeInverse(dirs[s]);
+		p.lane(p.ox, r) = origs[s].x;
+		p.lane(p.oy, r) = origs[s].y;
+		p.lane(p.oz, r) = origs[s].z;
+		p.lane(p.dx, r) = dirs[s].x;
+		p.lane(p.dy, r) = dirs[s].y;
+		p.lane(p.dz, r) = dirs[s].z;
+		p.lane(p.idx, r) = invDir.x;
+		p.lane(p.idy, r) = invDir.y;
+		p.lane(p.idz, r) = invDir.z;
+		p.lane(p.tmin, r) = r < numRays ? 1.0f : -1.0f;
+		p.lane(p.u, r) = 0.0f;
+		p.lane(p.v, r) = 0.0f;
+		p.index(r) = -1;
+
+		p.orgMin = FW::min(p.orgMin, origs[s]);
+		p.orgMax = FW::max(p.orgMax, origs[s]);
+		p.invMin = FW::min(p.invMin, invDir);
+		p.invMax = FW::max(p.invMax, invDir);
+		p.meanDir += dirs[s];
+	}
+
+	S32 stack[BINARY_STACK_SIZE];
+	stack[0] = 0;
+	int stackSize = 1;
+	float tmax = 1.0f;
+
+	while (stackSize > 0) {
+		countStack<Stats>(stats, stackSize);
+		const int nodeIdx = stack[--stackSize];
+		const FlatNode& node = nodes[nodeIdx];
+		if (!intersectFrustum(p, node, tmax))
+			continue;
+		if (Stats)
+			++stats->nodes;
+
+		int masks[PACKET_GROUPS];
+		int numActive = 0;
+		for (int g = 0; g < PACKET_GROUPS; ++g) {
+			masks[g] = intersectBoxPacket(p, g, node);
+			numActive += (masks[g] & 1) + ((masks[g] >> 1) & 1) + ((masks[g] >> 2) & 1) + ((masks[g] >> 3) & 1);
+		}
+		if (numActive == 0)
+			continue;
+
+		if (node.isLeaf()) {
+			const TriangleBlock* b = leaves.getBlocks() + leaves.getFirstBlock(node.startPrim);
+			const TriangleBlock* end = b + (node.numPrims + TriangleBlock::Width - 1) / TriangleBlock::Width;
+			for (int g = 0; g < PACKET_GROUPS; ++g)
+				if (masks[g])
+					intersectLeafPacket(p, g, masks[g], b, end);
+			tmax = packetTmax(p);
+			continue;
+		}
+
+		if (numActive < PACKET_MIN_ACTIVE) {
+			for (int r = 0; r < numRays; ++r) {
+				if (!(masks[r / 4] & (1 << (r % 4))))
+					continue;
+				traverseBinarySubtree<Stats>(nodes, leaves, Ray::segment(origs[r], dirs[r]), nodeIdx, p.lane(p.tmin, r), p.lane(p.u, r), p.lane(p.v, r), p.index(r), stats);
+			}
+			tmax = packetTmax(p);
+			continue;
+		}
+
+		// The child nearer along the mean direction is popped first
+		const FlatNode& left = nodes[nodeIdx + 1];
+		const FlatNode& right = nodes[node.rightChild];
+		if (dot((left.bbMin + left.bbMax) - (right.bbMin + right.bbMax), p.meanDir) > 0.0f) {
+			stack[stackSize++] = nodeIdx + 1;
+			stack[stackSize++] = node.rightChild;
+		} else {
+			stack[stackSize++] = node.rightChild;
+			stack[stackSize++] = nodeIdx + 1;
+		}
+	}
+
+	for (int r = 0; r < numRays; ++r) {
+		int i = p.index(r);
+		float t = p.lane(p.tmin, r);
+		hits[r] = i != -1 ? Hit(&triangles[i], origs[r] + t*dirs[r], t, p.lane(p.u, r), p.lane(p.v, r)) : Hit(NULL);
+	}
+	return true;
+}
+
+// --------------------------------------------------------------------------
+
+// Batch queries. The rays are sorted by the octant of their direction and then
+// by the Morton code of the origin within the bounds of all the origins, and
+// each task traces a chunk of BATCH_CHUNK rays of that order. Batches under
+// BATCH_SORT_MIN rays, such as a tile's rays of one bounce, and batches from a
+// single origin are traced in the given order, the sort would cost more than
+// it saves.
+#define BATCH_CHUNK 4096
+#define BATCH_SORT_MIN 1024
+#define BATCH_MORTON_BITS 10
+
+struct BatchJob
+{
+	const RayTracer*		rt;
+	const RayBatch*			rays;
+	const S32*				order;		// Ray indices in tracing order, NULL for the given order
+	int						count;
+	RayHit*					hits;		// rayCastBatch
+	U8*						occluded;	// occludedBatch
+};
+
+static void sortBatch(const RayBatch& rays, std::vector<S32>& order)
+{
+	int count = rays.size();
+	order.clear();
+	if (count < BATCH_SORT_MIN)
+		return;
+
+	Vec3f lo(FLT_MAX), hi(-FLT_MAX);
+	for (int i = 0; i < count; ++i) {
+		Vec3f o(rays.ox[i], rays.oy[i], rays.oz[i]);
+		lo = FW::min(lo, o);
+		hi = FW::max(hi, o);
+	}
+	if (lo == hi)
+		return;
+
+	order.resize(count);
+	for (int i = 0; i < count; ++i)
+		order[i] = i;
+
+	float maxCell = (float)((1 << BATCH_MORTON_BITS) - 1);
+	Vec3f extent = hi - lo;
+	Vec3f scale(extent.x > 0.0f ? maxCell / extent.x : 0.0f,
+				extent.y > 0.0f ? maxCell / extent.y : 0.0f,
+				extent.z > 0.0f ? maxCell / extent.z : 0.0f);
+
+	std::vector<U64> keys(count);
+	for (int i = 0; i < count; ++i) {
+		Vec3f c = (Vec3f(rays.ox[i], rays.oy[i], rays.oz[i]) - lo) * scale;
+		U32 octant = (rays.dx[i] < 0.0f ? 4 : 0) | (rays.dy[i] < 0.0f ? 2 : 0) | (rays.dz[i] < 0.0f ? 1 : 0);
+		keys[i] = ((U64)octant << (3 * BATCH_MORTON_BITS)) | Bvh::mortonCode((U64)c.x, (U64)c.y, (U64)c.z, BATCH_MORTON_BITS);
+	}
+
+	Bvh::radixSort(keys, order, 3 * BATCH_MORTON_BITS + 3, (count + BATCH_CHUNK - 1) / BATCH_CHUNK);
+}
+
+static void rayCastBatchTask(MulticoreLauncher::Task& task)
+{
+	const BatchJob& job = *(const BatchJob*)task.data;
+	int end = FW::min((task.idx + 1) * BATCH_CHUNK, job.count);
+	for (int k = task.idx * BATCH_CHUNK; k < end; ++k) {
+		int i = job.order ? job.order[k] : k;
+		job.rt->rayCast(job.rays->get(i), job.hits[i]);
+	}
+}
+
+static void occludedBatchTask(MulticoreLauncher::Task& task)
+{
+	const BatchJob& job = *(const BatchJob*)task.data;
+	int end = FW::min((task.idx + 1) * BATCH_CHUNK, job.count);
+	for (int k = task.idx * BATCH_CHUNK; k < end; ++k) {
+		int i = job.order ? job.order[k] : k;
+		job.occluded[i] = job.rt->occluded(job.rays->get(i)) ? 1 : 0;
+	}
+}
+
+static void runBatch(MulticoreLauncher::TaskFunc func, BatchJob& job, MulticoreLauncher* launcher)
+{
+	int numChunks = (job.count + BATCH_CHUNK - 1) / BATCH_CHUNK;
+	if (launcher && numChunks > 1) {
+		launcher->push(func, &job, 0, numChunks);
+		launcher->popAll();
+		return;
+	}
+
+	MulticoreLauncher::Task task;
+	task.launcher = NULL;
+	task.func = func;
+	task.data = &job;
+	task.result = NULL;
+	for (task.idx = 0; task.idx < numChunks; ++task.idx)
+		func(task);
+}
+
+// --------------------------------------------------------------------------
+
+RayTracer::TraversalMode RayTracer::traversalMode = RayTracer::TraversalMode_Wide8;
+float RayTracer::rebuildThreshold = 0.5f;
+
+// A background rebuild works on its own copy of the triangles, with the
+// duplicates of spatial splits removed, and builds serially so it stays off
+// the worker threads the renderer uses.
+struct BvhRebuild
+{
+	std::vector<RTTriangle>		triangles;
+	Bvh*						bvh;
+};
+
+static void rebuildThreadFunc( void* param )
+{
+	BvhRebuild* rebuild = (BvhRebuild*)param;
+	rebuild->bvh = new Bvh( rebuild->triangles, 1 );
+}
+
+const char* RayTracer::getTraversalModeName( TraversalMode m )
+{
+	switch ( m )
+	{
+	case TraversalMode_Binary:	return "Binary";
+	case TraversalMode_Wide4:	return "4-wide (SSE)";
+	case TraversalMode_Wide8:	return "8-wide (AVX)";
+	default:					return "Unknown";
+	}
+}
+
+
+RayTracer::RayTracer() : m_bvh(NULL), m_nodes(NULL), m_hierarchyFile(NULL), m_hierarchyMapping(NULL), m_hierarchyView(NULL), m_wideBvh4(NULL), m_wideBvh8(NULL), m_leafTriangles(NULL), m_rebuildThread(NULL), m_rebuild(NULL)
 {
 }
 
 RayTracer::~RayTracer()
 {
+	cancelRebuild();
+	delete m_rebuildThread;
+	delete m_wideBvh4;
+	delete m_wideBvh8;
+	delete m_leafTriangles;
 	delete m_bvh;
+	unmapHierarchy();
 }
 
-void RayTracer::loadHierarchy( const char* filename, const std::vector<RTTriangle>& triangles )
+void RayTracer::unmapHierarchy( void )
 {
-	// Make the compiler shut up
-	(void)filename;
-	(void)triangles;
+	if ( m_hierarchyView )
+		UnmapViewOfFile( m_hierarchyView );
+	if ( m_hierarchyMapping )
+		CloseHandle( m_hierarchyMapping );
+	if ( m_hierarchyFile )
+		CloseHandle( m_hierarchyFile );
+
+	m_hierarchyView = NULL;
+	m_hierarchyMapping = NULL;
+	m_hierarchyFile = NULL;
+}
+
+bool RayTracer::loadHierarchy( const char* filename, std::vector<RTTriangle>& triangles )
+{
+	HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( file == INVALID_HANDLE_VALUE )
+		return false;
 
-	// TODO
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	const U8* view = NULL;
+	if ( GetFileSizeEx( file, &size ) && size.QuadPart >= HIERARCHY_NODE_OFFSET )
+		mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	if ( mapping )
+		view = (const U8*)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+
+	// Validate the header before touching anything else
+	const HierarchyHeader* header = (const HierarchyHeader*)view;
+	bool valid = view &&
+		memcmp( header->magic, s_hierarchyMagic, sizeof(s_hierarchyMagic) ) == 0 &&
+		header->endianTag == HIERARCHY_ENDIAN_TAG &&
+		header->version == HIERARCHY_VERSION &&
+		header->nodeSize == sizeof(FlatNode) &&
+		header->bvhMode == Bvh::getBvhMode() &&
+		header->binCount == Bvh::getBinCount() &&
+		header->splitBudget == Bvh::getSplitBudget() &&
+		header->leafWidth == Bvh::getLeafWidth() &&
+		header->numTriangles == (S32)triangles.size() &&
+		header->stats.numTriangles == header->numTriangles &&
+		header->stats.numReferences >= header->numTriangles &&
+		header->stats.numNodes > 0 &&
+		header->nodeOffset == HIERARCHY_NODE_OFFSET &&
+		header->indexOffset == header->nodeOffset + (S64)header->stats.numNodes * (S64)sizeof(FlatNode) &&
+		header->indexOffset + (S64)header->stats.numReferences * (S64)sizeof(S32) <= size.QuadPart;
+
+	// Put the triangles in tree order, duplicated where the tree references them more than once
+	if ( valid )
+	{
+		const S32* indices = (const S32*)(view + header->indexOffset);
+		std::vector<RTTriangle> original;
+		original.swap( triangles );
+		triangles.reserve( header->stats.numReferences );
+		for ( int i = 0; valid && i < header->stats.numReferences; ++i )
+		{
+			valid = indices[i] >= 0 && indices[i] < header->numTriangles;
+			if ( valid )
+				triangles.push_back( original[indices[i]] );
+		}
+		if ( !valid )
+			triangles.swap( original );
+	}
+
+	if ( !valid )
+	{
+		if ( view )
+			UnmapViewOfFile( view );
+		if ( mapping )
+			CloseHandle( mapping );
+		CloseHandle( file );
+		return false;
+	}
+
+	// The nodes are used straight from the mapped file
+	cancelRebuild();
+	delete m_bvh;
+	unmapHierarchy();
+	m_hierarchyFile = file;
+	m_hierarchyMapping = mapping;
+	m_hierarchyView = view;
+
+	m_triangles = &triangles;
+	m_bvh = new Bvh( triangles, (const FlatNode*)(view + header->nodeOffset), header->stats );
+	m_nodes = m_bvh->getNodes();
+	buildLeafTriangles();
+	buildWideBvh();
+	return true;
 }
 
 void RayTracer::saveHierarchy(const char* filename, const std::vector<RTTriangle>& triangles )
 {
-	// Make the compiler shut up
-	(void)filename;
-	(void)triangles;
+	const std::vector<S32>& indices = m_bvh->getTriangleIndices();
+	FW_ASSERT( indices.size() == triangles.size() );
+
+	HierarchyHeader header;
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic, s_hierarchyMagic, sizeof(s_hierarchyMagic) );
+	header.endianTag = HIERARCHY_ENDIAN_TAG;
+	header.version = HIERARCHY_VERSION;
+	header.nodeSize = sizeof(FlatNode);
+	header.bvhMode = Bvh::getBvhMode();
+	header.binCount = Bvh::getBinCount();
+	header.splitBudget = Bvh::getSplitBudget();
+	header.leafWidth = Bvh::getLeafWidth();
+	header.stats = m_bvh->getStats();
+	header.numTriangles = header.stats.numTriangles;
+	header.nodeOffset = HIERARCHY_NODE_OFFSET;
+	header.indexOffset = header.nodeOffset + (S64)header.stats.numNodes * sizeof(FlatNode);
+
+	U8 headerBlock[HIERARCHY_NODE_OFFSET];
+	memset( headerBlock, 0, sizeof(headerBlock) );
+	memcpy( headerBlock, &header, sizeof(header) );
 
-	// TODO
+	String oldError = clearError();
+	{
+		File file( filename, File::Create );
+		file.write( headerBlock, sizeof(headerBlock) );
+		file.write( m_nodes, (int)(header.stats.numNodes * sizeof(FlatNode)) );
+		if ( !indices.empty() )
+			file.write( &indices[0], (int)(indices.size() * sizeof(S32)) );
+	}
+	if ( hasError() )
+		::printf( "Failed to save hierarchy to %s: %s\n", filename, getError().getPtr() );
+	restoreError( oldError );
 }
 
 void RayTracer::constructHierarchy( std::vector<RTTriangle>& triangles )
 {
 	m_triangles = &triangles;
+	cancelRebuild();
 	delete m_bvh;				// Delete the possible old BVH
+	unmapHierarchy();
 	m_bvh = new Bvh(triangles);	// Construct a new BVH
+	m_nodes = m_bvh->getNodes();
+	buildLeafTriangles();
+	buildWideBvh();
+}
+
+void RayTracer::refitHierarchy( void )
+{
+	Timer stopwatch;
+	stopwatch.start();
+	float cost = m_bvh->refit();
+	stopwatch.end();
+
+	// The refit copied the nodes out of a mapped file
+	m_nodes = m_bvh->getNodes();
+	unmapHierarchy();
+	buildLeafTriangles();
+	buildWideBvh();
+
+	::printf( "Refit BVH in %.3f sec, SAH cost %.2f (%.2f when built)\n", stopwatch.getTotal(), cost, m_bvh->getBuildSAHCost() );
+
+	if ( m_rebuild || rebuildThreshold <= 0.0f || cost <= m_bvh->getBuildSAHCost() * (1.0f + rebuildThreshold) )
+		return;
+
+	::printf( "SAH cost grew by more than %.0f%%, rebuilding the BVH in the background\n", rebuildThreshold * 100.0f );
+
+	m_rebuild = new BvhRebuild;
+	m_rebuild->bvh = NULL;
+	m_rebuild->triangles = *m_triangles;
+
+	// Copies made by spatial splits share the user pointer and the vertices
+	const BvhStats& stats = m_bvh->getStats();
+	if ( stats.numReferences > stats.numTriangles )
+	{
+		std::vector<RTTriangle>& triangles = m_rebuild->triangles;
+		std::stable_sort( triangles.begin(), triangles.end(), []( const RTTriangle& a, const RTTriangle& b ) -> bool {
+			return std::tie( a.m_userPointer, a.m_vertices[0], a.m_vertices[1], a.m_vertices[2] ) <
+				   std::tie( b.m_userPointer, b.m_vertices[0], b.m_vertices[1], b.m_vertices[2] );
+		} );
+		triangles.erase( std::unique( triangles.begin(), triangles.end(), []( const RTTriangle& a, const RTTriangle& b ) -> bool {
+			return a.m_userPointer == b.m_userPointer && memcmp( a.m_vertices, b.m_vertices, sizeof(a.m_vertices) ) == 0;
+		} ), triangles.end() );
+	}
+
+	if ( !m_rebuildThread )
+		m_rebuildThread = new Thread;
+	m_rebuildThread->start( rebuildThreadFunc, m_rebuild );
+}
+
+bool RayTracer::finishRebuild( bool wait )
+{
+	if ( !m_rebuild || (!wait && m_rebuildThread->isAlive()) )
+		return false;
+	m_rebuildThread->join();
+
+	delete m_bvh;
+	unmapHierarchy();
+
+	m_triangles->swap( m_rebuild->triangles );
+	m_bvh = m_rebuild->bvh;
+	m_bvh->rebind( *m_triangles );
+	delete m_rebuild;
+	m_rebuild = NULL;
+
+	// Catch up with vertex changes made while the tree was being built
+	m_bvh->refit();
+	m_nodes = m_bvh->getNodes();
+	buildLeafTriangles();
+	buildWideBvh();
+
+	::printf( "Swapped in the rebuilt BVH, SAH cost %.2f\n", m_bvh->getSAHCost() );
+	return true;
+}
+
+void RayTracer::cancelRebuild( void )
+{
+	if ( !m_rebuild )
+		return;
+
+	m_rebuildThread->join();
+	delete m_rebuild->bvh;
+	delete m_rebuild;
+	m_rebuild = NULL;
+}
+
+void RayTracer::buildLeafTriangles( void )
+{
+	delete m_leafTriangles;
+	m_leafTriangles = new LeafTriangles( *m_bvh, *m_triangles );
+
+	// The pointer based test reads the RTTriangles and the vertices they point
+	// to, which like in computeMD5 are assumed to be one array
+	const Vec3f* first = NULL;
+	const Vec3f* last = NULL;
+	for ( size_t i = 0; i < m_triangles->size(); ++i )
+		for ( int j = 0; j < 3; ++j )
+		{
+			const Vec3f* v = (*m_triangles)[i].m_vertices[j];
+			first = ( !first || v < first ) ? v : first;
+			last = ( !last || v > last ) ? v : last;
+		}
+	size_t pointerBytes = m_triangles->size() * sizeof(RTTriangle) + ( first ? ( last - first + 1 ) * sizeof(Vec3f) : 0 );
+
+	::printf( "Leaf triangles: %d blocks, %.1f MB (RTTriangles and vertices: %.1f MB), %s kernel\n",
+		m_leafTriangles->getNumOfBlocks(), m_leafTriangles->getMemoryUsage() / (1024.0f * 1024.0f), pointerBytes / (1024.0f * 1024.0f), LeafTriangles::getKernelName( LeafTriangles::getKernel() ) );
+}
+
+void RayTracer::buildWideBvh( void )
+{
+	delete m_wideBvh4;
+	delete m_wideBvh8;
+	m_wideBvh4 = NULL;
+	m_wideBvh8 = NULL;
+
+	TraversalMode m = traversalMode;
+	if ( m == TraversalMode_Wide8 && !isAvxSupported() )
+	{
+		::printf( "AVX is not supported, using 4-wide traversal\n" );
+		m = TraversalMode_Wide4;
+	}
+	if ( m == TraversalMode_Binary )
+		return;
+
+	Timer stopwatch;
+	stopwatch.start();
+
+	int width, numNodes, depth;
+	size_t bytes;
+	if ( m == TraversalMode_Wide8 )
+	{
+		m_wideBvh8 = new WideBvh<8>( *m_bvh );
+		width = 8;
+		numNodes = m_wideBvh8->getNumOfNodes();
+		depth = m_wideBvh8->getDepth();
+		bytes = numNodes * sizeof(WideNode<8>);
+	}
+	else
+	{
+		m_wideBvh4 = new WideBvh<4>( *m_bvh );
+		width = 4;
+		numNodes = m_wideBvh4->getNumOfNodes();
+		depth = m_wideBvh4->getDepth();
+		bytes = numNodes * sizeof(WideNode<4>);
+	}
+	stopwatch.end();
+
+	// Deeper trees than the fixed traversal stack holds keep the binary traversal
+	if ( depth * (width - 1) + 1 > WIDE_STACK_SIZE )
+	{
+		::printf( "Wide BVH is too deep (%d levels), using binary traversal\n", depth );
+		delete m_wideBvh4;
+		delete m_wideBvh8;
+		m_wideBvh4 = NULL;
+		m_wideBvh8 = NULL;
+		return;
+	}
+
+	::printf( "Collapsed to %s BVH: %d nodes, depth %d, %.1f MB, %.3f sec\n\n",
+		getTraversalModeName( m ), numNodes, depth, bytes / (1024.0f * 1024.0f), stopwatch.getTotal() );
+}
+
+bool RayTracer::occluded( const Ray& ray ) const
+{
+	if ( m_wideBvh8 )
+		return occludedWide<8, false>( m_wideBvh8->getNodes(), *m_leafTriangles, ray, NULL );
+	if ( m_wideBvh4 )
+		return occludedWide<4, false>( m_wideBvh4->getNodes(), *m_leafTriangles, ray, NULL );
+	if ( m_bvh->getDepth() < BINARY_STACK_SIZE )
+		return occludedBinary<false>( m_nodes, *m_leafTriangles, ray, NULL );
+	return rayIntersectNodeShadow( ray, 0 );
+}
+
+bool RayTracer::occluded( const Vec3f& orig, const Vec3f& dir, float tmin, float tmax ) const
+{
+	return occluded( Ray::segment( orig, dir, tmin, tmax ) );
+}
+
+void RayTracer::rayCastBatch( const RayBatch& rays, RayHit* hits, MulticoreLauncher* launcher ) const
+{
+	std::vector<S32> order;
+	sortBatch( rays, order );
+
+	BatchJob job = { this, &rays, order.empty() ? NULL : &order[0], rays.size(), hits, NULL };
+	runBatch( rayCastBatchTask, job, launcher );
+}
+
+void RayTracer::occludedBatch( const RayBatch& rays, U8* occluded, MulticoreLauncher* launcher ) const
+{
+	std::vector<S32> order;
+	sortBatch( rays, order );
+
+	BatchJob job = { this, &rays, order.empty() ? NULL : &order[0], rays.size(), NULL, occluded };
+	runBatch( occludedBatchTask, job, launcher );
+}
+
+Hit RayTracer::getHit( const Ray& ray, const RayHit& hit ) const
+{
+	return toHit( *m_triangles, ray, hit );
+}
+
+void RayTracer::rayCastPacket( const Vec3f* origs, const Vec3f* dirs, int numRays, Hit* hits ) const
+{
+	FW_ASSERT( numRays <= PacketSize );
+	if ( m_bvh->getDepth() < BINARY_STACK_SIZE && tracePacket<false>( m_nodes, *m_leafTriangles, *m_triangles, origs, dirs, numRays, hits, NULL ) )
+		return;
+
+	// The rays diverge, cast them one by one
+	for ( int i = 0; i < numRays; ++i )
+		hits[i] = rayCast( origs[i], dirs[i] );
 }
 
 bool RayTracer::rayCastShadow( const Vec3f& orig, const Vec3f& dir ) const
 {
-	return rayIntersectNodeShadow(orig, dir, (dir-orig).length(), m_bvh->getRoot());
+	return occluded( orig, dir, 0.0f, 1.0f );
 }
 
-bool RayTracer::rayIntersectNodeShadow(const Vec3f& orig, const Vec3f& dir, const float maxval, const Node* node) const
+bool RayTracer::rayIntersectNodeShadow(const Ray& ray, int nodeIdx) const
 {
-	// Test whether the ray intersects the node's bounding box at all
-	if (!intersect_bbox(&orig.x, &dir.x, &(node->bbMin).x, &(node->bbMax).x, maxval)) {
+	const FlatNode& node = m_nodes[nodeIdx];
+
+	// Test whether the segment intersects the node's bounding box at all
+	float tnear;
+	if (!intersectBox(node, ray, ray.tmin, ray.tmax, tnear)) {
 		return false;
 	}
 
 	// If the node is a leaf node
-	if (!node->leftChild && !node->rightChild) {
-		return rayIntersectTriangles(orig, dir, node->startPrim, node->endPrim).triangle ? true : false;
+	if (node.isLeaf()) {
+		return m_leafTriangles->occluded(node.startPrim, node.numPrims, ray);
 	}
 
-	if (rayIntersectNodeShadow(orig, dir, maxval, node->leftChild))
+	// The left child is stored right after its parent
+	if (rayIntersectNodeShadow(ray, nodeIdx+1))
 		return true;
-	if (rayIntersectNodeShadow(orig, dir, maxval, node->rightChild))
+	if (rayIntersectNodeShadow(ray, node.rightChild))
 		return true;
 
 	return false;
 }
 
-bool RayTracer::rayCastAny( const Vec3f& orig, const Vec3f& dir )
+bool RayTracer::rayCastAny( const Vec3f& orig, const Vec3f& dir ) const
 {
-	return rayCast( orig, dir ).triangle != 0;
+	return occluded( orig, dir, 0.0f, 1.0f );
 }
 
 /** YOUR CODE HERE
 	This is where you hierarchically traverse the tree you built!
 	You can use the existing code for the leaf nodes.
 **/
-Hit RayTracer::rayIntersectNode(const Vec3f& orig, const Vec3f& dir, const float maxval, const Node* node) const
+Hit RayTracer::rayIntersectNode(const Ray& ray, int nodeIdx, TraversalStats* stats, int depth) const
 {
+	const FlatNode& node = m_nodes[nodeIdx];
+
 	// Test whether the ray intersects the node's bounding box at all
-	if (!intersect_bbox(&orig.x, &dir.x, &(node->bbMin).x, &(node->bbMax).x, maxval)) {
+	float tnear;
+	if (stats)
+		++stats->boxes;
+	if (!intersectBox(node, ray, ray.tmin, ray.tmax, tnear)) {
 		return Hit(NULL);
 	}
+	if (stats) {
+		++stats->nodes;
+		stats->stackDepth = FW::max(stats->stackDepth, (S32)depth + 1);
+	}
 
-	// If the node is a leaf node
-	if (!node->leftChild && !node->rightChild) {
-		return rayIntersectTriangles(orig, dir, node->startPrim, node->endPrim);
+	// If the node is a leaf node. The reference keeps the scalar leaf test
+	if (node.isLeaf()) {
+		if (stats)
+			stats->triangles += node.numPrims;
+		float tmin = ray.tmax, u = 0.0f, v = 0.0f;
+		int i = m_leafTriangles->intersectScalar(node.startPrim, node.numPrims, ray, tmin, u, v);
+		return i != -1 ? Hit(&(*m_triangles)[i], ray.at(tmin), tmin, u, v) : Hit(NULL);
 	}
 
-	Hit left = rayIntersectNode(orig, dir, maxval, node->leftChild);
-	Hit right = rayIntersectNode(orig, dir, maxval, node->rightChild);
+	// The left child is stored right after its parent
+	Hit left = rayIntersectNode(ray, nodeIdx+1, stats, depth + 1);
+	Hit right = rayIntersectNode(ray, node.rightChild, stats, depth + 1);
 
 	if (!left.triangle && !right.triangle)
 		return Hit(NULL);
@@ -159,11 +1279,136 @@ Hit RayTracer::rayIntersectTriangles(const Vec3f& orig, const Vec3f& dir, int st
 		return Hit(NULL);
 }
 
+void RayTracer::rayCast( const Ray& ray, RayHit& hit ) const
+{
+	if ( m_wideBvh8 )
+		hit = traverseWide<8, false>( m_wideBvh8->getNodes(), *m_leafTriangles, ray, NULL );
+	else if ( m_wideBvh4 )
+		hit = traverseWide<4, false>( m_wideBvh4->getNodes(), *m_leafTriangles, ray, NULL );
+	else if ( m_bvh->getDepth() < BINARY_STACK_SIZE )
+		hit = traverseBinary<false>( m_nodes, *m_leafTriangles, ray, NULL );
+	else
+	{
+		Hit h = rayIntersectNode( ray, 0 );
+		hit = makeRayHit( h.triangle ? (int)(h.triangle - &(*m_triangles)[0]) : -1, h.tmin, h.umin, h.vmin );
+	}
+}
+
+Hit RayTracer::rayCast( const Ray& ray ) const
+{
+	if ( !m_wideBvh8 && !m_wideBvh4 && m_bvh->getDepth() >= BINARY_STACK_SIZE )
+		return rayIntersectNode( ray, 0 );
+
+	RayHit hit;
+	rayCast( ray, hit );
+	return toHit( *m_triangles, ray, hit );
+}
+
 Hit RayTracer::rayCast( const Vec3f& orig, const Vec3f& dir ) const
 {
-	return rayIntersectNode(orig, dir, (dir-orig).length(), m_bvh->getRoot());
+	return rayCast( Ray::segment( orig, dir ) );
 }
 
+Hit RayTracer::rayCastStats( const Ray& ray, TraversalStats& stats ) const
+{
+	if ( m_wideBvh8 )
+		return toHit( *m_triangles, ray, traverseWide<8, true>( m_wideBvh8->getNodes(), *m_leafTriangles, ray, &stats ) );
+	if ( m_wideBvh4 )
+		return toHit( *m_triangles, ray, traverseWide<4, true>( m_wideBvh4->getNodes(), *m_leafTriangles, ray, &stats ) );
+	if ( m_bvh->getDepth() < BINARY_STACK_SIZE )
+		return toHit( *m_triangles, ray, traverseBinary<true>( m_nodes, *m_leafTriangles, ray, &stats ) );
+	return rayIntersectNode( ray, 0, &stats );
+}
+
+bool RayTracer::occludedStats( const Ray& ray, TraversalStats& stats ) const
+{
+	if ( m_wideBvh8 )
+		return occludedWide<8, true>( m_wideBvh8->getNodes(), *m_leafTriangles, ray, &stats );
+	if ( m_wideBvh4 )
+		return occludedWide<4, true>( m_wideBvh4->getNodes(), *m_leafTriangles, ray, &stats );
+	if ( m_bvh->getDepth() < BINARY_STACK_SIZE )
+		return occludedBinary<true>( m_nodes, *m_leafTriangles, ray, &stats );
+
+	// The recursive any hit test does not count, the closest hit answers the same
+	return rayIntersectNode( ray, 0, &stats ).triangle != NULL;
+}
+
+void RayTracer::benchmarkTraversal( const std::vector<Vec3f>& origins, const std::vector<Vec3f>& dirs ) const
+{
+	int numRays = (int)origins.size();
+	std::vector<Hit> reference;
+	reference.reserve( numRays );
+
+	::printf( "Traversal benchmark, %d rays, %d binary nodes:\n", numRays, m_bvh->getNumOfNodes() );
+
+	// Packets are consecutive runs of PacketSize rays. A node visit of the packet
+	// kernel counts once for the whole packet and it counts no box or triangle
+	// tests of its own, so it reports nodes per packet over the packets it traced
+	for ( int kernel = 0; kernel < 4; ++kernel )
+	{
+		if ( ( kernel == 1 || kernel == 3 ) && m_bvh->getDepth() >= BINARY_STACK_SIZE )
+			continue;
+		if ( kernel == 2 && !m_wideBvh4 && !m_wideBvh8 )
+			continue;
+
+		S64 nodeVisits = 0, boxTests = 0, triangleTests = 0;
+		int mismatches = 0, divergent = 0, packets = 0;
+		Timer stopwatch;
+		stopwatch.start();
+		for ( int i = 0; i < numRays; )
+		{
+			Hit h[PacketSize];
+			int n = 1;
+			TraversalStats stats;
+			const Ray ray = Ray::segment( origins[i], dirs[i] );
+			if ( kernel == 0 )
+				h[0] = rayIntersectNode( ray, 0, &stats );
+			else if ( kernel == 1 )
+				h[0] = toHit( *m_triangles, ray, traverseBinary<true>( m_nodes, *m_leafTriangles, ray, &stats ) );
+			else if ( kernel == 2 && m_wideBvh8 )
+				h[0] = toHit( *m_triangles, ray, traverseWide<8, true>( m_wideBvh8->getNodes(), *m_leafTriangles, ray, &stats ) );
+			else if ( kernel == 2 )
+				h[0] = toHit( *m_triangles, ray, traverseWide<4, true>( m_wideBvh4->getNodes(), *m_leafTriangles, ray, &stats ) );
+			else
+			{
+				n = FW::min( (int)PacketSize, numRays - i );
+				if ( tracePacket<true>( m_nodes, *m_leafTriangles, *m_triangles, &origins[i], &dirs[i], n, h, &stats ) )
+					++packets;
+				else
+				{
+					// Timed, but the single rays stay out of the per packet counts
+					++divergent;
+					stats = TraversalStats();
+					for ( int j = 0; j < n; ++j )
+						h[j] = rayCast( Ray::segment( origins[i+j], dirs[i+j] ) );
+				}
+			}
+			nodeVisits += stats.nodes;
+			boxTests += stats.boxes;
+			triangleTests += stats.triangles;
+
+			// All kernels must find the same closest hits as the recursive one
+			for ( int j = 0; j < n; ++j, ++i )
+			{
+				if ( kernel == 0 )
+					reference.push_back( h[j] );
+				else if ( h[j].triangle != reference[i].triangle || ( h[j].triangle && h[j].tmin != reference[i].tmin ) )
+					++mismatches;
+			}
+		}
+		stopwatch.end();
+
+		const char* name = kernel == 0 ? "Recursive binary" : kernel == 1 ? "Ordered binary" : kernel == 3 ? "Binary packets" : m_wideBvh8 ? "Ordered 8-wide" : "Ordered 4-wide";
+		float mraysPerSec = numRays / FW::max(stopwatch.getTotal(), 1e-6f) * 1e-6f;
+		if ( kernel == 3 )
+			::printf( "%-17s %8.2f nodes/packet, %6.2f Mrays/s, %d mismatches, %d of %d packets cast as single rays\n", name,
+				(double)nodeVisits / FW::max(packets, 1), mraysPerSec, mismatches, divergent, packets + divergent );
+		else
+			::printf( "%-17s %8.2f nodes/ray, %8.2f boxes/ray, %8.2f tris/ray, %6.2f Mrays/s, %d mismatches\n", name,
+				(double)nodeVisits / FW::max(numRays, 1), (double)boxTests / FW::max(numRays, 1), (double)triangleTests / FW::max(numRays, 1), mraysPerSec, mismatches );
+	}
+	::printf( "\n" );
+}
 
 } // namespace FW
 
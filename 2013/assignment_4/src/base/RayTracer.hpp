@@ -1,6 +1,7 @@
 #pragma once
 
 #include "base/String.hpp"
+#include "Ray.hpp"
 #include <vector>
 
 //------------------------------------------------------------------------
@@ -15,8 +16,13 @@ namespace FW
 {
 
 class Bvh;
+template <int N> class WideBvh;
+class LeafTriangles;
+class Thread;
+class MulticoreLauncher;
+struct BvhRebuild;
 class RTTriangle;
-class Node;
+struct FlatNode;
 class Hit;
 
 // this struct helps to map the linear indices of the ray tracer triangles
@@ -32,24 +38,97 @@ struct RTToMesh
 class RayTracer
 {
 public:
+	enum TraversalMode
+	{
+		TraversalMode_Binary = 0,	// Iterative, one box test per node
+		TraversalMode_Wide4,		// 4-ary tree, SSE slab test over all children
+		TraversalMode_Wide8,		// 8-ary tree, AVX slab test; Wide4 without AVX
+	};
+
+	enum
+	{
+		PacketSize			= 16,		// Rays per rayCastPacket call, a 4x4 pixel block
+	};
+
 						RayTracer				(void);
 						~RayTracer				(void);
 
 	void				constructHierarchy		( std::vector<RTTriangle>& triangles );
 
-	// not required, but HIGHLY recommended!
+	// Hierarchy cache. loadHierarchy maps the file, puts the triangles in tree
+	// order and returns false, leaving everything untouched, if the file is
+	// missing or was written for a different mesh, version or BVH setting.
 	void				saveHierarchy			(const char* filename, const std::vector<RTTriangle>& triangles);
-	void				loadHierarchy			(const char* filename, const std::vector<RTTriangle>& triangles);
-
-	// intersection functions
-	Hit					rayIntersectNode		(const Vec3f& orig, const Vec3f& dir, const float maxval, const Node* node) const;
+	bool				loadHierarchy			(const char* filename, std::vector<RTTriangle>& triangles);
+
+	// Refits the hierarchy after the vertices of the triangles moved. Once the
+	// SAH cost has grown past the rebuild threshold, a new tree is built on a
+	// background thread and picked up by finishRebuild.
+	void				refitHierarchy			(void);
+
+	// Swaps in a finished background rebuild and returns true, false if none
+	// is ready. With wait, a running rebuild is waited for first. No rays may
+	// be traced during the call.
+	bool				finishRebuild			(bool wait = false);
+
+	// Relative SAH cost growth that triggers a background rebuild, 0 = never
+	static void			setRebuildThreshold		(float t)	{ RayTracer::rebuildThreshold = t; }
+	static float		getRebuildThreshold		(void)		{ return RayTracer::rebuildThreshold; }
+
+	// intersection functions. rayIntersectNode is the recursive traversal that
+	// descends into both children of every node hit and tests the leaves with
+	// the scalar kernel, rayCast uses ordered iterative traversals that skip
+	// nodes beyond the closest hit so far. Both return the closest hit with t
+	// in (ray.tmin, ray.tmax). stats, if given, counts the recursion with
+	// depth as the recursion depth of nodeIdx.
+	Hit					rayIntersectNode		(const Ray& ray, int nodeIdx, TraversalStats* stats = NULL, int depth = 0) const;
 	Hit					rayIntersectTriangles	(const Vec3f& orig, const Vec3f& dir, int startPrim, int endPrim) const;
 
-	Hit					rayCast					(const Vec3f& orig, const Vec3f& dir) const;
-	bool			    rayCastAny				(const Vec3f& orig, const Vec3f& dir);
-
+	Hit					rayCast					(const Ray& ray) const;
+	void				rayCast					(const Ray& ray, RayHit& hit) const;			// Same hit without building a Hit
+	Hit					rayCast					(const Vec3f& orig, const Vec3f& dir) const;	// Ray::segment(orig, dir)
+	bool			    rayCastAny				(const Vec3f& orig, const Vec3f& dir) const;
+
+	// Closest hits of up to PacketSize coherent rays, such as the camera rays
+	// of a pixel block, traced together through the binary tree with SSE box
+	// and triangle tests. The hits are those of rayCast, up to ties between
+	// triangles at the same distance; rays whose directions differ in sign
+	// are cast one by one. The traversal mode does not apply: the packets
+	// always walk the binary tree, also when a wide tree is built.
+	void				rayCastPacket			(const Vec3f* origs, const Vec3f* dirs, int numRays, Hit* hits) const;
+
+	// Occlusion query for shadow and AO rays: true if anything is hit with t
+	// in (ray.tmin, ray.tmax). Stops at the first hit found and computes no
+	// barycentrics, so it is cheaper than rayCast.
+	bool				occluded				(const Ray& ray) const;
+	bool				occluded				(const Vec3f& orig, const Vec3f& dir, float tmin, float tmax) const;	// Ray::segment(orig, dir, tmin, tmax)
+
+	// Batch queries, hits[i] and occluded[i] are the results of ray i. The
+	// rays are traced in order of direction octant and then along a Morton
+	// curve over their origins, so the rays traced together start close by
+	// and head the same way. With a launcher the chunks of the order run as
+	// its tasks, otherwise on the calling thread; the call returns when all
+	// the tasks of the launcher are done.
+	void				rayCastBatch			(const RayBatch& rays, RayHit* hits, MulticoreLauncher* launcher = NULL) const;
+	void				occludedBatch			(const RayBatch& rays, U8* occluded, MulticoreLauncher* launcher = NULL) const;
+	Hit					getHit					(const Ray& ray, const RayHit& hit) const;		// The Hit of hits[i], ray is rays.get(i)
+
+	// rayCast and occluded through the instantiations of the kernels that
+	// count their work, adding it to stats. The kernels behind rayCast and
+	// occluded have the counting compiled out.
+	Hit					rayCastStats			(const Ray& ray, TraversalStats& stats) const;
+	bool				occludedStats			(const Ray& ray, TraversalStats& stats) const;
+
+	// Segment [orig, orig+dir], same as occluded(orig, dir, 0, 1)
 	bool				rayCastShadow			( const Vec3f& orig, const Vec3f& dir ) const;
-	bool				rayIntersectNodeShadow	(const Vec3f& orig, const Vec3f& dir, const float maxval, const Node* node) const;
+	bool				rayIntersectNodeShadow	(const Ray& ray, int nodeIdx) const;
+
+	// Traces the rays single threaded with the recursive, the ordered binary,
+	// the wide traversal of the current mode and the packet traversal, and
+	// prints the nodes visited, boxes and triangles tested per ray, the speed
+	// and whether the closest hits agree. The packet traversal reports its
+	// node visits per packet instead, they are not comparable per ray.
+	void				benchmarkTraversal		(const std::vector<Vec3f>& origins, const std::vector<Vec3f>& dirs) const;
 
 	// valid after a hit has been detected.
 	Vec3f				getIntersectionPoint	(void) const;
@@ -62,6 +141,11 @@ public:
 	// WITH the assumption all vertices are allocated in one big chunk.
 	static FW::String	computeMD5				(const std::vector<Vec3f>& vertices);
 
+	// Applies to hierarchies constructed or loaded afterwards
+	static void			setTraversalMode		(TraversalMode m)	{ RayTracer::traversalMode = m; }
+	static TraversalMode getTraversalMode		(void)				{ return RayTracer::traversalMode; }
+	static const char*	getTraversalModeName	(TraversalMode m);
+
 	RT::BHTempNode*				m_hierarchy;
 	std::vector<RTTriangle>*	m_triangles;
 	unsigned int*				m_list;
@@ -74,6 +158,37 @@ public:
 	// The root node of the BVH
 	Bvh*					m_bvh;
 
+	// The compiled node array of m_bvh, the root is node 0
+	const FlatNode*			m_nodes;
+
+	// Mapped hierarchy file the nodes point into, NULL for built trees
+	void*					m_hierarchyFile;
+	void*					m_hierarchyMapping;
+	const void*				m_hierarchyView;
+
+	void					unmapHierarchy			(void);
+
+	// Collapsed copy of m_nodes for the wide traversal modes, NULL otherwise
+	WideBvh<4>*				m_wideBvh4;
+	WideBvh<8>*				m_wideBvh8;
+
+	void					buildWideBvh			(void);
+
+	// Precomputed copy of the leaf triangles, used by all traversal modes
+	LeafTriangles*			m_leafTriangles;
+
+	void					buildLeafTriangles		(void);
+
+	// Background rebuild started by refitHierarchy, NULL when none is running
+	Thread*					m_rebuildThread;
+	BvhRebuild*				m_rebuild;
+
+	void					cancelRebuild			(void);
+
+private:
+	static TraversalMode	traversalMode;
+	static float			rebuildThreshold;
+
 };
 
 } // namespace FW
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <fstream>
 
 #include "io/ImageLodePngIO.hpp"
+#include "io/ImagePfmIO.hpp"
 #include "io/File.hpp"
 
 #include "Renderer.hpp"
@@ -10,15 +11,229 @@
 #include "RTTriangle.hpp"
 #include "Sampler.hpp"
 #include "Hit.hpp"
+#include "Bvh.hpp"
+#include "base/Thread.hpp"
 
 namespace FW
 {
 
 static std::vector<std::vector<int>> randomseeds;
 
+// Camera rays are traced in packets of RayTracer::PacketSize rays covering
+// blocks of this many scanlines
+#define PACKET_ROWS 4
+
+// The scanline path tracer hands its tasks square tiles of tileSize pixels,
+// in the order of a Hilbert curve over the grid of tiles. The tiles rendered
+// at the same time are then next to each other, and their rays share the BVH
+// nodes, leaves and texels they touch. The wavefront passes take their pixels
+// in the same order.
+#define TILE_SIZE_DEFAULT 16
+
+int Renderer::tileSize = TILE_SIZE_DEFAULT;
+
+// Adaptive sampling. After the warm-up passes a tile is traced again only
+// while the relative error of some pixel in it is above the target, see
+// AccumulationBuffer::relativeError.
+#define ADAPTIVE_WARMUP_DEFAULT 8
+#define ADAPTIVE_TARGET_DEFAULT 0.02f
+
+bool Renderer::adaptive = false;
+int Renderer::adaptiveWarmup = ADAPTIVE_WARMUP_DEFAULT;
+float Renderer::adaptiveTarget = ADAPTIVE_TARGET_DEFAULT;
+
+// A pass over the tiles is split into batches sized from the measured paths
+// per second to take about this many seconds each, so the display is updated
+// at that rate however heavy the scene is
+#define TARGET_BATCH_TIME_DEFAULT 0.25f
+
+float Renderer::targetBatchTime = TARGET_BATCH_TIME_DEFAULT;
+
+// The preview passes before the first full pass trace a pixel per block of
+// PREVIEW_STEP x PREVIEW_STEP pixels, then per block of half of that, and so
+// on, and fill each block with its sample. They only go to the display, the
+// accumulated image starts with the first full pass.
+#define PREVIEW_STEP 4
+
+bool Renderer::preview = true;
+
+int Renderer::numThreads = 0;
+int Renderer::passLimit = 0;
+
+// The tiles of a pass in groups of a tile per thread, consecutive along the
+// Hilbert curve so that the tiles traced at the same time stay together. The
+// groups go in bit-reversed order, which spreads any run of them evenly over
+// the image, so each batch refines the whole picture a little.
+static void interleaveTiles( const std::vector<S32>& tiles, int group, std::vector<S32>& order )
+{
+	int numGroups = ((int)tiles.size() + group - 1) / group;
+	int bits = 0;
+	while ( (1 << bits) < numGroups )
+		++bits;
+
+	order.clear();
+	for ( int r = 0; r < (1 << bits); ++r )
+	{
+		int g = 0;
+		for ( int b = 0; b < bits; ++b )
+			g |= ((r >> b) & 1) << (bits - 1 - b);
+		if ( g >= numGroups )
+			continue;
+		for ( int i = g * group; i < FW::min( (g + 1) * group, (int)tiles.size() ); ++i )
+			order.push_back( tiles[i] );
+	}
+}
+
+// Cell d along the Hilbert curve through an n x n grid, n a power of two
+static Vec2i hilbertCell( int n, int d )
+{
+	Vec2i c( 0, 0 );
+	for ( int s = 1; s < n; s *= 2 )
+	{
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if ( ry == 0 )
+		{
+			// Rotate the quadrant
+			if ( rx == 1 )
+				c = Vec2i( s - 1 - c.x, s - 1 - c.y );
+			std::swap( c.x, c.y );
+		}
+		c += Vec2i( s * rx, s * ry );
+		d /= 4;
+	}
+	return c;
+}
+
+// Upper left corners of the tiles covering an image, in Hilbert order. Tiles
+// on the right and bottom edges are clipped to the image.
+static void hilbertTiles( const Vec2i& size, int tile, std::vector<Vec2i>& tiles )
+{
+	int numX = (size.x + tile - 1) / tile;
+	int numY = (size.y + tile - 1) / tile;
+	int n = 1;
+	while ( n < numX || n < numY )
+		n *= 2;
+
+	tiles.clear();
+	for ( int d = 0; d < n * n; ++d )
+	{
+		Vec2i c = hilbertCell( n, d );
+		if ( c.x < numX && c.y < numY )
+			tiles.push_back( c * tile );
+	}
+}
+
+//------------------------------------------------------------------------
+// Wavefront path tracing. A pass keeps the state of one path per pixel and
+// moves all of them forward a bounce at a time through separate stages, each
+// a parallel loop over a queue: the camera rays are generated, the extension
+// rays of the live paths are traced, the hits are shaded, which samples the
+// light and the next direction, and the shadow rays of the light samples are
+// traced to connect the light. The camera rays are traced as packets, the
+// extension rays of the bounces go to RayTracer::rayCastBatch and the shadow
+// rays to RayTracer::occludedBatch, which order them by the octant of the ray
+// direction and then along a Morton curve over the ray origins.
+
+// Queue entries per stage task
+#define WAVEFRONT_CHUNK 4096
+
+enum WavefrontStage
+{
+	WavefrontStage_Generate = 0,
+	WavefrontStage_Gather,
+	WavefrontStage_Extend,
+	WavefrontStage_Shade,
+	WavefrontStage_Connect,
+	WavefrontStage_Accumulate,
+	WavefrontStage_Max
+};
+
+static const char* s_wavefrontStageNames[WavefrontStage_Max] = { "generate", "gather", "extend", "shade", "connect", "accumulate" };
+
+struct PathState
+{
+	Vec3f					origin;			// Of the next extension ray
+	Vec3f					dir;			// Camera ray: to the far plane, bounces: unit length
+	Vec3f					throughput;		// Product of the albedos so far
+	Vec3f					radiance;		// Gathered so far, without the 1/pi of the BRDF
+	float					weight;			// Russian roulette weight of the next hit
+	S32						bounce;			// Hits so far
+	Hit						hit;			// Of the last extend stage
+};
+
+struct ShadowRay
+{
+	Vec3f					origin;
+	Vec3f					dir;
+	Vec3f					radiance;		// Added to the path if nothing blocks the ray
+	S32						path;			// -1 if the light faced away
+};
+
+struct Wavefront
+{
+	Wavefront( int numPixels );
+	~Wavefront();
+
+	std::vector<PathState>	paths;			// One per pixel
+	std::vector<S32>		pixels;			// In the 4x4 blocks of the camera packets
+	std::vector<S32>		queue;			// Paths to extend
+	RayBatch				extensionBatch;	// The rays of queue after the first bounce
+	std::vector<RayHit>		rayHits;		// Result for each ray of extensionBatch
+	std::vector<ShadowRay>	shadowRays;		// Written by shade at the queue position of the path
+	std::vector<U8>			alive;			// Written by shade, the path goes on
+	std::vector<S32>		shadowQueue;	// Shadow rays to trace
+	RayBatch				shadowBatch;	// The rays of shadowQueue
+	std::vector<U8>			occluded;		// Result for each ray of shadowBatch
+	std::vector<Sequence*>	sequences;		// One per chunk, only the task of the chunk uses it
+
+	Mat4f					invP;			// Clip space to world space
+	WavefrontStage			stage;
+	int						count;			// Queue entries of the running stage
+	int						bounce;
+
+	float					stageTime[WavefrontStage_Max];
+	S64						numExtensionRays;
+	S64						numShadowRays;
+};
+
+Wavefront::Wavefront( int numPixels )
+{
+	paths.resize( numPixels );
+	for ( int i = 0; i < (numPixels + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK; ++i )
+		sequences.push_back( Sampler::getSequenceInstance() );
+}
+
+Wavefront::~Wavefront()
+{
+	for ( int i = 0; i < sequences.size(); ++i )
+		delete sequences[i];
+}
+
+// Runs a stage over count queue entries in tasks of WAVEFRONT_CHUNK entries
+static void runWavefrontStage( MulticoreLauncher& launcher, void* ctx, Wavefront& wf, WavefrontStage stage, int count )
+{
+	Timer timer( true );
+	wf.stage = stage;
+	wf.count = count;
+	if ( count > 0 )
+	{
+		launcher.push( Renderer::wavefrontStage, ctx, 0, (count + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK );
+		launcher.popAll();
+	}
+	wf.stageTime[stage] += timer.getElapsed();
+}
+
+//------------------------------------------------------------------------
+
 Renderer::Renderer()
 {
 	m_raysPerSecond = 0.0f;
+	m_pathsPerSecond = 0.0f;
+	m_passTime = 0.0f;
+	m_numBatches = 0;
+	m_wavefrontThread = NULL;
+	m_wavefrontPending = false;
 }
 
 Renderer::~Renderer()
@@ -29,9 +244,17 @@ Renderer::~Renderer()
 		while( m_launcher.getNumTasks() > m_launcher.getNumFinished() )
 			Sleep( 1 );
 		m_launcher.popAll();
+		if ( m_wavefrontPending )
+			m_wavefrontThread->join();
 	}
-	delete m_context.m_image;
-	delete m_context.m_coarseImage;
+	delete m_wavefrontThread;
+}
+
+Renderer::PathTracerContext::~PathTracerContext()
+{
+	for (int i = 0; i < m_sequences.size(); ++i)
+		delete m_sequences[i];
+	delete m_wavefront;
 }
 
 // 
@@ -47,49 +270,55 @@ Vec4f Renderer::interpolateAttribute( const RTTriangle* tri, float a, float b, c
 }
 
 
-// YOUR CODE HERE
-// copy the code over from the radiosity assignment.
-// you should return the diffuse albedo from the point hit by the ray.
-// if textured, use the texture; if not, use Material.diffuse.
-Vec3f Renderer::albedo( const MeshWithColors* mesh, const Vec3i& indices, const RTToMesh* map, const Vec3f& barys )
+// Shades the hit of a path of pixel (i, j): the albedo goes into the
+// throughput, the light sample into sr, with sr.path = path if the light faces
+// the hit, and the next extension ray into s. Returns true if the path goes on.
+bool Renderer::shadePath( const PathTracerContext& ctx, PathState& s, int path, int i, int j, Sequence* seq, ShadowRay& sr )
 {
-	Vec3f Kd;
+	sr.path = -1;
+	if ( s.hit.triangle == 0 )
+		return false;
 
-	// Check for texture
-	const MeshBase::Material& mat = mesh->material(map->submesh);
+	const SurfaceInteraction si( s.hit, ctx.m_scene );
+	int height = ctx.m_accum.getSize().y;
 
-	if ( mat.textures[MeshBase::TextureType_Diffuse].exists() )
-	{
-		// Yes, texture; fetch diffuse albedo from there.
-		// First interpolate UV coordinates from the vertices using barycentrics
-		// Then turn those into pixel coordinates within the texture
-		// Finally fetch the color using Image::getVec4f() (point sampling is fine).
-		// Use the result as the diffuse reflectance instead of mat.diffuse.
+	// Get the surface color and the normal
+	Vec3f scol = si.albedo;
+	Vec3f normal = si.normal;
+	if (FW::dot(s.dir, normal) > 0.0f)
+		normal = -normal;
 
-		const Texture& tex = mat.textures[MeshBase::TextureType_Diffuse];
-		const Image& teximg = *tex.getImage();
+	s.throughput *= scol;
 
-		Vec2f texCoord = barys[0] * mesh->vertex(indices[0]).t + 
-						 barys[1] * mesh->vertex(indices[1]).t + 
-						 barys[2] * mesh->vertex(indices[2]).t;
+	// Sample the light, it is added to the path if the shadow ray gets through
+	Vec3f E;
+	if ( Renderer::sampleDirectContribution(ctx.m_light, randomseeds[(j+1)%height][i] + ctx.m_pass, s.hit.intersection, normal, seq, sr.dir, E) )
+	{
+		sr.origin = s.hit.intersection + EPSILON*normal;
+		sr.radiance = s.weight * s.throughput * E;
+		sr.path = path;
+	}
 
-		Vec2i texCoordi = Vec2i( (int)((texCoord.x - floor(texCoord.x))*teximg.getSize().x), 
-								 (int)((texCoord.y - floor(texCoord.y))*teximg.getSize().y) );
+	// Update the origin and direction for another round
+	s.origin = s.hit.intersection + EPSILON*normal;
+	s.dir = formBasis(normal) * Sampler::cosineSampleHemisphere(seq, randomseeds[(j+2)%height][i] + ctx.m_pass);
 
-		Kd = teximg.getVec4f(texCoordi).getXYZ();
-	}
-	else
+	// Bounces + 1 hits for sure, then russian roulette doubles the weight of each further hit
+	int iterations = abs(ctx.m_bounces) + 1;
+	++s.bounce;
+	if ( s.bounce < iterations )
+		return true;
+	if ( ctx.m_rr && (seq->getRandomU32() & 0x01) )
 	{
-		Kd = mat.diffuse.getXYZ();
+		s.weight = s.bounce == iterations ? 2.0f : s.weight * 2.0f;
+		return true;
 	}
-
-	return Kd;
+	return false;
 }
 
-
-// This function is responsible for asynchronously rendering one path per pixel for a given scanline.
-// The path tracer logic you write goes in here. And it's pretty much all you _must_ do this time!
-void Renderer::pathTraceScanline( MulticoreLauncher::Task& t )
+// This function is responsible for asynchronously rendering one path per pixel for a tile
+// of the image. The path tracer logic you write goes in here. And it's pretty much all you _must_ do this time!
+void Renderer::pathTraceTile( MulticoreLauncher::Task& t )
 {
 	static Mat3f oldCameraOrientation;
 	static Vec3f oldCameraPosition;
@@ -97,190 +326,558 @@ void Renderer::pathTraceScanline( MulticoreLauncher::Task& t )
 
 	PathTracerContext& ctx = *(PathTracerContext*)t.data;
 
-	const MeshWithColors* scene			= ctx.m_scene;
 	RayTracer* rt						= ctx.m_rt;
-	Image* image						= ctx.m_image;
+	AccumulationBuffer& accum			= ctx.m_accum;
 	const CameraControls& cameraCtrl	= *ctx.m_camera;
-	AreaLight* light					= ctx.m_light;
-	bool rr								= ctx.m_rr;
-
-	// Make sure we're on CPU
-	image->getMutablePtr();
 
 	// Get camera orientation and projection (and compute inverse projection if changed)
 	if (cameraCtrl.getOrientation() != oldCameraOrientation || cameraCtrl.getPosition() != oldCameraPosition)  {
 		Mat4f worldToCamera				= cameraCtrl.getWorldToCamera();
-		Mat4f projection				= Mat4f::fitToView(Vec2f(-1.0f,-1.0f), Vec2f(2.0f,2.0f), image->getSize())*cameraCtrl.getCameraToClip();
+		Mat4f projection				= Mat4f::fitToView(Vec2f(-1.0f,-1.0f), Vec2f(2.0f,2.0f), accum.getSize())*cameraCtrl.getCameraToClip();
 	
 		// Inverse projection from clip space to world space
 		invP							= (projection*worldToCamera).inverted();
 	}
 
-	// Scanline index from task
-	int j = t.idx;
-
 	float inv_PI						= ctx.m_invPI;
 	float x_coord_mapping				= ctx.m_xCoordMapping;
 	float y_coord_mapping				= ctx.m_yCoordMapping;
 
-	int width = image->getSize().x;
-	int height = image->getSize().y;
-
-	// We're doing bounces + 1 direct iterations
-	int iterations						= abs(ctx.m_bounces) + 1;
-
-	for ( int i = 0; i < width; ++i )
+	int width = accum.getSize().x;
+	int height = accum.getSize().y;
+
+	// The tasks go through the tiles still being sampled, each tile has its own sequence
+	const int tileIdx					= ctx.m_passOrder[t.idx];
+	Sequence* seq						= ctx.m_sequences[tileIdx];
+
+	// The paths of the tile move forward a bounce at a time like those of a
+	// wavefront pass, so the extension and the shadow rays of a bounce go to
+	// the batch queries together. The camera rays of each block of pixels are
+	// traced as one packet. A preview pass traces a pixel per step x step block instead.
+	const int packetWidth = RayTracer::PacketSize / PACKET_ROWS;
+	const int step = ctx.m_previewStep;
+	const Vec2i tile = ctx.m_tiles[tileIdx];
+	const int tileRight = FW::min( tile.x + ctx.m_tileSize, width );
+	const int tileBottom = FW::min( tile.y + ctx.m_tileSize, height );
+
+	std::vector<PathState> paths;
+	std::vector<Vec2i> pixels;
+	for ( int j0 = tile.y; j0 < tileBottom; j0 += PACKET_ROWS * step )
+	for ( int i0 = tile.x; i0 < tileRight; i0 += packetWidth * step )
 	{
 		if( ctx.m_bForceExit )
 			return;
 
-		// Generate a ray through pixel (with anti-aliasing)
-		Vec2f jitter = Sampler::uniformSample(ctx.m_sequences[j], randomseeds[j][i] + ctx.m_pass, Vec2f(0.0f), Vec2f(1.0f));
-		float x = (i + jitter.x) * x_coord_mapping - 1.0f; // / width *  2.0f - 1.0f;
-		float y = (j + jitter.y) * y_coord_mapping + 1.0f; // / height * -2.0f + 1.0f;
+		const int j1 = FW::min( j0 + PACKET_ROWS * step, tileBottom );
+		const int i1 = FW::min( i0 + packetWidth * step, tileRight );
 
-		// Point on front and black planes in homogeneous coordinates
-		Vec4f P0( x, y, 0.0f, 1.0f );
-		Vec4f P1( x, y, 1.0f, 1.0f );
+		Vec3f Ros[RayTracer::PacketSize];
+		Vec3f Rds[RayTracer::PacketSize];
+		Hit hits[RayTracer::PacketSize];
+		int numRays = 0;
 
-		// Apply inverse projection, divide by w to get object-space points
-		Vec4f Roh = (invP * P0);
-		Vec3f Ro = (Roh/Roh.w).getXYZ();
-		Vec4f Rdh = (invP * P1);
-		Vec3f Rd = (Rdh/Rdh.w).getXYZ();
-
-		// Subtract front plane point from back plane point,
-		// yields ray direction.
-		// NOTE that it's not normalized; the direction Rd is defined
-		// so that the segment to be traced is [Ro, Ro+Rd], i.e.,
-		// intersections that come _after_ the point Ro+Rd are to be discarded.
-		Rd = Rd - Ro;
-
-		Vec3f tcol = Vec3f(0.0f); // Total color
-		Vec3f fcol = Vec3f(1.0f); 
-
-		Vec3f scol;
-		Vec3f dcol;
-		Vec3f normal;
-		//debugfile << "[\n"; // DEBUG
-
-		// Go through the direct and indirect bounces and trace the paths
-		for (int b = 0; b < iterations; ++b) 
+		for ( int j = j0; j < j1; j += step )
+		for ( int i = i0; i < i1; i += step, ++numRays )
 		{
-			// Trace ray through the pixel
-			Hit pHit = rt->rayCast( Ro, Rd );
+			// Generate a ray through pixel (with anti-aliasing), or through the block of a preview pass
+			Vec2f jitter = Sampler::uniformSample(seq, randomseeds[j][i] + ctx.m_pass, Vec2f(0.0f), Vec2f(1.0f));
+			float x = (i + jitter.x * FW::min( step, tileRight - i )) * x_coord_mapping - 1.0f; // / width *  2.0f - 1.0f;
+			float y = (j + jitter.y * FW::min( step, tileBottom - j )) * y_coord_mapping + 1.0f; // / height * -2.0f + 1.0f;
+
+			// Point on front and black planes in homogeneous coordinates
+			Vec4f P0( x, y, 0.0f, 1.0f );
+			Vec4f P1( x, y, 1.0f, 1.0f );
+
+			// Apply inverse projection, divide by w to get object-space points
+			Vec4f Roh = (invP * P0);
+			Vec3f Ro = (Roh/Roh.w).getXYZ();
+			Vec4f Rdh = (invP * P1);
+			Vec3f Rd = (Rdh/Rdh.w).getXYZ();
+
+			// Subtract front plane point from back plane point,
+			// yields ray direction.
+			// NOTE that it's not normalized; the direction Rd is defined
+			// so that the segment to be traced is [Ro, Ro+Rd], i.e.,
+			// intersections that come _after_ the point Ro+Rd are to be discarded.
+			Ros[numRays] = Ro;
+			Rds[numRays] = Rd - Ro;
+			pixels.push_back( Vec2i( i, j ) );
+		}
 
-			// If we hit something, fetch a color and insert into image
-			if ( pHit.triangle != 0 )
-			{
-				// Perform the path tracing operations for this pixel.
-				const RTToMesh* map = (const RTToMesh*)pHit.triangle->m_userPointer;
-				const Vec3i& indices = ctx.m_scene->indices( map->submesh )[ map->tri_idx ];
-				const Vec3f barys = pHit.triangle->getBarycentrics(pHit.intersection);
-
-				// Get the surface color
-				scol = Renderer::albedo(ctx.m_scene, indices, map, barys);
-
-				// Get the normal
-				normal = pHit.triangle->getNormal(pHit.intersection, barys);
-				if (FW::dot(Rd, normal) > 0.0f)
-					normal = -normal;
-
-				// Add the direct contribution
-				dcol = Renderer::getDirectContribution(ctx.m_light, randomseeds[(j+1)%height][i] + ctx.m_pass, pHit.intersection, normal, ctx.m_rt, ctx.m_sequences[j]);
-				
-				// Update the origin and direction for another round
-				Ro = pHit.intersection + EPSILON*normal;
-				//debugfile << "(" << Ro.x << "," << Ro.y << "," << Ro.z << ")\n";
-
-				Rd = formBasis(normal) * Sampler::cosineSampleHemisphere(ctx.m_sequences[j], randomseeds[(j+2)%height][i] + ctx.m_pass) * 100.0f;
-
-				fcol *= scol;
-				tcol += fcol * dcol;
-			}
-			else 
+		rt->rayCastPacket( Ros, Rds, numRays, hits );
+
+		for ( int r = 0; r < numRays; ++r )
+		{
+			PathState s;
+			s.origin = Ros[r];
+			s.dir = Rds[r];
+			s.throughput = Vec3f(1.0f);
+			s.radiance = Vec3f(0.0f);
+			s.weight = 1.0f;
+			s.bounce = 0;
+			s.hit = hits[r];
+			paths.push_back( s );
+		}
+	}
+
+	// The batches run on this thread, the other workers trace their own tiles.
+	// The buffers are reused from bounce to bounce, and at the default tile
+	// size the batches are small enough that the batch queries skip their sort.
+	std::vector<S32> queue( paths.size() );
+	for ( int k = 0; k < (int)queue.size(); ++k )
+		queue[k] = k;
+
+	RayBatch extensionBatch, shadowBatch;
+	std::vector<RayHit> rayHits;
+	std::vector<ShadowRay> shadowRays;
+	std::vector<U8> occluded;
+	for ( int bounce = 0; !queue.empty(); ++bounce )
+	{
+		if( ctx.m_bForceExit )
+			return;
+
+		int count = (int)queue.size();
+		if ( bounce > 0 )
+		{
+			extensionBatch.clear();
+			for ( int k = 0; k < count; ++k )
+				extensionBatch.add( Ray( paths[queue[k]].origin, paths[queue[k]].dir ) );
+			rayHits.resize( count );
+			rt->rayCastBatch( extensionBatch, &rayHits[0] );
+			for ( int k = 0; k < count; ++k )
+				paths[queue[k]].hit = rt->getHit( extensionBatch.get( k ), rayHits[k] );
+		}
+
+		// Shade the hits and gather the shadow rays and the paths that go on
+		shadowBatch.clear();
+		shadowRays.clear();
+		int numAlive = 0;
+		for ( int k = 0; k < count; ++k )
+		{
+			ShadowRay sr;
+			int p = queue[k];
+			if ( shadePath( ctx, paths[p], p, pixels[p].x, pixels[p].y, seq, sr ) )
+				queue[numAlive++] = p;
+			if ( sr.path >= 0 )
 			{
-				break;
+				shadowRays.push_back( sr );
+				shadowBatch.add( sr.origin, sr.dir );
 			}
 		}
+		queue.resize( numAlive );
+
+		// Add the light the shadow rays get through
+		occluded.resize( shadowRays.size() );
+		if ( !shadowRays.empty() )
+			rt->occludedBatch( shadowBatch, &occluded[0] );
+		for ( int k = 0; k < (int)shadowRays.size(); ++k )
+			if ( !occluded[k] )
+				paths[shadowRays[k].path].radiance += shadowRays[k].radiance;
+	}
+
+	for ( int p = 0; p < (int)paths.size(); ++p )
+	{
+		int i = pixels[p].x;
+		int j = pixels[p].y;
+
+		// Remember to divide the BRDF by PI
+		Vec3f tcol = paths[p].radiance * inv_PI;
+
+		// Put pixel, a preview sample fills its block on the display
+		if ( step == 1 )
+			accum.add( i, j, tcol );
+		else
+			for ( int y = j; y < FW::min( j + step, tileBottom ); ++y )
+			for ( int x = i; x < FW::min( i + step, tileRight ); ++x )
+				ctx.m_display[y * ctx.m_displayStride + x] = Vec4f( tcol, 1.0f );
+	}
 
-		// If russian roulette is on enter the russian roulette stage
-		if (rr) 
+	if ( step > 1 )
+		return;
+
+	// Show the tile
+	accum.resolve( tile, Vec2i(tileRight, tileBottom), ctx.m_display, ctx.m_displayStride );
+
+	// The error of the tile decides whether the next pass traces it again
+	if ( ctx.m_adaptive && ctx.m_pass + 1 >= adaptiveWarmup )
+		ctx.m_tileError[tileIdx] = accum.maxRelativeError( tile, Vec2i(tileRight, tileBottom) );
+}
+
+// Traces one pass of the wavefront path tracer, on m_wavefrontThread. The paths
+// follow the same steps as in pathTraceTile, only a bounce of all of them at a time.
+void Renderer::wavefrontPass( void* param )
+{
+	PathTracerContext& ctx = *(PathTracerContext*)param;
+	Wavefront& wf = *ctx.m_wavefront;
+	const CameraControls& cameraCtrl = *ctx.m_camera;
+
+	Mat4f worldToCamera				= cameraCtrl.getWorldToCamera();
+	Mat4f projection				= Mat4f::fitToView(Vec2f(-1.0f,-1.0f), Vec2f(2.0f,2.0f), ctx.m_accum.getSize())*cameraCtrl.getCameraToClip();
+	wf.invP							= (projection*worldToCamera).inverted();
+
+	for ( int i = 0; i < WavefrontStage_Max; ++i )
+		wf.stageTime[i] = 0.0f;
+	wf.numExtensionRays = 0;
+	wf.numShadowRays = 0;
+
+	MulticoreLauncher launcher;
+	Timer timer;
+
+	int numPixels = (int)wf.paths.size();
+	wf.queue.resize( numPixels );
+	runWavefrontStage( launcher, &ctx, wf, WavefrontStage_Generate, numPixels );
+
+	for ( wf.bounce = 0; !wf.queue.empty() && !ctx.m_bForceExit; ++wf.bounce )
+	{
+		// The camera rays stay in their blocks for the packets, the extension
+		// rays are traced as a batch and the stage only picks up their hits
+		int count = (int)wf.queue.size();
+		if ( wf.bounce > 0 )
+		{
+			timer.start();
+			wf.extensionBatch.clear();
+			for ( int k = 0; k < count; ++k )
+				wf.extensionBatch.add( Ray( wf.paths[wf.queue[k]].origin, wf.paths[wf.queue[k]].dir ) );
+			wf.rayHits.resize( count );
+			wf.stageTime[WavefrontStage_Gather] += timer.getElapsed();
+
+			timer.start();
+			ctx.m_rt->rayCastBatch( wf.extensionBatch, &wf.rayHits[0], &launcher );
+			wf.stageTime[WavefrontStage_Extend] += timer.getElapsed();
+		}
+		runWavefrontStage( launcher, &ctx, wf, WavefrontStage_Extend, count );
+		wf.numExtensionRays += count;
+
+		wf.shadowRays.resize( count );
+		wf.alive.resize( count );
+		runWavefrontStage( launcher, &ctx, wf, WavefrontStage_Shade, count );
+
+		// Gather the shadow rays and the paths that go on
+		timer.start();
+		wf.shadowQueue.clear();
+		int numAlive = 0;
+		for ( int k = 0; k < count; ++k )
 		{
-			unsigned int contribution = 2;
-			while ( ctx.m_sequences[j]->getRandomU32() & 0x01 ) 
+			if ( wf.shadowRays[k].path >= 0 )
+				wf.shadowQueue.push_back( k );
+			if ( wf.alive[k] )
+				wf.queue[numAlive++] = wf.queue[k];
+		}
+		wf.queue.resize( numAlive );
+		wf.stageTime[WavefrontStage_Gather] += timer.getElapsed();
+
+		// The batch query sorts the shadow rays itself
+		timer.start();
+		int numShadowRays = (int)wf.shadowQueue.size();
+		wf.shadowBatch.clear();
+		for ( int k = 0; k < numShadowRays; ++k )
+			wf.shadowBatch.add( wf.shadowRays[wf.shadowQueue[k]].origin, wf.shadowRays[wf.shadowQueue[k]].dir );
+		wf.occluded.resize( numShadowRays );
+		if ( numShadowRays > 0 && !ctx.m_bForceExit )
+		{
+			ctx.m_rt->occludedBatch( wf.shadowBatch, &wf.occluded[0], &launcher );
+			for ( int k = 0; k < numShadowRays; ++k )
 			{
-				// Trace ray through the pixel
-				Hit pHit = rt->rayCast( Ro, Rd );
+				const ShadowRay& sr = wf.shadowRays[wf.shadowQueue[k]];
+				if ( !wf.occluded[k] )
+					wf.paths[sr.path].radiance += sr.radiance;
+			}
+		}
+		wf.stageTime[WavefrontStage_Connect] += timer.getElapsed();
+		wf.numShadowRays += numShadowRays;
+	}
 
-				// If we hit something, fetch a color and insert into image
-				if ( pHit.triangle != 0 )
-				{
-					// Perform the path tracing operations for this pixel.
-					const RTToMesh* map = (const RTToMesh*)pHit.triangle->m_userPointer;
-					const Vec3i& indices = ctx.m_scene->indices( map->submesh )[ map->tri_idx ];
-					const Vec3f barys = pHit.triangle->getBarycentrics(pHit.intersection);
+	// A stopped pass is dropped, so the image only ever sums whole passes
+	if ( !ctx.m_bForceExit )
+		runWavefrontStage( launcher, &ctx, wf, WavefrontStage_Accumulate, numPixels );
+}
 
-					scol = Renderer::albedo(ctx.m_scene, indices, map, barys);
+// One chunk of the running wavefront stage
+void Renderer::wavefrontStage( MulticoreLauncher::Task& t )
+{
+	PathTracerContext& ctx = *(PathTracerContext*)t.data;
+	Wavefront& wf = *ctx.m_wavefront;
 
-					// Get the normal
-					normal = pHit.triangle->getNormal(pHit.intersection, barys);
-					if (FW::dot(Rd, normal) > 0.0f)
-						normal = -normal;
+	if ( ctx.m_bForceExit )
+		return;
 
-					// Add the contribution
-					dcol = Renderer::getDirectContribution(ctx.m_light, randomseeds[(j+1)%(int)height][i] + ctx.m_pass, pHit.intersection, normal, ctx.m_rt, ctx.m_sequences[j]);
+	RayTracer* rt						= ctx.m_rt;
+	Sequence* seq						= wf.sequences[t.idx];
+	int width							= ctx.m_accum.getSize().x;
+	int pass							= ctx.m_pass;
 
-					// Update the origin and direction for another round
-					Ro = pHit.intersection + EPSILON*normal;
-					//debugfile << "(" << Ro.x << "," << Ro.y << "," << Ro.z << ")\n";
+	const int begin = t.idx * WAVEFRONT_CHUNK;
+	const int end = FW::min( begin + WAVEFRONT_CHUNK, wf.count );
 
-					Rd = formBasis(normal) * Sampler::cosineSampleHemisphere(ctx.m_sequences[j], randomseeds[(j+2)%(int)height][i] + ctx.m_pass) * 100.0f;
+	switch ( wf.stage )
+	{
+	case WavefrontStage_Generate:
+		for ( int k = begin; k < end; ++k )
+		{
+			int p = wf.pixels[k];
+			int i = p % width;
+			int j = p / width;
+
+			// Generate a ray through pixel (with anti-aliasing)
+			Vec2f jitter = Sampler::uniformSample(seq, randomseeds[j][i] + pass, Vec2f(0.0f), Vec2f(1.0f));
+			float x = (i + jitter.x) * ctx.m_xCoordMapping - 1.0f;
+			float y = (j + jitter.y) * ctx.m_yCoordMapping + 1.0f;
+
+			Vec4f Roh = wf.invP * Vec4f( x, y, 0.0f, 1.0f );
+			Vec4f Rdh = wf.invP * Vec4f( x, y, 1.0f, 1.0f );
+			Vec3f Ro = (Roh/Roh.w).getXYZ();
+
+			PathState& s = wf.paths[p];
+			s.origin = Ro;
+			s.dir = (Rdh/Rdh.w).getXYZ() - Ro;
+			s.throughput = Vec3f(1.0f);
+			s.radiance = Vec3f(0.0f);
+			s.weight = 1.0f;
+			s.bounce = 0;
+			wf.queue[k] = p;
+		}
+		break;
 
-					fcol *= scol;
-					tcol += (float)contribution * fcol * dcol;
-				
-					contribution <<= 1;
-				}
-				else 
+	case WavefrontStage_Extend:
+		if ( wf.bounce == 0 )
+		{
+			// The camera rays of each 4x4 block of pixels are traced as one packet
+			const int packetWidth = RayTracer::PacketSize / PACKET_ROWS;
+			Vec3f Ros[RayTracer::PacketSize];
+			Vec3f Rds[RayTracer::PacketSize];
+			Hit hits[RayTracer::PacketSize];
+
+			for ( int k = begin; k < end; )
+			{
+				int block = wf.queue[k] / width / PACKET_ROWS * width + wf.queue[k] % width / packetWidth;
+				int numRays = 0;
+				for ( ; numRays < RayTracer::PacketSize && k + numRays < end; ++numRays )
 				{
-					break;
+					int p = wf.queue[k + numRays];
+					if ( p / width / PACKET_ROWS * width + p % width / packetWidth != block )
+						break;
+					Ros[numRays] = wf.paths[p].origin;
+					Rds[numRays] = wf.paths[p].dir;
 				}
+
+				rt->rayCastPacket( Ros, Rds, numRays, hits );
+				for ( int r = 0; r < numRays; ++r )
+					wf.paths[wf.queue[k + r]].hit = hits[r];
+				k += numRays;
 			}
 		}
+		else
+		{
+			for ( int k = begin; k < end; ++k )
+				wf.paths[wf.queue[k]].hit = rt->getHit( wf.extensionBatch.get( k ), wf.rayHits[k] );
+		}
+		break;
 
-		//debugfile << "]\n";
-		// Remember to divide the BRDF by PI
-		tcol *= inv_PI;
+	case WavefrontStage_Shade:
+		// The connect stage adds the light if the shadow ray gets through
+		for ( int k = begin; k < end; ++k )
+		{
+			int p = wf.queue[k];
+			wf.alive[k] = shadePath( ctx, wf.paths[p], p, p % width, p / width, seq, wf.shadowRays[k] ) ? 1 : 0;
+		}
+		break;
+
+	case WavefrontStage_Accumulate:
+		for ( int p = begin; p < end; ++p )
+		{
+			// Remember to divide the BRDF by PI
+			ctx.m_accum.add( p % width, p / width, wf.paths[p].radiance * ctx.m_invPI );
+		}
+		ctx.m_accum.resolveSpan( begin, end, ctx.m_display, ctx.m_displayStride );
+		break;
 
-		// Put pixel
-		Vec4f prev = image->getVec4f( Vec2i(i,j) );
-		prev += Vec4f( tcol, 1.0f );
-		image->setVec4f( Vec2i(i,j), prev );
+	default:
+		FW_ASSERT( 0 );
+		break;
 	}
+}
+
+//------------------------------------------------------------------------
+// Traversal heatmaps. One camera ray through the center of each pixel is cast
+// with RayTracer::rayCastStats, a task per scanline, and every counter becomes
+// a false colour image scaled to its maximum over the frame.
 
+enum HeatmapCounter
+{
+	HeatmapCounter_Nodes = 0,
+	HeatmapCounter_Boxes,
+	HeatmapCounter_Triangles,
+	HeatmapCounter_StackDepth,
+	HeatmapCounter_Max
+};
+
+static const char* s_heatmapCounterNames[HeatmapCounter_Max] = { "nodes", "boxes", "triangles", "stack" };
+
+struct HeatmapJob
+{
+	const RayTracer*			rt;
+	Mat4f						invP;			// Clip space to world space
+	Vec2i						size;
+	std::vector<TraversalStats>	stats;			// Per pixel
+	std::vector<U8>				hits;			// Per pixel
+};
+
+static S32 heatmapCounter( const TraversalStats& s, int counter )
+{
+	switch ( counter )
+	{
+	case HeatmapCounter_Nodes:		return s.nodes;
+	case HeatmapCounter_Boxes:		return s.boxes;
+	case HeatmapCounter_Triangles:	return s.triangles;
+	default:						return s.stackDepth;
+	}
 }
 
-void Renderer::startPathTracingProcess( const MeshWithColors* scene, AreaLight* light, RayTracer* rt, Image* dest, int bounces, const CameraControls& camera )
+// Black through blue, cyan, green and yellow to red for x in [0, 1]
+static Vec3f heatColor( float x )
 {
+	static const Vec3f ramp[] = { Vec3f(0,0,0), Vec3f(0,0,1), Vec3f(0,1,1), Vec3f(0,1,0), Vec3f(1,1,0), Vec3f(1,0,0) };
+	const int last = sizeof(ramp) / sizeof(ramp[0]) - 1;
+	float f = FW::clamp( x, 0.0f, 1.0f ) * last;
+	int k = FW::min( (int)f, last - 1 );
+	return FW::lerp( ramp[k], ramp[k+1], f - k );
+}
+
+static void heatmapScanline( MulticoreLauncher::Task& t )
+{
+	HeatmapJob& job = *(HeatmapJob*)t.data;
+	const int j = t.idx;
+
+	for ( int i = 0; i < job.size.x; ++i )
+	{
+		float x = (i + 0.5f) * 2.0f / job.size.x - 1.0f;
+		float y = (j + 0.5f) * -2.0f / job.size.y + 1.0f;
+
+		Vec4f Roh = job.invP * Vec4f( x, y, 0.0f, 1.0f );
+		Vec4f Rdh = job.invP * Vec4f( x, y, 1.0f, 1.0f );
+		Vec3f Ro = (Roh/Roh.w).getXYZ();
+
+		int p = j * job.size.x + i;
+		job.hits[p] = job.rt->rayCastStats( Ray::segment( Ro, (Rdh/Rdh.w).getXYZ() - Ro ), job.stats[p] ).triangle != NULL;
+	}
+}
+
+void Renderer::renderTraversalHeatmaps( const RayTracer* rt, const CameraControls& camera, const Vec2i& size, const String& prefix )
+{
+	HeatmapJob job;
+	job.rt = rt;
+	job.size = size;
+	job.invP = (Mat4f::fitToView(Vec2f(-1,-1), Vec2f(2,2), size) * camera.getCameraToClip() * camera.getWorldToCamera()).inverted();
+	job.stats.resize( size.x * size.y );
+	job.hits.resize( size.x * size.y );
+
+	Timer timer;
+	timer.start();
+	MulticoreLauncher launcher;
+	launcher.setNumThreads( launcher.getNumCores() );
+	launcher.push( heatmapScanline, &job, 0, size.y );
+	launcher.popAll();
+	float secs = timer.getElapsed();
+
+	// Per frame aggregates
+	const int numRays = size.x * size.y;
+	S64 sum[HeatmapCounter_Max] = { 0 };
+	S32 peak[HeatmapCounter_Max] = { 0 };
+	int numHits = 0;
+	for ( int p = 0; p < numRays; ++p )
+	{
+		for ( int k = 0; k < HeatmapCounter_Max; ++k )
+		{
+			S32 c = heatmapCounter( job.stats[p], k );
+			sum[k] += c;
+			peak[k] = FW::max( peak[k], c );
+		}
+		numHits += job.hits[p];
+	}
+
+	::printf( "Traversal heatmaps, %s traversal, %dx%d camera rays, %d hits, %.4f secs (%.2f Mrays/s with counting):\n",
+		RayTracer::getTraversalModeName( RayTracer::getTraversalMode() ), size.x, size.y, numHits, secs, numRays / FW::max(secs, 1e-6f) * 1e-6f );
+
+	Image heatmap( size, ImageFormat::RGB_Vec3f );
+	for ( int k = 0; k < HeatmapCounter_Max; ++k )
+	{
+		float scale = 1.0f / FW::max( peak[k], 1 );
+		for ( int j = 0; j < size.y; ++j )
+		for ( int i = 0; i < size.x; ++i )
+			heatmap.setVec4f( Vec2i(i,j), Vec4f( heatColor( heatmapCounter( job.stats[j * size.x + i], k ) * scale ), 1.0f ) );
+
+		String fileName = prefix + "_" + s_heatmapCounterNames[k] + ".pfm";
+		File outfile( fileName, File::Create );
+		exportPfmImage( outfile, &heatmap );
+
+		::printf( "  %-10s mean %8.2f, max %6d -> %s\n", s_heatmapCounterNames[k], (double)sum[k] / FW::max(numRays, 1), peak[k], fileName.getPtr() );
+	}
+	::printf( "\n" );
+}
+
+void Renderer::writeErrorMap( const String& fileName ) const
+{
+	const AccumulationBuffer& accum = m_context.m_accum;
+	const Vec2i& size = accum.getSize();
+	if ( size.min() <= 0 )
+		return;
+
+	// Twice the target is red, pixels below the target stay in the blue half
+	Image errorMap( size, ImageFormat::RGB_Vec3f );
+	double sum = 0.0;
+	int numConverged = 0;
+	for ( int j = 0; j < size.y; ++j )
+	for ( int i = 0; i < size.x; ++i )
+	{
+		float e = accum.relativeError( i, j );
+		errorMap.setVec4f( Vec2i(i,j), Vec4f( heatColor( e / (2.0f * adaptiveTarget) ), 1.0f ) );
+		sum += FW::min( e, 1.0f );
+		numConverged += e <= adaptiveTarget;
+	}
+
+	File outfile( fileName, File::Create );
+	exportPfmImage( outfile, &errorMap );
+
+	const int numPixels = size.x * size.y;
+	::printf( "Relative error after %d passes: mean %.4f (clamped to 1), %.1f%% of the pixels below %.4f -> %s\n",
+		m_context.m_pass, sum / numPixels, 100.0f * numConverged / numPixels, adaptiveTarget, fileName.getPtr() );
+}
+
+void Renderer::startPathTracingProcess( const MeshWithColors* scene, AreaLight* light, RayTracer* rt, Image* dest, int bounces, const CameraControls& camera, bool wavefront )
+{
+	// A stopped wavefront pass may still be winding down
+	if ( m_wavefrontPending )
+	{
+		m_wavefrontThread->join();
+		m_wavefrontPending = false;
+	}
+
 	FW_ASSERT( !m_context.m_bForceExit );
 
-	// HAXXXXX
-	randomseeds.clear();
-	for (int i = 0; i < dest->getSize().y; ++i) {
-		randomseeds.push_back(std::vector<int>());
-		for (int j = 0; j < dest->getSize().x; ++j)
-			randomseeds[i].push_back(m_rand.getU32()%100000);
+	// HAXXXXX, kept over restarts at the same size
+	if ( (int)randomseeds.size() != dest->getSize().y || (int)randomseeds[0].size() != dest->getSize().x )
+	{
+		randomseeds.clear();
+		for (int i = 0; i < dest->getSize().y; ++i) {
+			randomseeds.push_back(std::vector<int>());
+			for (int j = 0; j < dest->getSize().x; ++j)
+				randomseeds[i].push_back(m_rand.getU32()%100000);
+		}
 	}
 
 	// Delete the old context member variables
-	delete m_context.m_image;
-	delete m_context.m_coarseImage;
+	bool wasWavefront = m_context.m_wavefront != NULL;
+	delete m_context.m_wavefront;
+	m_context.m_wavefront = NULL;
 
 	for (int i = 0; i < m_context.m_sequences.size(); ++i)
 		delete m_context.m_sequences[i];
 	m_context.m_sequences.clear();
 
+	// The speed measured so far still sizes the batches of a restart in the same scene and mode
+	if ( scene != m_context.m_scene || rt != m_context.m_rt || bounces != m_context.m_bounces || dest->getSize() != m_context.m_accum.getSize() || wavefront != wasWavefront )
+		m_pathsPerSecond = 0.0f;
+
 	m_context.m_bForceExit = false;
 	m_context.m_bResidual = false;
 	m_context.m_camera = &camera;
@@ -289,59 +886,269 @@ void Renderer::startPathTracingProcess( const MeshWithColors* scene, AreaLight*
 	m_context.m_light = light;
 	m_context.m_pass = 0;
 	m_context.m_bounces = bounces;
-	m_context.m_image = new Image( dest->getSize(), ImageFormat::RGBA_Vec4f );
-	m_context.m_coarseImage = new Image( dest->getSize(), ImageFormat::RGBA_Vec4f );
+	m_context.m_accum.reset( dest->getSize() );
 	
 	m_context.m_rr = bounces < 0 ? true : false;
 	m_context.m_invPI = 1.0f/FW_PI;
-	m_context.m_xCoordMapping = 1.0f / m_context.m_image->getSize().x *  2.0f;
-	m_context.m_yCoordMapping = 1.0f / m_context.m_image->getSize().y *  -2.0f;
+	m_context.m_xCoordMapping = 1.0f / dest->getSize().x *  2.0f;
+	m_context.m_yCoordMapping = 1.0f / dest->getSize().y *  -2.0f;
 
 	m_context.m_destImage = dest;
-	m_context.m_image->clear();
-	m_context.m_coarseImage->clear();
 
-	// Create new sequences
-	for (int i = 0; i < dest->getSize().y; ++i)
+	// Tiles in Hilbert order
+	m_context.m_tileSize = tileSize;
+	hilbertTiles( dest->getSize(), m_context.m_tileSize, m_context.m_tiles );
+
+	// Create new sequences, one per tile
+	for (int i = 0; i < (int)m_context.m_tiles.size(); ++i)
 		m_context.m_sequences.push_back(Sampler::getSequenceInstance());
 
-	dest->clear();
+	// All tiles are traced until the warm-up is over. The wavefront passes
+	// always go over every pixel.
+	m_context.m_adaptive = adaptive && !wavefront;
+	m_context.m_tileError.assign( m_context.m_tiles.size(), FLT_MAX );
+	m_context.m_activeTiles.clear();
+	for (int i = 0; i < (int)m_context.m_tiles.size(); ++i)
+		m_context.m_activeTiles.push_back(i);
+
+	// The preview passes cover dest before the first full pass, until then it
+	// shows what was there before, e.g. the image before a camera move
+	m_context.m_previewStep = preview && !wavefront ? PREVIEW_STEP : 1;
+	if ( m_context.m_previewStep == 1 )
+		dest->clear();
+
+	// The tasks resolve their pixels straight into dest, which stays on the CPU.
+	// Fetching the pointer here keeps them off the Buffer bookkeeping.
+	FW_ASSERT( dest->getFormat().getID() == ImageFormat::RGBA_Vec4f );
+	m_context.m_display = (Vec4f*)dest->getMutablePtr();
+	m_context.m_displayStride = (int)(dest->getStride() / sizeof(Vec4f));
+
+	// The wavefront passes take the pixels in the same tiles and 4x4 blocks as pathTraceTile
+	if ( wavefront )
+	{
+		int width = dest->getSize().x;
+		int height = dest->getSize().y;
+		const int packetWidth = RayTracer::PacketSize / PACKET_ROWS;
+
+		m_context.m_wavefront = new Wavefront( width * height );
+		for ( int t = 0; t < (int)m_context.m_tiles.size(); ++t )
+		{
+			const Vec2i tile = m_context.m_tiles[t];
+			const int tileRight = FW::min( tile.x + m_context.m_tileSize, width );
+			const int tileBottom = FW::min( tile.y + m_context.m_tileSize, height );
+			for ( int j0 = tile.y; j0 < tileBottom; j0 += PACKET_ROWS )
+			for ( int i0 = tile.x; i0 < tileRight; i0 += packetWidth )
+			for ( int j = j0; j < FW::min( j0 + PACKET_ROWS, tileBottom ); ++j )
+			for ( int i = i0; i < FW::min( i0 + packetWidth, tileRight ); ++i )
+				m_context.m_wavefront->pixels.push_back( j * width + i );
+		}
+	}
 
 	// Print statistics
-	::printf("Path tracing started.\nSequence mode...: %s\nIndirect bounces: %d\nRussian roulette: %s\n\n", 
-		     Sampler::getSequenceInstanceStr(), FW::abs(m_context.m_bounces), m_context.m_rr ? "Enabled" : "Disabled");
+	::printf("Path tracing started.\nSequence mode...: %s\nIndirect bounces: %d\nRussian roulette: %s\nMode............: %s\nTiles...........: %d of %dx%d, Hilbert order\n", 
+		     Sampler::getSequenceInstanceStr(), FW::abs(m_context.m_bounces), m_context.m_rr ? "Enabled" : "Disabled", wavefront ? "Wavefront" : "Scanline",
+			 (int)m_context.m_tiles.size(), m_context.m_tileSize, m_context.m_tileSize);
+	if ( m_context.m_adaptive )
+		::printf("Adaptive........: %.4f relative error after %d passes\n", adaptiveTarget, adaptiveWarmup);
+	else
+		::printf("Adaptive........: Disabled\n");
+	if ( !wavefront && targetBatchTime > 0.0f )
+		::printf("Updates.........: Batches of about %.2f secs\n", targetBatchTime);
+	else
+		::printf("Updates.........: Whole passes\n");
+	if ( m_context.m_previewStep > 1 )
+		::printf("Preview.........: 1/%d of the pixels, then 1/%d\n\n", PREVIEW_STEP * PREVIEW_STEP, PREVIEW_STEP * PREVIEW_STEP / 4);
+	else
+		::printf("Preview.........: Disabled\n\n");
 
 	// fire away!
-	m_launcher.setNumThreads( m_launcher.getNumCores() );	// the solution exe is multithreaded
+	m_launcher.setNumThreads( getNumThreads() );	// the solution exe is multithreaded
 	m_launcher.popAll();
-	m_launcher.push( pathTraceScanline, &m_context, 0, dest->getSize().y );
+	if ( wavefront )
+	{
+		if ( !m_wavefrontThread )
+			m_wavefrontThread = new Thread;
+		m_wavefrontThread->start( wavefrontPass, &m_context );
+		m_wavefrontPending = true;
+	}
 	
 	m_totalTime = 0.0f;
 	m_passTimer.start();
+
+	if ( !wavefront )
+	{
+		startTilePass();
+		pushTileBatch();
+	}
 }
 
-void Renderer::updatePicture( Image* dest )
+void Renderer::restartPathTracingProcess( void )
+{
+	if ( !m_context.m_scene )
+		return;
+
+	stopAndWait();
+	startPathTracingProcess( m_context.m_scene, m_context.m_light, m_context.m_rt, m_context.m_destImage, m_context.m_bounces, *m_context.m_camera, m_context.m_wavefront != NULL );
+}
+
+void Renderer::stopAndWait( void )
+{
+	// Let the running tasks see the exit flag and return
+	m_context.m_bForceExit = true;
+	while( m_launcher.getNumTasks() > m_launcher.getNumFinished() )
+		Sleep( 1 );
+	m_launcher.popAll();
+	if ( m_wavefrontPending )
+	{
+		m_wavefrontThread->join();
+		m_wavefrontPending = false;
+	}
+	m_context.m_bForceExit = false;
+}
+
+void Renderer::startTilePass( void )
 {
-	FW_ASSERT( m_context.m_image != 0 );
-	FW_ASSERT( m_context.m_image->getSize() == dest->getSize() );
-	for ( int i = 0; i < dest->getSize().y; ++i )
-		for ( int j = 0; j < dest->getSize().x; ++j )
+	interleaveTiles( m_context.m_activeTiles, getNumThreads(), m_context.m_passOrder );
+	m_context.m_batchStart = 0;
+	m_context.m_batchSize = 0;
+	m_numBatches = 0;
+	m_passTime = 0.0f;
+}
+
+void Renderer::pushTileBatch( void )
+{
+	const int group = getNumThreads();
+	const int remaining = (int)m_context.m_passOrder.size() - m_context.m_batchStart;
+
+	// The first batch, a tile per thread, measures the speed
+	int n = remaining;
+	if ( targetBatchTime > 0.0f )
+	{
+		n = group;
+		if ( m_pathsPerSecond > 0.0f )
 		{
-			Vec4f D = m_context.m_image->getVec4f(Vec2i(j,i));
-			if ( D.w != 0.0f )
-				D = D*(1.0f/D.w);
-			dest->setVec4f( Vec2i(j,i), D + m_context.m_coarseImage->getVec4f(Vec2i(j,i)) );
+			float tilePixels = (float)(m_context.m_tileSize * m_context.m_tileSize) / (m_context.m_previewStep * m_context.m_previewStep);
+			n = (int)(targetBatchTime * m_pathsPerSecond / tilePixels);
+			n = FW::max( (n + group - 1) / group * group, group );
 		}
+	}
+	m_context.m_batchSize = FW::min( n, remaining );
+
+	m_launcher.setNumThreads( getNumThreads() );	// the solution exe is multithreaded
+	m_launcher.popAll();
+	m_launcher.push( pathTraceTile, &m_context, m_context.m_batchStart, m_context.m_batchSize );
+	m_passTimer.start();
+	++m_numBatches;
+}
+
+void Renderer::updatePicture( Image* dest )
+{
+	// The tasks have already written their finished tiles and chunks to dest,
+	// only make sure the next draw uploads it from the CPU again
+	FW_ASSERT( dest == m_context.m_destImage );
+	FW_ASSERT( m_context.m_accum.getSize() == dest->getSize() );
+	dest->getMutablePtr();
 }
 
 void Renderer::checkFinish()
 {
-	// have all the vertices from current bounce finished computing?
+	// a wavefront pass runs on its own thread, wait until that is done
+	if ( m_context.m_wavefront )
+	{
+		if ( !m_wavefrontPending || m_wavefrontThread->isAlive() )
+			return;
+
+		m_wavefrontThread->join();
+		m_wavefrontPending = false;
+
+		++m_context.m_pass;
+
+		if ( !m_context.m_bForceExit )
+		{
+			const Wavefront& wf = *m_context.m_wavefront;
+
+			// A pass traces a path per pixel, averaged with the earlier passes like the batches
+			float elapsed = m_passTimer.getElapsed();
+			if ( elapsed > 0.0f )
+			{
+				float pathsPerSecond = wf.paths.size() / elapsed;
+				m_pathsPerSecond = m_pathsPerSecond > 0.0f ? 0.5f * (m_pathsPerSecond + pathsPerSecond) : pathsPerSecond;
+			}
+
+			::printf( "Pass %d done, time used for pass: %.4f secs, %.2fM paths/s\n", m_context.m_pass, elapsed, m_pathsPerSecond * 1.0e-6f );
+			::printf( "  %d bounces, %.2fM extension rays, %.2fM shadow rays\n ", wf.bounce, wf.numExtensionRays * 1.0e-6f, wf.numShadowRays * 1.0e-6f );
+			for ( int i = 0; i < WavefrontStage_Max; ++i )
+				::printf( " %s %.4f", s_wavefrontStageNames[i], wf.stageTime[i] );
+			::printf( " secs\n" );
+
+			m_totalTime += elapsed;
+			if ( passLimit > 0 && m_context.m_pass >= passLimit )
+			{
+				::printf( "\nPass limit of %d reached, %.4f secs\n", passLimit, m_totalTime );
+				return;
+			}
+
+			// keep going
+			m_passTimer.start();
+			m_wavefrontThread->start( wavefrontPass, &m_context );
+			m_wavefrontPending = true;
+		}
+		else
+			::printf( "Stopped.\n" );
+		return;
+	}
+
+	// have all the tiles of the current batch finished computing?
 	if ( m_launcher.getNumTasks() == m_launcher.getNumFinished() )
 	{
 		// yes, remove from task list
 		m_launcher.popAll();
 
+		if ( m_context.m_bForceExit )
+		{
+			::printf( "Stopped.\n" );
+			return;
+		}
+
+		// Paths per second of the batch, averaged with the earlier ones
+		float elapsed = m_passTimer.getElapsed();
+		m_totalTime += elapsed;
+		m_passTime += elapsed;
+
+		const Vec2i size = m_context.m_accum.getSize();
+		const int step = m_context.m_previewStep;
+		S64 numPaths = 0;
+		for ( int k = m_context.m_batchStart; k < m_context.m_batchStart + m_context.m_batchSize; ++k )
+		{
+			const Vec2i& tile = m_context.m_tiles[m_context.m_passOrder[k]];
+			int w = FW::min( m_context.m_tileSize, size.x - tile.x );
+			int h = FW::min( m_context.m_tileSize, size.y - tile.y );
+			numPaths += ((w + step - 1) / step) * ((h + step - 1) / step);
+		}
+		if ( elapsed > 0.0f )
+		{
+			float pathsPerSecond = numPaths / elapsed;
+			m_pathsPerSecond = m_pathsPerSecond > 0.0f ? 0.5f * (m_pathsPerSecond + pathsPerSecond) : pathsPerSecond;
+		}
+
+		// The rest of the pass
+		m_context.m_batchStart += m_context.m_batchSize;
+		if ( m_context.m_batchStart < (int)m_context.m_passOrder.size() )
+		{
+			pushTileBatch();
+			return;
+		}
+
+		// On to the next finer preview, or the first full pass
+		if ( step > 1 )
+		{
+			::printf( "Preview at 1/%d of the pixels done, %.4f secs after the start\n", step * step, m_totalTime );
+			m_context.m_previewStep /= 2;
+			startTilePass();
+			pushTileBatch();
+			return;
+		}
+
 		++m_context.m_pass;
 
 		// you may want to uncomment this to write out a sequence of PNG images
@@ -350,18 +1157,36 @@ void Renderer::checkFinish()
 		//File outfile( fn, File::Create );
 		//exportLodePngImage( outfile, m_context.m_destImage );
 
-		if ( !m_context.m_bForceExit )
+		::printf( "Pass %d done, time used for pass: %.4f secs, %d batches, %.2fM paths/s", m_context.m_pass, m_passTime, m_numBatches, m_pathsPerSecond * 1.0e-6f );
+
+		// Drop the tiles that have reached the target error
+		if ( m_context.m_adaptive && m_context.m_pass >= adaptiveWarmup )
 		{
-			// keep going
-			m_launcher.setNumThreads( m_launcher.getNumCores() );	// the solution exe is multithreaded
-			m_launcher.popAll();
-			m_launcher.push( pathTraceScanline, &m_context, 0, m_context.m_image->getSize().y );
-			::printf( "Pass %d done, time used for pass: %.4f secs\n", m_context.m_pass, m_passTimer.getElapsed() );
-			m_totalTime += m_passTimer.getElapsed();
-			m_passTimer.start();
+			int numTraced = (int)m_context.m_activeTiles.size();
+			m_context.m_activeTiles.clear();
+			for ( int i = 0; i < (int)m_context.m_tiles.size(); ++i )
+				if ( m_context.m_tileError[i] > adaptiveTarget )
+					m_context.m_activeTiles.push_back( i );
+			::printf( ", %d of %d tiles traced, %d left", numTraced, (int)m_context.m_tiles.size(), (int)m_context.m_activeTiles.size() );
 		}
-		else
-			::printf( "Stopped.\n" );
+		::printf( "\n" );
+
+		if ( m_context.m_activeTiles.empty() )
+		{
+			::printf( "\nAll tiles below %.4f relative error after %d passes, %.4f secs\n", adaptiveTarget, m_context.m_pass, m_totalTime );
+			writeErrorMap( "adaptive_error.pfm" );
+			return;
+		}
+
+		if ( passLimit > 0 && m_context.m_pass >= passLimit )
+		{
+			::printf( "\nPass limit of %d reached, %.4f secs\n", passLimit, m_totalTime );
+			return;
+		}
+
+		// keep going
+		startTilePass();
+		pushTileBatch();
 	}
 
 }
@@ -10,6 +10,7 @@
 
 #include "RayTracer.hpp"
 #include "AreaLight.hpp"
+#include "AccumulationBuffer.hpp"
 #include "TLSVariable.h"
 
 #define EPSILON 0.001f
@@ -27,6 +28,10 @@ class RayTracer;
 class RTTriangle;
 class Image;
 class Sequence;
+class Thread;
+struct Wavefront;
+struct PathState;
+struct ShadowRay;
 
 // This class contains functionality to render pictures using a ray tracer.
 class Renderer
@@ -36,14 +41,58 @@ public:
 			~Renderer();
 
 			// are we still processing?
-			bool				isRunning							( void ) const		{ return m_launcher.getNumTasks() > 0; }
+			bool				isRunning							( void ) const		{ return m_launcher.getNumTasks() > 0 || m_wavefrontPending; }
 
 			// negative #bounces = -N means start russian roulette from Nth bounce
 			// positive N means always trace up to N bounces
-			void				startPathTracingProcess				( const MeshWithColors* scene, AreaLight*, RayTracer* rt, Image* dest, int bounces, const CameraControls& camera );
-			static void			pathTraceScanline					( MulticoreLauncher::Task& t );
-			void				updatePicture						( Image* display );	// normalize by 1/w
+			// wavefront = true runs each pass as stages over all pixels, see wavefrontPass
+			void				startPathTracingProcess				( const MeshWithColors* scene, AreaLight*, RayTracer* rt, Image* dest, int bounces, const CameraControls& camera, bool wavefront = false );
+			void				restartPathTracingProcess			( void );	// same settings, e.g. after a camera move
+			void				stopAndWait							( void );	// returns once no task or wavefront pass is running
+			static void			pathTraceTile						( MulticoreLauncher::Task& t );
+			static void			wavefrontPass						( void* param );	// on m_wavefrontThread
+			static void			wavefrontStage						( MulticoreLauncher::Task& t );
+			void				updatePicture						( Image* display );	// the tasks resolve into display, this only flags it for upload
 			void				checkFinish							( void );
+
+			// Edge of the square tiles the passes are split into, taken when path
+			// tracing starts. Rounded up to a multiple of 4, the packets of camera
+			// rays are 4x4 pixel blocks.
+			static void			setTileSize							( int size )		{ Renderer::tileSize = FW::max( (size + 3) & ~3, 4 ); }
+			static int			getTileSize							( void )			{ return Renderer::tileSize; }
+
+			// Adaptive sampling of the scanline path tracer. After the warm-up
+			// passes only the tiles with a pixel whose relative error is above the
+			// target are traced again, and path tracing ends when none are left.
+			// Off unless enabled, so passes cover the whole image by default.
+			static void			setAdaptive							( bool enable )		{ Renderer::adaptive = enable; }
+			static bool			getAdaptive							( void )			{ return Renderer::adaptive; }
+			static void			setAdaptiveWarmup					( int passes )		{ Renderer::adaptiveWarmup = FW::max( passes, 2 ); }
+			static int			getAdaptiveWarmup					( void )			{ return Renderer::adaptiveWarmup; }
+			static void			setAdaptiveTarget					( float error )		{ Renderer::adaptiveTarget = FW::max( error, 1e-4f ); }
+			static float		getAdaptiveTarget					( void )			{ return Renderer::adaptiveTarget; }
+
+			// Seconds the scanline path tracer aims to spend on a batch of tiles
+			// before the next display update, 0 traces whole passes at once
+			static void			setTargetBatchTime					( float secs )		{ Renderer::targetBatchTime = FW::max( secs, 0.0f ); }
+			static float		getTargetBatchTime					( void )			{ return Renderer::targetBatchTime; }
+
+			// Coarse preview passes of the scanline path tracer before the first
+			// full pass, at 1/16 and 1/4 of the pixels with each sample filling its block
+			static void			setPreview							( bool enable )		{ Renderer::preview = enable; }
+			static bool			getPreview							( void )			{ return Renderer::preview; }
+
+			// Threads path tracing runs on, 0 for a thread per core
+			static void			setNumThreads						( int n )			{ Renderer::numThreads = FW::max( n, 0 ); }
+			static int			getNumThreads						( void )			{ return Renderer::numThreads > 0 ? Renderer::numThreads : MulticoreLauncher::getNumCores(); }
+
+			// Path tracing ends after this many full passes, 0 runs until stopped
+			static void			setPassLimit						( int passes )		{ Renderer::passLimit = FW::max( passes, 0 ); }
+			static int			getPassLimit						( void )			{ return Renderer::passLimit; }
+
+			int					getNumPasses						( void ) const		{ return m_context.m_pass; }
+			float				getTotalTime						( void ) const		{ return m_totalTime; }
+			float				getPathsPerSecond					( void ) const		{ return m_pathsPerSecond; }
 			
 			void				stop								( void )			
 			{ 
@@ -52,7 +101,17 @@ public:
 				m_context.m_bForceExit = true; 
 			}
 
-			static Vec3f		albedo								( const MeshWithColors* mesh, const Vec3i& indices, const RTToMesh* map, const Vec3f& barys );
+			// Casts a camera ray per pixel of an image of the given size with the
+			// counting traversal and writes false colour heatmaps of the nodes
+			// visited, boxes and triangles tested and stack depth per ray to
+			// <prefix>_nodes.pfm, _boxes.pfm, _triangles.pfm and _stack.pfm, and
+			// prints the mean and maximum of each over the frame
+			void				renderTraversalHeatmaps				( const RayTracer* rt, const CameraControls& camera, const Vec2i& size, const String& prefix );
+
+			// Writes the relative error of each pixel of the path traced image as
+			// a false colour image, red at twice the adaptive sampling target, and
+			// prints the mean error and the share of pixels below the target
+			void				writeErrorMap						( const String& fileName ) const;
 
 
 protected:
@@ -60,8 +119,16 @@ protected:
 			// to the given RTTriangle, and interpolates them using the barycentrics a and b.
 			Vec4f				interpolateAttribute				( const RTTriangle* tri, float a, float b, const MeshBase* mesh, int attribidx );
 
-			__forceinline static Vec3f getDirectContribution(const AreaLight* light, int idx, const Vec3f& origin, 
-												 const Vec3f& normal, const RayTracer* rt, Sequence* s)
+			// A pass of the scanline path tracer goes over m_activeTiles in batches,
+			// each sized by the paths per second measured so far
+			void				startTilePass						( void );
+			void				pushTileBatch						( void );
+
+			// Draws a sample on the light as seen from origin. Returns false if the
+			// sample faces away from origin. Otherwise the light is visible if nothing
+			// blocks shadowDir from origin + EPSILON*normal, and then contributes E.
+			__forceinline static bool sampleDirectContribution(const AreaLight* light, int idx, const Vec3f& origin, 
+												 const Vec3f& normal, Sequence* s, Vec3f& shadowDir, Vec3f& E)
 			{
 				// Draw a sample on light source
 				float pdf;
@@ -75,19 +142,14 @@ protected:
 				// Calculate the lamp cosine term and check whether we're at the back of the lamp
 				float cosl = FW::clamp(FW::dot(light->getNormal(), -vl_normalized), 0.0f, 1.0f);
 				if (cosl == 0.0f) 
-					return Vec3f(0.0f);
-
-				// Trace shadow ray to see if it's blocked
-				if (!rt->rayCastShadow(origin + EPSILON*normal, vl))
-				{
-					// If not, add the appropriate emission, 1/r^2 and clamped cosine terms, accounting for the PDF as well.
-					// accumulate into E
-					float cosv = FW::clamp(FW::dot(vl_normalized, normal), 0.0f, 1.0f);
-					float vl_length = vl.length();
-					return (light->getEmission() * (1.0f/(vl_length*vl_length)) * cosl * cosv) / pdf;
-				}
-
-				return Vec3f(0.0f);
+					return false;
+
+				// Add the appropriate emission, 1/r^2 and clamped cosine terms, accounting for the PDF as well.
+				float cosv = FW::clamp(FW::dot(vl_normalized, normal), 0.0f, 1.0f);
+				float vl_length = vl.length();
+				shadowDir = vl;
+				E = (light->getEmission() * (1.0f/(vl_length*vl_length)) * cosl * cosv) / pdf;
+				return true;
 			}
 
 public:
@@ -130,12 +192,15 @@ protected:
 	__int64						m_s64TotalRays;
 	float						m_raysPerSecond;
 
-	Timer						m_passTimer;
+	Timer						m_passTimer;		// Of the running batch
 	float						m_totalTime;
+	float						m_passTime;			// Of the batches of the running pass
+	float						m_pathsPerSecond;
+	int							m_numBatches;
 
 	struct PathTracerContext
 	{
-		PathTracerContext()			: m_bForceExit(false), m_bResidual(false), m_scene(0), m_pass(0), m_rt(0), m_image(0), m_coarseImage(0), m_camera(0), m_bounces(0) { }
+		PathTracerContext()			: m_bForceExit(false), m_bResidual(false), m_scene(0), m_pass(0), m_rt(0), m_display(0), m_displayStride(0), m_camera(0), m_bounces(0), m_tileSize(0), m_adaptive(false), m_batchStart(0), m_batchSize(0), m_previewStep(1), m_wavefront(0) { }
 		bool						m_bForceExit;
 		bool						m_bResidual;
 		const MeshWithColors*		m_scene;
@@ -143,9 +208,10 @@ protected:
 		AreaLight*					m_light;
 		int							m_pass;
 		int							m_bounces;
-		Image*						m_image;
-		Image*						m_coarseImage;
+		AccumulationBuffer			m_accum;
 		Image*						m_destImage;
+		Vec4f*						m_display;			// Pixels of m_destImage
+		int							m_displayStride;	// in pixels
 		const CameraControls*		m_camera;
 		std::vector<Sequence*>		m_sequences;
 		
@@ -154,16 +220,38 @@ protected:
 		float						m_xCoordMapping;
 		float						m_yCoordMapping;
 
-		~PathTracerContext() 
-		{
-			for (int i = 0; i < m_sequences.size(); ++i)
-				delete m_sequences[i];
-		}
+		std::vector<Vec2i>			m_tiles;		// Upper left corners in Hilbert order, a task per tile
+		int							m_tileSize;
+		bool						m_adaptive;
+		std::vector<S32>			m_activeTiles;	// Tiles traced by the current pass, in Hilbert order
+		std::vector<S32>			m_passOrder;	// The same interleaved into batches, a task per tile
+		int							m_batchStart;	// First tile of the running batch in m_passOrder
+		int							m_batchSize;
+		int							m_previewStep;	// A pixel per step x step block is traced, 1 for full passes
+		std::vector<F32>			m_tileError;	// Largest relative error of a pixel, per tile
+		Wavefront*					m_wavefront;	// Path states of a wavefront pass, NULL in scanline mode
+
+		~PathTracerContext();
 	};
 
+	// One bounce of a path, shared by the tiles and the wavefront passes
+	static bool					shadePath			( const PathTracerContext& ctx, PathState& s, int path, int i, int j, Sequence* seq, ShadowRay& sr );
+
 	MulticoreLauncher			m_launcher;
 	PathTracerContext			m_context;
 
+	static int					tileSize;
+	static bool					adaptive;
+	static int					adaptiveWarmup;
+	static float				adaptiveTarget;
+	static float				targetBatchTime;
+	static bool					preview;
+	static int					numThreads;
+	static int					passLimit;
+
+	Thread*						m_wavefrontThread;
+	bool						m_wavefrontPending;		// A pass has been started and not yet joined
+
 };
 
 };	// namespace FW
\ No newline at end of file
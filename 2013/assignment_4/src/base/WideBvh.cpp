@@ -0,0 +1,142 @@
+#include "WideBvh.hpp"
+
+#include <vector>
+#include <cstring>
+#include <malloc.h>
+#include <intrin.h>
+#include <immintrin.h>
+
+// Alignment of the node array, nodes are whole cache lines
+#define WIDE_NODE_ALIGNMENT 64
+
+namespace FW
+{
+
+static __forceinline float flatNodeArea(const FlatNode& n)
+{
+	Vec3f d = n.bbMax - n.bbMin;
+	return 2.0f * (d.x*d.y + d.y*d.z + d.z*d.x);
+}
+
+// Collapses the binary tree top-down. Each wide node starts from the two
+// children of a binary node and repeatedly opens up the inner child with the
+// largest surface area, as that is the one most rays would descend into next,
+// until it has N children or only leaves are left.
+template <int N>
+WideBvh<N>::WideBvh(const Bvh& bvh) : m_nodes(NULL), m_numNodes(0), m_depth(0)
+{
+	struct StackEntry
+	{
+		int		flatIdx;	// Binary node whose subtree goes into the wide node
+		int		wideIdx;
+		int		depth;
+	};
+
+	const FlatNode* flat = bvh.getNodes();
+
+	WideNode<N> empty;
+	memset(&empty, 0, sizeof(empty));
+
+	std::vector<WideNode<N> > nodes;
+	nodes.reserve(bvh.getNumOfNodes() / (N - 1) + 1);
+	nodes.push_back(empty);
+
+	std::vector<StackEntry> stack;
+	StackEntry root = { 0, 0, 1 };
+	stack.push_back(root);
+
+	while (!stack.empty()) {
+		StackEntry e = stack.back();
+		stack.pop_back();
+		m_depth = FW::max(m_depth, e.depth);
+
+		// A leaf root becomes a single leaf child
+		int children[N];
+		int numChildren = 1;
+		children[0] = e.flatIdx;
+		if (!flat[e.flatIdx].isLeaf()) {
+			children[0] = e.flatIdx + 1;
+			children[1] = flat[e.flatIdx].rightChild;
+			numChildren = 2;
+		}
+
+		while (numChildren < N) {
+			int best = -1;
+			float bestArea = -1.0f;
+			for (int i = 0; i < numChildren; ++i) {
+				const FlatNode& c = flat[children[i]];
+				if (!c.isLeaf() && flatNodeArea(c) > bestArea) {
+					best = i;
+					bestArea = flatNodeArea(c);
+				}
+			}
+			if (best == -1)
+				break;
+
+			int opened = children[best];
+			children[best] = opened + 1;
+			children[numChildren++] = flat[opened].rightChild;
+		}
+
+		// Unused lanes get inverted bounds, the traversal masks them out anyway
+		WideNode<N> node = empty;
+		for (int i = 0; i < N; ++i) {
+			node.bbMinX[i] = node.bbMinY[i] = node.bbMinZ[i] = FLT_MAX;
+			node.bbMaxX[i] = node.bbMaxY[i] = node.bbMaxZ[i] = -FLT_MAX;
+			node.child[i] = -1;
+		}
+
+		node.numChildren = (U8)numChildren;
+		for (int i = 0; i < numChildren; ++i) {
+			const FlatNode& c = flat[children[i]];
+			node.bbMinX[i] = c.bbMin.x;
+			node.bbMinY[i] = c.bbMin.y;
+			node.bbMinZ[i] = c.bbMin.z;
+			node.bbMaxX[i] = c.bbMax.x;
+			node.bbMaxY[i] = c.bbMax.y;
+			node.bbMaxZ[i] = c.bbMax.z;
+
+			if (c.isLeaf()) {
+				node.child[i] = c.startPrim;
+				node.numPrims[i] = c.numPrims;
+				node.leafMask |= (U8)(1 << i);
+			} else {
+				node.child[i] = (S32)nodes.size();
+				nodes.push_back(empty);
+
+				StackEntry next = { children[i], node.child[i], e.depth + 1 };
+				stack.push_back(next);
+			}
+		}
+		nodes[e.wideIdx] = node;
+	}
+
+	m_numNodes = (int)nodes.size();
+	m_nodes = (WideNode<N>*)_aligned_malloc(nodes.size() * sizeof(WideNode<N>), WIDE_NODE_ALIGNMENT);
+	memcpy(m_nodes, &nodes[0], nodes.size() * sizeof(WideNode<N>));
+}
+
+template <int N>
+WideBvh<N>::~WideBvh(void)
+{
+	_aligned_free(m_nodes);
+}
+
+template class WideBvh<4>;
+template class WideBvh<8>;
+
+bool isAvxSupported(void)
+{
+	int info[4];
+	__cpuid(info, 1);
+
+	// AVX instructions, and XSAVE enabled by the OS for the YMM registers
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx)
+		return false;
+
+	return (_xgetbv(0) & 6) == 6;
+}
+
+}
\ No newline at end of file
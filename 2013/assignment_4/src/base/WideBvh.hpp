@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Bvh.hpp"
+
+namespace FW
+{
+
+// Node of a BVH with up to N children. The child bounds are stored one
+// coordinate per array, so a single SIMD slab test covers all children.
+// Inner children reference another node, leaf children a triangle range.
+template <int N>
+struct WideNode
+{
+	enum
+	{
+		DataSize	= 30 * N + 2,
+		Size		= (DataSize + 63) & ~63,	// Whole cache lines
+	};
+
+	F32						bbMinX[N];		// Child AABBs, one lane per child
+	F32						bbMinY[N];
+	F32						bbMinZ[N];
+	F32						bbMaxX[N];
+	F32						bbMaxY[N];
+	F32						bbMaxZ[N];
+
+	S32						child[N];		// Inner child: node index, leaf child: first triangle
+	U16						numPrims[N];	// Leaf child: number of triangles
+	U8						numChildren;	// Children are packed to the front
+	U8						leafMask;		// Bit i is set when child i is a leaf
+
+	U8						pad[Size - DataSize];
+
+	__forceinline bool		isLeaf		(int i) const	{ return ((leafMask >> i) & 1) != 0; }
+};
+
+static_assert(sizeof(WideNode<4>) == 128, "WideNode<4> must be 128 bytes");
+static_assert(sizeof(WideNode<8>) == 256, "WideNode<8> must be 256 bytes");
+
+
+// BVH with up to N children per node, collapsed from the binary tree of a
+// Bvh. N = 4 matches the SSE traversal kernel, N = 8 the AVX one. The leaves
+// reference the same triangle ranges as the binary tree.
+template <int N>
+class WideBvh
+{
+public:
+	WideBvh					(const Bvh& bvh);
+	~WideBvh				(void);
+
+	// The collapsed tree, the root is the first node
+	const WideNode<N>*		getNodes				(void) const	{ return m_nodes; }
+
+	int						getNumOfNodes			(void) const	{ return m_numNodes; }
+	int						getDepth				(void) const	{ return m_depth; }
+
+private:
+	WideNode<N>*			m_nodes;
+	int						m_numNodes;
+	int						m_depth;
+
+	WideBvh					(const WideBvh&);	// Not copyable
+	WideBvh&				operator=				(const WideBvh&);
+};
+
+// True when both the CPU and the OS support AVX, required by WideBvh<8>
+bool						isAvxSupported			(void);
+
+}
\ No newline at end of file
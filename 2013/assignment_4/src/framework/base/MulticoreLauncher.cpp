@@ -183,6 +183,16 @@ int MulticoreLauncher::getNumCores(void)
 
 //------------------------------------------------------------------------
 
+int MulticoreLauncher::getNumThreads(void)
+{
+    s_lock.enter();
+    int numThreads = (s_desiredThreads == -1) ? getNumCores() : s_desiredThreads;
+    s_lock.leave();
+    return numThreads;
+}
+
+//------------------------------------------------------------------------
+
 void MulticoreLauncher::setNumThreads(int numThreads)
 {
     FW_ASSERT(numThreads > 0);
@@ -115,6 +115,7 @@ public:
     void                    popAll              (const String& progressMessage);
 
     static int              getNumCores         (void);
+    static int              getNumThreads       (void);         // Threads the tasks run on, the cores unless set.
     static void             setNumThreads       (int numThreads);
 
 private: